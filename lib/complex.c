@@ -25,11 +25,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "boot.h"
 #include "fs.h"
 #include "table.h"
 #include "entry.h"
+#include "directory.h"
 #include "reference.h"
 #include "inverse.h"
 #include "complex.h"
@@ -50,9 +57,367 @@ int fatuflush(fat *f) {
 	return FATINTERRUPTIBLECHECK(uflush) ? -1 : 0;
 }
 
+/*
+ * clusters in use, the total for the progress of a walk over the filesystem;
+ * only counted if the progress is reported
+ */
+int64_t _fatprogressused(fat *f) {
+	if (! fatprogressactive(f))
+		return 0;
+	return fatlastcluster(f) - FAT_FIRST + 1 - fatclusternumfree(f);
+}
+
+/*
+ * journal of a long operation, to resume it after an interruption or a crash
+ * libllfat.txt: [Journal]
+ *
+ * a move is recorded in the journal before it is done; it is cleared only
+ * after the move is flushed and synced, so that at most one move is pending;
+ * when the journal is opened again, a pending move is completed if the
+ * reference already points to the destination and undone otherwise
+ *
+ * the checksum of the fat after each move is kept in the journal; an
+ * operation is resumed only if the fat still matches it
+ */
+
+char *fatjournalfile = NULL;
+
+#define FATJOURNALMAGIC "llfatjn1"
+
+#define FATJOURNALDEFRAGMENT	1
+#define FATJOURNALMOVEAREA	2
+#define FATJOURNALSELECTIVE	3
+#define FATJOURNALCOMPACT	4
+
+struct fatjournal {
+	char magic[8];			/* only when the operation started */
+	uint32_t operation;
+	uint32_t dirmoved;		/* first cluster of a directory moved */
+	int32_t last;			/* last cluster */
+	int32_t param[4];		/* parameters of the operation */
+	uint64_t geometry;		/* hash of boot parameters */
+	uint64_t checksum;		/* hash of the fat after the last move */
+	int32_t moves;			/* moves completed */
+
+	/* pending move, if num > 0 */
+	int32_t src;
+	int32_t dst;
+	int32_t num;
+	int32_t next;			/* next of the last cluster moved */
+	int32_t target;			/* planned destination of src */
+	int32_t refdirectory;		/* reference to src, 0 if in the fat */
+	int32_t refindex;
+	int32_t refprevious;
+	uint64_t after;			/* hash of the fat after the move */
+
+	char *filename;			/* not meaningful on file */
+	size_t size;
+	int resume;
+};
+
+/*
+ * the plan of a defragmentation follows the header
+ */
+int32_t *_fatjournalplan(struct fatjournal *j) {
+	return (int32_t *) (j + 1);
+}
+
+/*
+ * the entries of the fat that a move changes, with their values before and
+ * after it: each cluster of the source and of the destination, then the
+ * previous cluster if the reference is in the fat
+ */
+int _fatjournalcell(struct fatjournal *j, int k,
+		int32_t *cl, int32_t *before, int32_t *after) {
+	int i;
+
+	i = k / 2;
+	if (i < j->num) {
+		*cl = k % 2 ? j->dst + i : j->src + i;
+		*before = i < j->num - 1 ? j->src + i + 1 : j->next;
+		*after = i < j->num - 1 ? j->dst + i + 1 : j->next;
+		if (k % 2)
+			*before = FAT_UNUSED;
+		else
+			*after = FAT_UNUSED;
+		return 0;
+	}
+
+	if (k == 2 * j->num &&
+	    j->refdirectory == 0 && j->refprevious >= FAT_FIRST) {
+		*cl = j->refprevious;
+		*before = j->src;
+		*after = j->dst;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * the hash of the entries that a move changes, either before or after it
+ */
+uint64_t _fatjournalcells(struct fatjournal *j, int forward) {
+	uint64_t h;
+	int32_t cl, before, after;
+	int k;
+
+	h = 0;
+	for (k = 0; ! _fatjournalcell(j, k, &cl, &before, &after); k++)
+		h ^= fathashentry(cl, forward ? after : before);
+	return h;
+}
+
+/*
+ * save the journal to disk, after the filesystem
+ */
+int _fatjournalsync(fat *f, struct fatjournal *j) {
+	fatflush(f);
+	if (fsync(f->fd) == -1) {
+		perror("journal, fsync");
+		return -1;
+	}
+	return msync(j, j->size, MS_SYNC);
+}
+
+/*
+ * record a move, before doing it
+ */
+int _fatjournalbegin(fat *f, struct fatjournal *j,
+		int32_t src, int32_t dst, int num, int32_t target,
+		unit *directory, int index, int32_t previous) {
+	j->src = src;
+	j->dst = dst;
+	j->next = fatgetnextcluster(f, src + num - 1);
+	j->target = target;
+	j->refdirectory = directory == NULL ? 0 : directory->n;
+	j->refindex = index;
+	j->refprevious = previous;
+	j->num = num;
+	j->after = j->checksum ^
+		_fatjournalcells(j, 0) ^ _fatjournalcells(j, 1);
+	return msync(j, sizeof(struct fatjournal), MS_SYNC);
+}
+
+/*
+ * a move is done, or it failed and did not change anything
+ */
+int _fatjournalcommit(fat *f, struct fatjournal *j) {
+	j->checksum = j->after;
+	j->num = 0;
+	j->moves++;
+	return _fatjournalsync(f, j);
+}
+
+int _fatjournalcancel(struct fatjournal *j) {
+	j->num = 0;
+	return msync(j, sizeof(struct fatjournal), MS_SYNC);
+}
+
+/*
+ * the fat was changed outside of a move
+ */
+int _fatjournalchanged(fat *f, struct fatjournal *j) {
+	if (j == NULL)
+		return 0;
+	fatflush(f);
+	j->checksum = fathashtable(f);
+	return _fatjournalsync(f, j);
+}
+
+/*
+ * complete or undo the pending move; return 1 if the fat changed otherwise
+ * than by the move since it was recorded
+ */
+int _fatjournalresolve(fat *f, struct fatjournal *j) {
+	unit *directory;
+	int32_t target, *plan, cl, before, after, next;
+	uint64_t h;
+	int forward, i, k;
+
+	h = fathashtable(f);
+	for (k = 0; ! _fatjournalcell(j, k, &cl, &before, &after); k++) {
+		next = fatgetnextcluster(f, cl);
+		if (next != before && next != after)
+			return 1;
+		h ^= fathashentry(cl, next);
+	}
+	if (h != (j->checksum ^ _fatjournalcells(j, 0)))
+		return 1;
+
+	directory = NULL;
+	if (j->refdirectory != 0) {
+		directory = fatclusterread(f, j->refdirectory);
+		if (directory == NULL) {
+			printf("journal: cannot read cluster %d\n",
+				j->refdirectory);
+			return -1;
+		}
+	}
+	target = fatreferencegettarget(f,
+		directory, j->refindex, j->refprevious);
+	if (target != j->src && target != j->dst)
+		return 1;
+	forward = target == j->dst;
+
+	for (k = 0; ! _fatjournalcell(j, k, &cl, &before, &after); k++)
+		fatsetnextcluster(f, cl, forward ? after : before);
+	fatreferencesettarget(f, directory, j->refindex, j->refprevious,
+		forward ? j->dst : j->src);
+
+	if (j->operation == FATJOURNALDEFRAGMENT) {
+		plan = _fatjournalplan(j);
+		for (i = 0; i < j->num; i++) {
+			plan[j->src + i] = forward ? 0 : j->target + i;
+			plan[j->dst + i] =
+				! forward || j->target == j->dst ?
+					0 : j->target + i;
+		}
+	}
+
+	printf("journal: move of cluster %d to %d %s\n",
+		j->src, j->dst, forward ? "completed" : "undone");
+	if (forward) {
+		j->dirmoved = 1;
+		return _fatjournalcommit(f, j);
+	}
+	j->num = 0;
+	return _fatjournalsync(f, j);
+}
+
+/*
+ * open the journal of an operation; if it is for the same operation and it
+ * matches the filesystem, resume is set; otherwise the journal is emptied
+ */
+struct fatjournal *_fatjournalopen(fat *f, int operation, int32_t *param,
+		int planned) {
+	struct fatjournal saved, *j;
+	struct stat st;
+	size_t size;
+	int fd, res;
+
+	size = sizeof(struct fatjournal) +
+		(planned ? sizeof(int32_t) * (fatlastcluster(f) + 1) : 0);
+
+	fd = open(fatjournalfile, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		perror(fatjournalfile);
+		return NULL;
+	}
+
+	res = 0;
+	if (fstat(fd, &st) == -1 ||
+	    pread(fd, &saved, sizeof(saved), 0) != sizeof(saved) ||
+	    memcmp(saved.magic, FATJOURNALMAGIC, 8) ||
+	    saved.last != fatlastcluster(f) ||
+	    saved.geometry != fatgeometry(f))
+		saved.operation = 0;
+	else if (saved.num > 0) {
+		j = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+		if (j == MAP_FAILED) {
+			perror("journal, mmap");
+			close(fd);
+			return NULL;
+		}
+		j->size = st.st_size;
+		res = _fatjournalresolve(f, j);
+		memcpy(&saved, j, sizeof(saved));
+		munmap(j, j->size);
+		if (res == -1) {
+			close(fd);
+			return NULL;
+		}
+	}
+
+	if (saved.operation != 0 &&
+	    (res == 1 || saved.checksum != fathashtable(f))) {
+		printf("journal: filesystem changed since the journal ");
+		printf("was written, starting over\n");
+		saved.operation = 0;
+	}
+	if (saved.operation != 0 && ((size_t) st.st_size != size ||
+	    saved.operation != (uint32_t) operation ||
+	    memcmp(saved.param, param, sizeof(saved.param)))) {
+		printf("journal: it is for another operation, ");
+		printf("starting over\n");
+		saved.operation = 0;
+	}
+
+	if (saved.operation == 0 &&
+	    (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)) {
+		perror("journal creation");
+		close(fd);
+		return NULL;
+	}
+
+	j = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (j == MAP_FAILED) {
+		perror("journal, mmap");
+		return NULL;
+	}
+
+	j->filename = fatjournalfile;
+	j->size = size;
+	j->resume = saved.operation != 0;
+	if (j->resume)
+		printf("journal: resuming after %d moves\n", j->moves);
+	else {
+		j->operation = operation;
+		memcpy(j->param, param, sizeof(j->param));
+	}
+	return j;
+}
+
+/*
+ * the operation is planned and about to start moving clusters
+ */
+int _fatjournalstart(fat *f, struct fatjournal *j) {
+	if (j->resume)
+		return 0;
+	fatflush(f);
+	j->last = fatlastcluster(f);
+	j->geometry = fatgeometry(f);
+	j->checksum = fathashtable(f);
+	j->moves = 0;
+	j->num = 0;
+	memcpy(j->magic, FATJOURNALMAGIC, 8);
+	return _fatjournalsync(f, j);
+}
+
+/*
+ * close the journal; it is deleted when the operation is complete
+ */
+int _fatjournalclose(fat *f, struct fatjournal *j, int complete) {
+	char *filename;
+
+	if (j == NULL)
+		return 0;
+
+	filename = j->filename;
+	if (memcmp(j->magic, FATJOURNALMAGIC, 8))
+		complete = 1;
+	_fatjournalsync(f, j);
+	munmap(j, j->size);
+	if (complete)
+		return unlink(filename);
+	printf("journal: operation not completed, ");
+	printf("run it again to resume from %s\n", filename);
+	return 0;
+}
+
+/*
+ * longest run of consecutive clusters moved by a single read and write
+ */
+#define FATMOVERUN 256
+
 /*
  * move the clusters in an area to another, in cluster reference order
  * libllfat.txt: [Cluster reference order]
+ *
+ * the clusters that follow the target in its chain and can go just after the
+ * destination are moved together with it
  */
 
 FATINTERRUPTIBLEGLOBAL(movearea);
@@ -68,6 +433,9 @@ struct moveareastruct {
 
 	/* first cluster of a directory moved? */
 	int dirmoved;
+
+	/* journal, if any */
+	struct fatjournal *journal;
 };
 
 int _fatmovearea(fat *f,
@@ -77,6 +445,7 @@ int _fatmovearea(fat *f,
 		int direction, void *user) {
 	int32_t cl, target, dest;
 	struct moveareastruct *s;
+	int num, i, res;
 
 	if (FATINTERRUPTIBLECHECK(movearea))
 		return 0;
@@ -87,12 +456,14 @@ int _fatmovearea(fat *f,
 	target = fatreferencegettarget(f, directory, index, previous);
 	if (target < FAT_FIRST)
 		return FAT_REFERENCE_NORMAL;
+	fatprogressstep(f, 1, 0);
+	s = (struct moveareastruct *) user;
 	if (fatgetnextcluster(f, target) == FAT_BAD) {
 		fatreferencesettarget(f, directory, index, previous, FAT_EOF);
+		_fatjournalchanged(f, s->journal);
 		return 0;
 	}
 
-	s = (struct moveareastruct *) user;
 	if (fatcomplexdebug)
 		FATEXECUTEDEBUG
 
@@ -117,10 +488,25 @@ int _fatmovearea(fat *f,
 
 				/* move target of reference to free cluster */
 
+	num = fatclusterrunlength(f, target, dest, FATMOVERUN);
+	while (num > 1 &&
+	       (! fatclusterisbetween(target + num - 1, s->srcbegin, s->srcend) ||
+	        ! fatclusterisbetween(dest + num - 1, s->dstbegin, s->dstend)))
+		num--;
+
 	if (fatcomplexdebug)
 		fatreferenceprint(directory, index, previous);
-	dprintf(" %d -> %d = ", target, dest);
-	if (fatclustermove(f, directory, index, previous, dest, 1) < -1) {
+	dprintf(" %d -> %d", target, dest);
+	if (num > 1)
+		dprintf(" (%d clusters)", num);
+	dprintf(" = ");
+	if (s->journal != NULL)
+		_fatjournalbegin(f, s->journal, target, dest, num, dest,
+			directory, index, previous);
+	res = fatclustermoverun(f, directory, index, previous, dest, num, 1);
+	if (s->journal != NULL && res != 0)
+		_fatjournalcancel(s->journal);
+	if (res < -1) {
 		printf("IO error reading cluster %d\n", target);
 		FATINTERRUPTIBLEABORT(movearea, FATINTERRUPTIBLEIOERROR);
 		return 0;
@@ -129,13 +515,21 @@ int _fatmovearea(fat *f,
 		fatreferencegettarget(f, directory, index, previous));
 	dprintf("\n");
 
-				/* delete cluseter from cache to save memory */
+				/* delete clusters from cache to save memory */
 
-	fatunitdelete(&f->clusters, dest);
+	for (i = 0; i < num; i++)
+		fatunitdelete(&f->clusters, dest + i);
 
 	if (fatreferenceisdirectory(directory, index, previous))
 		s->dirmoved = 1;
 
+	if (res == 0)
+		fatprogressstep(f, 0, (uint64_t) num *
+			fatgetbytespersector(f) * fatgetsectorspercluster(f));
+
+	if (s->journal != NULL && res == 0)
+		_fatjournalcommit(f, s->journal);
+
 	return FAT_REFERENCE_NORMAL;
 }
 
@@ -143,6 +537,7 @@ int fatmovearea(fat *f,
 		int32_t srcbegin, int32_t srcend,
 		int32_t dstbegin, int32_t dstend) {
 	struct moveareastruct s;
+	int32_t param[4];
 	int res;
 
 	s.srcbegin = srcbegin;
@@ -151,26 +546,214 @@ int fatmovearea(fat *f,
 	s.dstend = dstend;
 	s.dirmoved = 0;
 
+	s.journal = NULL;
+	if (fatjournalfile != NULL) {
+		param[0] = srcbegin;
+		param[1] = srcend;
+		param[2] = dstbegin;
+		param[3] = dstend;
+		s.journal = _fatjournalopen(f, FATJOURNALMOVEAREA, param, 0);
+		if (s.journal == NULL)
+			return -1;
+		_fatjournalstart(f, s.journal);
+	}
+
 	f->last = dstbegin;
 
 	FATINTERRUPTIBLEINIT(movearea);
 
+	fatprogressbegin(f, "move area", _fatprogressused(f));
 	res = fatreferenceexecute(f, NULL, 0, -1, _fatmovearea, &s);
+	fatprogressend(f);
 
 	if (FATINTERRUPTIBLECHECK(movearea) && s.dirmoved)
 		fatfixdot(f);
 
 	fatflush(f);
+	_fatjournalclose(f, s.journal,
+		res == 0 && ! FATINTERRUPTIBLECHECK(movearea));
 	FATINTERRUPTIBLEFINISH(movearea);
 	return res;
 }
 
 /*
  * compact a filesystem by moving cluster at the beginning
+ *
+ * two cursors cross the fat from its ends until they meet: high goes down over
+ * the clusters in use, low goes up over the free ones; the run of clusters at
+ * high that are consecutive in their chain is moved to the run of free
+ * clusters at low, as much of it as fits, taken from its end at high so that
+ * its other clusters stay where they are; references are changed through the
+ * inverse fat, so that the filesystem is not walked; every cluster is moved at
+ * most once, and the clusters moved are exactly the ones in use over the
+ * final boundary
+ *
+ * the clusters in use that no file refers to and the bad ones are not moved
  */
+
+FATINTERRUPTIBLEGLOBAL(compact);
+
+struct compactstruct {
+	fatinverse *rev;
+	int32_t low;		/* first free cluster not yet filled */
+	int32_t high;		/* last cluster that may be moved */
+	int dirmoved;
+	struct fatjournal *journal;
+};
+
+int _fatcompactmovable(fat *f, struct compactstruct *c, int32_t cl) {
+	int32_t next;
+
+	next = fatgetnextcluster(f, cl);
+	return next != FAT_UNUSED && next != FAT_BAD &&
+		! fatinverseisvoid(c->rev, cl);
+}
+
+/*
+ * advance the two cursors to the next free cluster and the previous cluster
+ * to move; return 0 when they meet
+ */
+int _fatcompactnext(fat *f, struct compactstruct *c) {
+	while (c->low < c->high &&
+	       fatgetnextcluster(f, c->low) != FAT_UNUSED)
+		c->low++;
+	while (c->low < c->high && ! _fatcompactmovable(f, c, c->high))
+		c->high--;
+	return c->low < c->high;
+}
+
+/*
+ * number of clusters to move, without moving them
+ */
+int32_t _fatcompactcount(fat *f, struct compactstruct *c) {
+	int32_t low, high, count;
+
+	low = c->low;
+	high = c->high;
+	for (count = 0; _fatcompactnext(f, c); count++) {
+		c->low++;
+		c->high--;
+	}
+	c->low = low;
+	c->high = high;
+	return count;
+}
+
+int _fatcompactmove(fat *f, struct compactstruct *c) {
+	unit *directory;
+	int index;
+	int32_t previous, src;
+	int num, free, i, res;
+
+			/* the run that ends at high, and the free clusters at low */
+
+	for (src = c->high; src - 1 > c->low && c->high - src + 1 < FATMOVERUN;
+	     src--)
+		if (fatgetnextcluster(f, src - 1) != src ||
+		    ! _fatcompactmovable(f, c, src - 1))
+			break;
+	for (free = 1; c->low + free < src && free < c->high - src + 1; free++)
+		if (fatgetnextcluster(f, c->low + free) != FAT_UNUSED)
+			break;
+	num = c->high - src + 1 < free ? c->high - src + 1 : free;
+
+			/* move the last clusters of the run, the ones at high */
+
+	src = c->high - num + 1;
+	if (fatinverseget(f, c->rev, src, &directory, &index, &previous)) {
+		c->high = src - 1;
+		return 0;
+	}
+	if (c->rev[src].isdir && c->rev[src].isentry)
+		c->dirmoved = 1;
+
+	dprintf("%d -> %d", src, c->low);
+	if (num > 1)
+		dprintf(" (%d clusters)", num);
+	dprintf("\n");
+	if (c->journal != NULL)
+		_fatjournalbegin(f, c->journal, src, c->low, num, c->low,
+			directory, index, previous);
+	res = fatinversemoverun(f, c->rev, directory, index, previous,
+		c->rev[src].isdir, c->low, num, 1);
+	if (res != 0) {
+		if (c->journal != NULL)
+			_fatjournalcancel(c->journal);
+		printf("compact: %s ", res == -1 ? "cannot move" : "IO error on");
+		printf("cluster %d\n", src);
+		FATINTERRUPTIBLEABORT(compact, FATINTERRUPTIBLEIOERROR);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++)
+		fatunitdelete(&f->clusters, c->low + i);
+	fatprogressstep(f, num, (uint64_t) num *
+		fatgetbytespersector(f) * fatgetsectorspercluster(f));
+	if (c->journal != NULL) {
+		c->journal->dirmoved |= c->dirmoved;
+		_fatjournalcommit(f, c->journal);
+	}
+
+	c->low += num;
+	c->high -= num;
+	return 0;
+}
+
 int fatcompact(fat *f) {
-	return
-	fatmovearea(f, FAT_FIRST, fatlastcluster(f), 2, fatlastcluster(f));
+	struct compactstruct c;
+	int32_t param[4];
+	int32_t moves;
+	int res;
+
+	c.journal = NULL;
+	if (fatjournalfile != NULL) {
+		memset(param, 0, sizeof(param));
+		c.journal = _fatjournalopen(f, FATJOURNALCOMPACT, param, 0);
+		if (c.journal == NULL)
+			return -1;
+	}
+
+	c.rev = fatinverseopen(f, fatinversefile);
+	if (c.rev == NULL) {
+		_fatjournalclose(f, c.journal, 0);
+		return -1;
+	}
+
+	c.low = FAT_FIRST;
+	c.high = fatlastcluster(f);
+	c.dirmoved = c.journal != NULL && c.journal->dirmoved;
+
+	FATINTERRUPTIBLEINIT(compact);
+
+	moves = _fatcompactcount(f, &c);
+	if (fatcomplexdebug)
+		printf("compact: %d clusters to move\n", moves);
+
+	if (c.journal != NULL)
+		_fatjournalstart(f, c.journal);
+
+	res = 0;
+	fatprogressbegin(f, "compact", moves);
+	while (res == 0 && ! FATINTERRUPTIBLECHECK(compact) &&
+	       _fatcompactnext(f, &c))
+		res = _fatcompactmove(f, &c);
+	fatprogressend(f);
+
+	f->last = c.low;
+
+	if (c.dirmoved)
+		fatfixdot(f);
+
+	if (fatcomplexdebug)
+		fatinversecheck(f, c.rev, 0);
+
+	fatflush(f);
+	_fatjournalclose(f, c.journal,
+		res == 0 && ! FATINTERRUPTIBLECHECK(compact));
+	FATINTERRUPTIBLEFINISH(compact);
+
+	fatinversedelete(f, c.rev);
+	return res != 0 ? res : FATINTERRUPTIBLECHECK(compact);
 }
 
 /*
@@ -228,6 +811,8 @@ int _fattruncate(fat *f,
 			direction == 0)
 		return FAT_REFERENCE_RECUR | FAT_REFERENCE_DELETE;
 
+	fatprogressstep(f, 1, 0);
+
 	if (fatcomplexdebug)
 		FATEXECUTEDEBUG
 
@@ -389,22 +974,340 @@ int fattruncate(fat *f, int numclusters) {
 
 	s.cuttype = 0;
 
+	fatprogressbegin(f, "truncate", _fatprogressused(f));
 	res = fatreferenceexecute(f, NULL, 0, -1, _fattruncate, &s);
+	fatprogressend(f);
 	fatuflush(f);
 
 	return res;
 }
 
+/*
+ * estimate the cost of shrinking a filesystem to a number of clusters, from
+ * the fat and the directories only
+ *
+ * the files are visited in the same order fatmovearea() does; the clusters of
+ * a file over the bound are moved while there is room under it; the others
+ * are cut, with the rest of the file; the clusters cut from a directory do not
+ * include the files in it
+ */
+
+struct shrinkestimatestruct {
+	int32_t bound;		/* first cluster cut */
+	int32_t room;		/* free clusters left under the bound */
+	int move;
+	fatshrinkcost *c;
+};
+
+void _fatshrinkestimatechain(fat *f, struct shrinkestimatestruct *s,
+		int32_t first) {
+	int32_t cl, n, over, cut;
+
+	over = 0;
+	cut = -1;
+	for (cl = first, n = 0;
+	     cl >= FAT_FIRST && cl <= fatlastcluster(f) &&
+	     n <= fatlastcluster(f);
+	     cl = fatgetnextcluster(f, cl), n++) {
+		if (cl < s->bound)
+			continue;
+		over++;
+		if (cut != -1)
+			continue;
+		if (s->move && s->room > 0) {
+			s->room--;
+			s->c->moved++;
+		}
+		else
+			cut = n;
+	}
+
+	s->c->clusters += over;
+	if (over > 0)
+		s->c->files++;
+	if (cut != -1) {
+		s->c->truncated++;
+		s->c->lost += n - cut;
+	}
+}
+
+void _fatshrinkestimate(fat *f, char __attribute__((unused)) *path,
+		unit *directory, int index, void *user) {
+	if (fatentryisdotfile(directory, index))
+		return;
+	_fatshrinkestimatechain(f, (struct shrinkestimatestruct *) user,
+		fatentrygetfirstcluster(directory, index, fatbits(f)));
+}
+
+int fatshrinkestimate(fat *f, int32_t numclusters, int move,
+		double throughput, fatshrinkcost *c) {
+	struct shrinkestimatestruct s;
+	int32_t used;
+	int res;
+
+	memset(c, 0, sizeof(fatshrinkcost));
+	s.bound = numclusters + 2;
+	s.move = move;
+	s.c = c;
+	if (s.bound > fatlastcluster(f))
+		return 0;
+	s.room = fatclusternumfreebetween(f, FAT_FIRST, s.bound - 1);
+
+	if (fatbits(f) == 32)
+		_fatshrinkestimatechain(f, &s, fatgetrootbegin(f));
+	res = fatfileexecute(f, NULL, 0, -1, _fatshrinkestimate, &s);
+
+	used = fatlastcluster(f) - s.bound + 1 -
+		fatclusternumfreebetween(f, s.bound, fatlastcluster(f)) -
+		fatclusternumbadbetween(f, s.bound, fatlastcluster(f));
+	c->other = used > c->clusters ? used - c->clusters : 0;
+
+	c->bytes = (uint64_t) c->moved *
+		fatgetbytespersector(f) * fatgetsectorspercluster(f);
+	c->seconds = throughput <= 0 ? 0 : 2 * c->bytes / throughput;
+	return res;
+}
+
+/*
+ * enlarge a filesystem to a number of sectors
+ *
+ * if the fats need to be larger, they grow over the first data clusters,
+ * after moving them elsewhere; the data area starts that many clusters later,
+ * so every other cluster keeps its position on disk but its number decreases
+ * by that amount: all entries in the fats and all first clusters in the
+ * directory entries are renumbered, then the fats are written anew; on
+ * FAT12/16 the root directory moves with the start of the data area
+ *
+ * the growth of the fats is rounded up so that the data area moves by whole
+ * clusters; the number of bits of the fats is not changed
+ *
+ * only moving the first clusters can be interrupted; a crash after that leaves
+ * the filesystem inconsistent
+ */
+
+struct growstruct {
+	int32_t *entries;	/* directory entries to renumber */
+	int num;
+	int max;
+};
+
+int _fatgrowentry(fat *f,
+		unit *directory, int index, int32_t previous,
+		unit __attribute__((unused)) *startdirectory,
+		int __attribute__((unused)) startindex,
+		int32_t __attribute__((unused)) startprevious,
+		unit __attribute__((unused)) *dirdirectory,
+		int __attribute__((unused)) dirindex,
+		int32_t __attribute__((unused)) dirprevious,
+		int direction, void *user) {
+	struct growstruct *s;
+
+	if (direction != 0 || ! fatreferenceisentry(directory, index, previous))
+		return FAT_REFERENCE_NORMAL;
+	if (fatreferencegettarget(f, directory, index, previous) < FAT_FIRST)
+		return FAT_REFERENCE_NORMAL;
+
+	s = (struct growstruct *) user;
+	if (s->num + 2 > s->max) {
+		s->max = s->max == 0 ? 512 : s->max * 2;
+		s->entries = realloc(s->entries, s->max * sizeof(int32_t));
+		if (s->entries == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+	s->entries[s->num++] = directory->n;
+	s->entries[s->num++] = index;
+	return fatentryisdotfile(directory, index) ? 0 : FAT_REFERENCE_NORMAL;
+}
+
+int fatgrow(fat *f, uint32_t sectors) {
+	struct growstruct s;
+	int32_t fatsize, newsize, clusters, last, shift, cl, next, *table;
+	uint32_t start, datastart;
+	unit *directory, *root;
+	unsigned char *rootdata;
+	off_t size;
+	int nfat, spc, i;
+
+	if (sectors <= fatgetnumsectors(f)) {
+		printf("not a larger size: %u\n", sectors);
+		return -1;
+	}
+	size = lseek(f->fd, 0, SEEK_END);
+	if (size != -1 && (uint64_t) size <
+	    f->offset + (uint64_t) sectors * fatgetbytespersector(f)) {
+		printf("device too small for %u sectors\n", sectors);
+		return -1;
+	}
+
+			/* size of the fats: the data area moves by clusters */
+
+	nfat = fatgetnumfats(f);
+	spc = fatgetsectorspercluster(f);
+	fatsize = fatgetfatsize(f);
+	start = fatgetreservedsectors(f) + fatnumrootsectors(f);
+	for (newsize = fatsize; ; newsize++) {
+		if (nfat * (newsize - fatsize) % spc != 0)
+			continue;
+		if (start + nfat * newsize >= sectors) {
+			printf("not enough sectors for the larger fats\n");
+			return -1;
+		}
+		clusters = (sectors - start - nfat * newsize) / spc;
+		if (fatminfatsize(f, clusters) <= newsize)
+			break;
+	}
+	shift = nfat * (newsize - fatsize) / spc;
+	dprintf("fat size %d -> %d, clusters %d -> %d, shift %d\n",
+		fatsize, newsize, fatnumdataclusters(f), clusters, shift);
+	if (fatbitsfromclusters(clusters) != fatbits(f) ||
+	    (fatbits(f) == 32 && clusters > 0x0FFFFFF5)) {
+		printf("cannot grow, ");
+		printf("it would change the number of bits of the FAT\n");
+		return -1;
+	}
+	if (clusters <= fatnumdataclusters(f) - shift) {
+		printf("cannot grow, the larger fats take all new space\n");
+		return -1;
+	}
+
+			/* move the clusters where the fats grow */
+
+	if (shift > 0) {
+		if (fatmovearea(f, FAT_FIRST, FAT_FIRST + shift - 1,
+				FAT_FIRST + shift, fatlastcluster(f)))
+			return -1;
+		cl = fatclusterfindallocated(f,
+			FAT_FIRST, FAT_FIRST + shift - 1);
+		if (cl != FAT_ERR) {
+			printf("cannot free cluster %d for the fats\n", cl);
+			return -1;
+		}
+		if (fatbits(f) == 32 && fatgetrootbegin(f) < FAT_FIRST + shift) {
+			printf("cannot move the root directory\n");
+			return -1;
+		}
+	}
+
+			/* read the fat and renumber the directory entries */
+
+	last = fatlastcluster(f);
+	table = malloc((last + 1) * sizeof(int32_t));
+	if (table == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	for (cl = FAT_FIRST; cl <= last; cl++)
+		table[cl] = fatgetnextcluster(f, cl);
+
+	s.entries = NULL;
+	s.num = 0;
+	s.max = 0;
+	if (shift > 0 &&
+	    fatreferenceexecute(f, NULL, 0, -1, _fatgrowentry, &s)) {
+		free(table);
+		free(s.entries);
+		return -1;
+	}
+	for (i = 0; i < s.num; i += 2) {
+		directory = fatclusterread(f, s.entries[i]);
+		if (directory == NULL) {
+			printf("cannot read directory cluster %d\n",
+				s.entries[i]);
+			exit(1);
+		}
+		cl = fatentrygetfirstcluster(directory, s.entries[i + 1],
+			fatbits(f));
+		fatentrysetfirstcluster(directory, s.entries[i + 1],
+			fatbits(f), cl - shift);
+		directory->dirty = 1;
+	}
+	free(s.entries);
+
+	rootdata = NULL;
+	if (fatbits(f) != 32) {
+		root = fatclusterread(f, FAT_ROOT);
+		if (root == NULL) {
+			printf("cannot read the root directory\n");
+			exit(1);
+		}
+		rootdata = malloc(root->size);
+		if (rootdata == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		memcpy(rootdata, fatunitgetdata(root), root->size);
+	}
+
+			/* nothing in cache is at its new place */
+
+	fatflush(f);
+	fatunitdeallocate(f->clusters);
+	f->clusters = NULL;
+	datastart = start + nfat * newsize;
+	for (i = fatgetreservedsectors(f); (uint32_t) i < datastart; i++)
+		fatunitdelete(&f->sectors, i);
+
+			/* new geometry, fats and root directory */
+
+	fatsetfatsize(f, newsize);
+	if (fatsetnumsectors(f, sectors)) {
+		printf("cannot set the number of sectors\n");
+		exit(1);
+	}
+	if (fatbits(f) == 32)
+		fatsetrootbegin(f, fatgetrootbegin(f) - shift);
+
+	for (i = 0; i < nfat; i++)
+		fatinittable(f, i);
+	i = f->nfat;
+	f->nfat = FAT_ALL;
+	for (cl = FAT_FIRST + shift; cl <= last; cl++) {
+		next = table[cl];
+		if (next == FAT_UNUSED)
+			continue;
+		fatsetnextcluster(f, cl - shift,
+			next >= FAT_FIRST ? next - shift : next);
+	}
+	f->nfat = i;
+	free(table);
+
+	if (rootdata != NULL) {
+		root = fatclusterread(f, FAT_ROOT);
+		if (root == NULL) {
+			printf("cannot write the root directory\n");
+			exit(1);
+		}
+		memcpy(fatunitgetdata(root), rootdata, root->size);
+		root->dirty = 1;
+		free(rootdata);
+	}
+
+	f->last = FAT_FIRST;
+	fatclusternumfree(f);
+	fatcopyboottobackup(f);
+	return fatuflush(f);
+}
+
 /*
  * defragment a filesystem
  *
- * start with d->cl=2
- * for every cluster reference, in cluster order:
- *	- swap the cluster with d->cl (or move to if d->cl is currently unused)
- *	- increase d->cl
+ * first plan, then move:
+ * - start with d->cl=2; for every cluster reference, in cluster order, the
+ *   destination of the cluster is d->cl; then increase d->cl, skipping the
+ *   bad clusters and the used ones that no file refers to
+ * - the clusters of other files that are in the way go where the planned
+ *   clusters leave a hole
+ * - the resulting permutation is made of chains ending in a free cluster and
+ *   cycles; a chain is executed backwards from its free cluster, a cycle is
+ *   rotated with its clusters in memory, or through a free cluster if long;
+ *   this way, every cluster is moved only once
+ * - with a journal, the plan is kept in it and every move is synced to disk;
+ *   cycles go through a free cluster, since a rotation in memory is not a
+ *   single move
  *
- * it requires the inverse fat because swapping with d->cl requires a reference
- * to d->cl
+ * it requires the inverse fat because moving a cluster requires its reference
  *
  * more generally, move all clusters starting from a reference to an area
  * starting from a certain cluster number, in order
@@ -414,23 +1317,43 @@ FATINTERRUPTIBLEGLOBAL(defragment);
 
 struct defragmentstruct {
 	fatinverse *rev;
+	int32_t *plan;		/* destination of each cluster, or 0 */
+	int32_t *from;		/* which cluster goes in each, or 0 */
 	int32_t cl;
 	int recur;
 	int dirmoved;
 	int nchanges;
+	int staged;		/* cycles moved through a free cluster */
 	int testonly;
+	struct fatjournal *journal;
 };
 
+#define FATDEFRAGMENTROTATE 64	/* longest cycle rotated in memory */
+
+int _fatdefragmentmoving(struct defragmentstruct *d, int32_t cl) {
+	return d->plan[cl] >= FAT_FIRST && d->plan[cl] != cl;
+}
+
+void _fatdefragmentskip(fat *f, struct defragmentstruct *d) {
+	int32_t next;
+
+	for (; d->cl <= fatlastcluster(f); d->cl++) {
+		next = fatgetnextcluster(f, d->cl);
+		if (next == FAT_BAD)
+			continue;
+		if (next != FAT_UNUSED && fatinverseisvoid(d->rev, d->cl))
+			continue;
+		break;
+	}
+}
+
 int _fatdefragment(fat *f,
 		unit *directory, int index, int32_t previous,
 		unit *startdirectory, int startindex, int32_t startprevious,
 		unit *dirdirectory, int dirindex, int32_t dirprevious,
 		int direction, void *user) {
 	struct defragmentstruct *d;
-	int32_t target, cl;
-	int targetfree;
-	int res;
-	int isdir;
+	int32_t target;
 
 	if (FATINTERRUPTIBLECHECK(defragment))
 		return 0;
@@ -448,100 +1371,482 @@ int _fatdefragment(fat *f,
 		return 0;
 	}
 
+	if (directory != NULL && fatentryisdotfile(directory, index))
+		return 0;
+
+			/* already planned: a crosslinked cluster */
+
+	if (d->plan[target] != 0)
+		return 0;
+
 	if (d->cl > fatlastcluster(f))
 		return 0;
 
-	if (d->cl == target) {
-		d->cl++;
-		return FAT_REFERENCE_COND(d->recur);
+	if (fatcomplexdebug && d->cl != target)
+		FATEXECUTEDEBUG;
+
+	d->plan[target] = d->cl;
+	fatprogressstep(f, 1, 0);
+
+	d->cl++;
+	_fatdefragmentskip(f, d);
+	return FAT_REFERENCE_COND(d->recur);
+}
+
+/*
+ * send the clusters not in the plan that occupy a destination to the clusters
+ * left by the plan; then count the moves
+ */
+void _fatdefragmentdisplace(fat *f, struct defragmentstruct *d) {
+	int32_t cl, vacated;
+
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+		if (d->plan[cl] >= FAT_FIRST)
+			d->from[d->plan[cl]] = cl;
+
+	vacated = FAT_FIRST;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+		if (d->from[cl] == 0 || d->plan[cl] != 0)
+			continue;
+		if (fatgetnextcluster(f, cl) == FAT_UNUSED)
+			continue;
+
+		while (vacated <= fatlastcluster(f) &&
+		       (! _fatdefragmentmoving(d, vacated) ||
+		        d->from[vacated] != 0))
+			vacated++;
+		if (vacated > fatlastcluster(f))
+			break;
+
+		dprintf("cluster %d displaced to %d\n", cl, vacated);
+		d->plan[cl] = vacated;
+		d->from[vacated] = cl;
 	}
 
-	if (fatcomplexdebug)
-		FATEXECUTEDEBUG;
+	d->nchanges = 0;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+		if (_fatdefragmentmoving(d, cl))
+			d->nchanges++;
+}
 
-			/* fix . and .. */
+/*
+ * the cost of the plan: each moved cluster is read and written once, plus one
+ * more for each long cycle
+ */
+void _fatdefragmentcost(fat *f, int nchanges, int staged,
+		int chains, int cycles) {
+	uint64_t bytes;
+
+	bytes = (uint64_t) (nchanges + staged) *
+		fatgetbytespersector(f) * fatgetsectorspercluster(f);
+	printf("plan: %d clusters to move, in %d chains and %d cycles\n",
+		nchanges, chains, cycles);
+	printf("plan: %" PRIu64 " bytes read, %" PRIu64 " bytes written\n",
+		bytes, bytes);
+}
 
-	FATEXECUTEFIXDOT
+/*
+ * print the plan, one chain or cycle per line: each cluster goes in the next;
+ * the plan is consumed
+ */
+void _fatdefragmentprint(fat *f, struct defragmentstruct *d) {
+	int32_t cl, c, n;
+	int chains, cycles, length;
+
+	chains = 0;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+		if (! _fatdefragmentmoving(d, cl) || d->from[cl] != 0)
+			continue;
+		printf("chain %d", cl);
+		for (c = cl; _fatdefragmentmoving(d, c); c = n) {
+			n = d->plan[c];
+			d->plan[c] = 0;
+			printf(" -> %d", n);
+		}
+		printf("\n");
+		chains++;
+	}
+
+	cycles = 0;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+		if (! _fatdefragmentmoving(d, cl))
+			continue;
+		printf("cycle %d", cl);
+		for (c = cl, length = 0; _fatdefragmentmoving(d, c); c = n) {
+			n = d->plan[c];
+			d->plan[c] = 0;
+			printf(" -> %d", n);
+			length++;
+		}
+		printf("\n");
+		if (length > FATDEFRAGMENTROTATE &&
+		    fatclusterfindfree(f) != FAT_ERR)
+			d->staged++;
+		cycles++;
+	}
+
+	_fatdefragmentcost(f, d->nchanges, d->staged, chains, cycles);
+}
+
+/*
+ * execute the plan
+ */
+int _fatdefragmentmove(fat *f, struct defragmentstruct *d,
+		int32_t src, int32_t dst, int num) {
+	unit *directory;
+	int index;
+	int32_t previous;
+	int i, res;
+
+	if (d->rev[src].isdir && d->rev[src].isentry)
+		d->dirmoved = 1;
+
+	dprintf("%d -> %d", src, dst);
+	if (num > 1)
+		dprintf(" (%d clusters)", num);
+	dprintf("\n");
+	if (num == 1)
+		res = fatinversemove(f, d->rev, src, dst, 1);
+	else if (fatinverseget(f, d->rev, src, &directory, &index, &previous))
+		res = -2;
+	else
+		res = fatinversemoverun(f, d->rev,
+			directory, index, previous, d->rev[src].isdir,
+			dst, num, 1);
+	if (res == -1) {
+		printf("move: cannot move cluster %d to %d\n", src, dst);
+		FATINTERRUPTIBLEABORT(defragment, FATINTERRUPTIBLEIOERROR);
+		return -1;
+	}
+	if (res < -1) {
+		printf("move: IO error ");
+		printf("%s ", res < -2 ? "writing" : "reading");
+		printf("cluster %d\n", res % 2 ? dst : src);
+		FATINTERRUPTIBLEABORT(defragment, FATINTERRUPTIBLEIOERROR);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		dprintf("deallocate cluster %d\n", dst + i);
+		fatunitdelete(&f->clusters, dst + i);
+	}
+	fatprogressstep(f, num, (uint64_t) num *
+		fatgetbytespersector(f) * fatgetsectorspercluster(f));
+	return 0;
+}
+
+/*
+ * how many clusters from src can be moved together to dst: they are
+ * consecutive in the chain, the plan sends them to consecutive clusters, and
+ * the chains that continue from them are not left behind
+ */
+int _fatdefragmentrun(fat *f, struct defragmentstruct *d,
+		int32_t cl, int32_t src, int32_t dst) {
+	int max, num;
+
+	max = fatclusterrunlength(f, src, dst, FATMOVERUN);
+	for (num = 1; num < max; num++) {
+		if (d->from[dst + num] != src + num)
+			break;
+		if (d->from[src + num] != 0 && src + num < cl)
+			break;
+	}
+	return num;
+}
 
-			/* is this reference part of a directory? */
+/*
+ * move clusters and update the plan: a cluster that was not moved to its
+ * planned destination still has to go there
+ */
+int _fatdefragmentstep(fat *f, struct defragmentstruct *d,
+		int32_t src, int32_t dst, int num) {
+	unit *directory;
+	int index;
+	int32_t previous, target;
+	int i;
 
-	isdir = FATEXECUTEISDIR;
+	target = d->plan[src];
+	if (d->journal != NULL &&
+	    ! fatinverseget(f, d->rev, src, &directory, &index, &previous))
+		_fatjournalbegin(f, d->journal, src, dst, num, target,
+			directory, index, previous);
 
-			/* move or swap clusters */
+	if (_fatdefragmentmove(f, d, src, dst, num)) {
+		if (d->journal != NULL)
+			_fatjournalcancel(d->journal);
+		return -1;
+	}
 
-	d->nchanges++;
-	targetfree = fatgetnextcluster(f, d->cl) == FAT_UNUSED;
+	for (i = 0; i < num; i++) {
+		d->plan[src + i] = 0;
+		d->from[dst + i] = 0;
+		if (target == dst)
+			continue;
+		d->plan[dst + i] = target + i;
+		d->from[target + i] = dst + i;
+	}
 
-	if (d->testonly) {
-		dprintf("%d %s-> %d\n", target, targetfree ? "" : "<", d->cl);
+	if (d->journal != NULL) {
+		d->journal->dirmoved |= d->dirmoved;
+		_fatjournalcommit(f, d->journal);
 	}
-	else if (targetfree) {
-		dprintf("%d -> %d\n", target, d->cl);
-		res = fatinversemovereference(f, d->rev,
-			directory, index, previous, isdir, d->cl, 1);
-		if (res < -1) {
-			printf("move: IO error ");
-			printf("%s ", res < -2 ? "writing" : "reading");
-			printf("cluster %d\n", res % 2 ? d->cl : target);
-			FATINTERRUPTIBLEABORT(defragment,
-				FATINTERRUPTIBLEIOERROR);
-			return 0;
-		}
-		dprintf("deallocate cluster %d\n", d->cl);
-		fatunitdelete(&f->clusters, d->cl);
+	return 0;
+}
+
+/*
+ * execute a chain backwards from its free destination cl
+ */
+int _fatdefragmentchain(fat *f, struct defragmentstruct *d,
+		int32_t cl, int run) {
+	int32_t src, dst;
+	int num;
+
+	for (dst = cl; d->from[dst] != 0; dst = src) {
+		if (FATINTERRUPTIBLECHECK(defragment))
+			return -1;
+		src = d->from[dst];
+		num = run ? _fatdefragmentrun(f, d, cl, src, dst) : 1;
+		if (_fatdefragmentstep(f, d, src, dst, num))
+			return -1;
+	}
+	return 0;
+}
+
+int _fatdefragmentrotate(fat *f, struct defragmentstruct *d, int32_t cl) {
+	int32_t *cycle, c, staging;
+	int n, i, res;
+
+	n = 0;
+	c = cl;
+	do {
+		n++;
+		c = d->plan[c];
+	} while (c != cl);
+
+			/* long cycle: one cluster waits in a free cluster,
+			   turning the cycle into a chain */
+
+	staging = n > FATDEFRAGMENTROTATE || d->journal != NULL ?
+		fatclusterfindfree(f) : FAT_ERR;
+	if (staging != FAT_ERR) {
+		for (c = cl; d->plan[c] != cl; c = d->plan[c]);
+		if (_fatdefragmentstep(f, d, c, staging, 1))
+			return -1;
+		d->staged++;
+		return _fatdefragmentchain(f, d, c, 0);
+	}
+
+			/* an in-memory rotation cannot be journaled: leave the
+			   cycle where it is rather than risk losing it */
+
+	if (d->journal != NULL) {
+		printf("journal: no free cluster, ");
+		printf("cycle of cluster %d not moved\n", cl);
+		c = cl;
+		do {
+			staging = d->plan[c];
+			d->plan[c] = 0;
+			d->from[staging] = 0;
+			c = staging;
+		} while (c != cl);
+		return 0;
+	}
+
+			/* short cycle: rotate with all its clusters in memory */
+
+	cycle = malloc(n * sizeof(int32_t));
+	if (cycle == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	for (i = 0, c = cl; i < n; i++, c = d->plan[c]) {
+		cycle[i] = c;
+		if (d->rev[c].isdir && d->rev[c].isentry)
+			d->dirmoved = 1;
+		dprintf("%d -> %d\n", c, d->plan[c]);
+	}
+
+	res = fatinverserotate(f, d->rev, cycle, n, 1);
+	if (res) {
+		printf("rotate: %s ", res == -1 ? "cannot move" : "IO error on");
+		printf("cycle of cluster %d\n", cl);
+		FATINTERRUPTIBLEABORT(defragment, FATINTERRUPTIBLEIOERROR);
 	}
 	else {
-		if (fatcomplexdebug) {
-			fatinverseprint(f, d->rev, target);
-			printf(" <-> ");
-			fatinverseprint(f, d->rev, d->cl);
-			printf("\n");
+		for (i = 0; i < n; i++) {
+			d->plan[cycle[i]] = 0;
+			fatunitdelete(&f->clusters, cycle[i]);
 		}
-
-		res = fatinverseswapreference(f, d->rev,
-			directory, index, previous, isdir,
-			d->rev[d->cl].directory, d->rev[d->cl].index,
-			d->rev[d->cl].previous, d->rev[d->cl].isdir,
-			1);
-		if (res < -1) {
-			printf("swap: IO error ");
-			printf("%s ", res < -2 ? "writing" : "reading");
-			printf("cluster %d\n", res % 2 ? d->cl : target);
-			FATINTERRUPTIBLEABORT(defragment,
-				FATINTERRUPTIBLEIOERROR);
-			return 0;
+		fatprogressstep(f, n, (uint64_t) n *
+			fatgetbytespersector(f) * fatgetsectorspercluster(f));
+		if (d->journal != NULL) {
+			d->journal->dirmoved |= d->dirmoved;
+			_fatjournalchanged(f, d->journal);
 		}
+	}
 
-		if (d->rev[target].isdir && d->rev[target].previous == 0)
-			d->dirmoved = 1;
+	free(cycle);
+	return res;
+}
 
-		dprintf("deallocate cluster %d\n", d->cl);
-		fatunitdelete(&f->clusters, d->cl);
-		dprintf("deallocate cluster %d\n", target);
-		fatunitdelete(&f->clusters, target);
+void _fatdefragmentexecute(fat *f, struct defragmentstruct *d) {
+	int32_t cl;
+	int chains, cycles;
+
+			/* chains, from their free destination backwards */
+
+	chains = 0;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+		if (d->from[cl] == 0 || d->plan[cl] != 0)
+			continue;
+		if (_fatdefragmentchain(f, d, cl, 1))
+			return;
+		chains++;
 	}
 
-	// fatinversecheck(f, d->rev);
+			/* cycles */
+
+	cycles = 0;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+		if (! _fatdefragmentmoving(d, cl))
+			continue;
+		if (FATINTERRUPTIBLECHECK(defragment))
+			return;
+		if (_fatdefragmentrotate(f, d, cl))
+			return;
+		cycles++;
+	}
 
-			/* increase target cluster */
+	if (fatcomplexdebug)
+		_fatdefragmentcost(f, d->nchanges, d->staged,
+			chains, cycles);
+}
 
-	do {
+/*
+ * plan the directories first, in breadth-first order
+ *
+ * the directories are visited level by level from the root, the chain of each
+ * taking the next destinations; the rest is planned as in a defragmentation:
+ * the clusters of the files in the way go where the directories were
+ */
+int _fatlayoutchain(fat *f, struct defragmentstruct *d, int32_t first) {
+	int32_t cl, next;
+
+	for (cl = first; cl != FAT_EOF; cl = next) {
+		if (cl < FAT_FIRST || cl > fatlastcluster(f) ||
+		    d->plan[cl] != 0 || d->cl > fatlastcluster(f))
+			return -1;
+		next = fatgetnextcluster(f, cl);
+		if (next == FAT_UNUSED || next == FAT_BAD)
+			return -1;
+		dprintf("directory cluster %d -> %d\n", cl, d->cl);
+		d->plan[cl] = d->cl;
+		fatprogressstep(f, 1, 0);
 		d->cl++;
-	} while (fatgetnextcluster(f, d->cl) == FAT_BAD &&
-		d->cl <= fatlastcluster(f));
-	return FAT_REFERENCE_COND(d->recur);
+		_fatdefragmentskip(f, d);
+	}
+	return 0;
 }
 
-int fatlinearize(fat *f, unit *directory, int index, int32_t previous,
-		int32_t start, int recur, int testonly, int *nchanges) {
+int _fatlayout(fat *f, struct defragmentstruct *d) {
+	int32_t *queue, first, target;
+	int head, tail, max, index, res;
+	unit *directory;
+	unsigned char *class;
+
+	max = 512;
+	queue = malloc(max * sizeof(int32_t));
+	if (queue == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	queue[0] = fatgetrootbegin(f);
+	tail = 1;
+
+	res = 0;
+	class = NULL;
+	for (head = 0; head < tail && res == 0; head++) {
+		if (FATINTERRUPTIBLECHECK(defragment))
+			break;
+
+		first = queue[head];
+		if (first >= FAT_FIRST) {
+			if (d->plan[first] != 0)
+				continue;
+			if (_fatlayoutchain(f, d, first)) {
+				dprintf("directory cluster %d: ", first);
+				dprintf("broken chain, not scanned\n");
+				continue;
+			}
+		}
+
+		directory = fatclusterread(f, first);
+		if (directory == NULL) {
+			printf("cannot read directory cluster %d\n", first);
+			res = -1;
+			break;
+		}
+
+		for (index = -1; ; ) {
+			res = fatnextentryclass(f, &directory, &index,
+				&class, FAT_CLASS_DIR);
+			if (res != 0)
+				break;
+			if (fatentryisdotfile(directory, index))
+				continue;
+			target = fatentrygetfirstcluster(directory, index,
+				fatbits(f));
+			if (target < FAT_FIRST || target > fatlastcluster(f) ||
+			    d->plan[target] != 0)
+				continue;
+			if (tail >= max) {
+				max *= 2;
+				queue = realloc(queue, max * sizeof(int32_t));
+				if (queue == NULL) {
+					printf("cannot allocate memory\n");
+					exit(1);
+				}
+			}
+			queue[tail++] = target;
+		}
+		if (res < -1) {
+			printf("cannot read directory cluster %d\n", first);
+			res = -1;
+		}
+		else
+			res = 0;
+	}
+
+	free(class);
+	free(queue);
+	return res;
+}
+
+int _fatlinearize(fat *f, unit *directory, int index, int32_t previous,
+		int32_t start, int recur, int layout,
+		int testonly, int *nchanges) {
 	struct defragmentstruct d;
+	int32_t param[4], cl;
 	char *dummy;
 	int i;
 	int res;
 
-	d.rev = fatinversecreate(f, 0);
-	if (d.rev == NULL)
+	d.journal = NULL;
+	if (fatjournalfile != NULL && ! testonly) {
+		param[0] = start;
+		param[1] = recur;
+		param[2] = directory == NULL && previous == -1;
+		param[3] = layout;
+		d.journal = _fatjournalopen(f, FATJOURNALDEFRAGMENT, param, 1);
+		if (d.journal == NULL)
+			return -1;
+	}
+
+	d.rev = fatinverseopen(f, fatinversefile);
+	if (d.rev == NULL) {
+		_fatjournalclose(f, d.journal, 0);
 		return -1;
+	}
 
 	dummy = malloc(100000);
 	if (dummy == NULL)
@@ -549,24 +1854,65 @@ int fatlinearize(fat *f, unit *directory, int index, int32_t previous,
 	for (i = 0; i < 100000; i++)
 		dummy[i] = i;
 	free(dummy);
-		
+
+	if (d.journal != NULL)
+		d.plan = _fatjournalplan(d.journal);
+	else
+		d.plan = calloc(fatlastcluster(f) + 1, sizeof(int32_t));
+	d.from = calloc(fatlastcluster(f) + 1, sizeof(int32_t));
+	if (d.plan == NULL || d.from == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
 	d.cl = start;
 	d.recur = recur;
 	d.dirmoved = 0;
 	d.nchanges = 0;
+	d.staged = 0;
 	d.testonly = testonly;
+	_fatdefragmentskip(f, &d);
 
 	FATINTERRUPTIBLEINIT(defragment);
 
-	res = fatreferenceexecute(f, directory, index, previous,
-			_fatdefragment, &d);
+	if (d.journal != NULL && d.journal->resume) {
+		res = 0;
+		d.dirmoved = d.journal->dirmoved;
+		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+			if (d.plan[cl] >= FAT_FIRST)
+				d.from[d.plan[cl]] = cl;
+		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+			if (_fatdefragmentmoving(&d, cl))
+				d.nchanges++;
+	}
+	else {
+		fatprogressbegin(f, "plan", f->free == -1 ? 0 :
+			fatlastcluster(f) - FAT_FIRST + 1 - f->free);
+		res = layout ?
+			_fatlayout(f, &d) :
+			fatreferenceexecute(f, directory, index, previous,
+				_fatdefragment, &d);
+		fatprogressend(f);
+		if (res == 0 && ! FATINTERRUPTIBLECHECK(defragment))
+			_fatdefragmentdisplace(f, &d);
+	}
+
+	if (res == 0 && ! FATINTERRUPTIBLECHECK(defragment)) {
+		if (testonly)
+			_fatdefragmentprint(f, &d);
+		else {
+			if (d.journal != NULL)
+				_fatjournalstart(f, d.journal);
+			fatprogressbegin(f, "move", d.nchanges);
+			_fatdefragmentexecute(f, &d);
+			fatprogressend(f);
+		}
+	}
 
 	if (nchanges != NULL)
 		*nchanges = d.nchanges;
 
-	if ((! fatreferenceisboot(directory, index, previous)) && d.dirmoved)
-		fatfixdot(f);
-	if (FATINTERRUPTIBLECHECK(defragment) && d.dirmoved)
+	if (d.dirmoved)
 		fatfixdot(f);
 
 	if (fatcomplexdebug)
@@ -574,13 +1920,359 @@ int fatlinearize(fat *f, unit *directory, int index, int32_t previous,
 
 	fatflush(f);
 
+	_fatjournalclose(f, d.journal,
+		res == 0 && ! FATINTERRUPTIBLECHECK(defragment));
+
 	FATINTERRUPTIBLEFINISH(defragment);
 
+	if (d.journal == NULL)
+		free(d.plan);
+	free(d.from);
 	fatinversedelete(f, d.rev);
 	return res != 0 ? res : FATINTERRUPTIBLECHECK(defragment) - 1;
 }
 
+int fatlinearize(fat *f, unit *directory, int index, int32_t previous,
+		int32_t start, int recur, int testonly, int *nchanges) {
+	return _fatlinearize(f, directory, index, previous,
+		start, recur, 0, testonly, nchanges);
+}
+
 int fatdefragment(fat *f, int testonly, int *nchanges) {
 	return fatlinearize(f, NULL, 0, -1, 2, 1, testonly, nchanges);
 }
 
+int fatdirectoriesfirst(fat *f, int testonly, int *nchanges) {
+	return _fatlinearize(f, NULL, 0, -1, 2, 1, 1, testonly, nchanges);
+}
+
+/*
+ * defragment only the files that need it most
+ *
+ * the fragments of each regular file are counted from the fat; the files with
+ * at least minfragments fragments are ranked by cost, which is the number of
+ * fragments after the first times the number of clusters; in this order, each
+ * is moved as a whole to the smallest free sequence of clusters that contains
+ * it, until budget clusters are moved (0 = no limit); a file that does not fit
+ * in any free sequence or in the rest of the budget is skipped
+ *
+ * directories are not moved; with a journal, a resumed operation counts its
+ * budget from the start again
+ */
+
+FATINTERRUPTIBLEGLOBAL(selective);
+
+struct fragmentedfile {
+	int32_t directory;	/* cluster of the directory entry */
+	int index;
+	int32_t first;
+	int32_t size;		/* clusters */
+	int32_t fragments;
+	uint64_t cost;
+	int32_t dst;		/* where it goes */
+	char *path;
+};
+
+struct selectivestruct {
+	struct fragmentedfile *files;
+	int nfiles;
+	int maxfiles;
+	int minfragments;
+	int testonly;
+	unsigned char *seen;	/* clusters in some file */
+	unsigned char *shared;	/* clusters in more than one */
+	struct fatjournal *journal;
+};
+
+void _fatdefragmentscore(fat *f, char *path, unit *directory, int index,
+		void *user) {
+	struct selectivestruct *s;
+	struct fragmentedfile *file;
+	char shortname[13];
+	int32_t first, cl, next, size, fragments;
+
+	if (FATINTERRUPTIBLECHECK(selective))
+		return;
+
+	if (fatentryisdotfile(directory, index))
+		return;
+	first = fatentrygetfirstcluster(directory, index, fatbits(f));
+	if (first < FAT_FIRST || first > fatlastcluster(f))
+		return;
+
+			/* fragments and size, up to a loop or a bad next */
+
+	size = 1;
+	fragments = 1;
+	for (cl = first; ; cl = next) {
+		next = fatgetnextcluster(f, cl);
+		if (next == FAT_EOF)
+			break;
+		if (next < FAT_FIRST || next > fatlastcluster(f) ||
+		    size > fatlastcluster(f))
+			return;
+		if (next != cl + 1)
+			fragments++;
+		size++;
+	}
+	fatprogressstep(f, size, 0);
+
+	s = (struct selectivestruct *) user;
+	for (cl = first; cl != FAT_EOF; cl = fatgetnextcluster(f, cl)) {
+		if (FATBIT(s->seen, cl))
+			FATSETBIT(s->shared, cl);
+		FATSETBIT(s->seen, cl);
+	}
+	if (fatentryisdirectory(directory, index))
+		return;
+	if (fragments < s->minfragments || fragments < 2)
+		return;
+
+	if (s->nfiles >= s->maxfiles) {
+		s->maxfiles = s->maxfiles == 0 ? 256 : s->maxfiles * 2;
+		s->files = realloc(s->files,
+			s->maxfiles * sizeof(struct fragmentedfile));
+		if (s->files == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+
+	file = &s->files[s->nfiles++];
+	file->directory = directory->n;
+	file->index = index;
+	file->first = first;
+	file->size = size;
+	file->fragments = fragments;
+	file->cost = (uint64_t) (fragments - 1) * size;
+	file->dst = FAT_ERR;
+	file->path = NULL;
+	if (s->testonly) {
+		fatentrygetshortname(directory, index, shortname);
+		file->path = malloc(strlen(path) + strlen(shortname) + 1);
+		if (file->path == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		strcpy(file->path, path);
+		strcat(file->path, shortname);
+	}
+}
+
+int _fatdefragmentcompare(const void *a, const void *b) {
+	const struct fragmentedfile *fa, *fb;
+
+	fa = (const struct fragmentedfile *) a;
+	fb = (const struct fragmentedfile *) b;
+	if (fa->cost != fb->cost)
+		return fa->cost < fb->cost ? 1 : -1;
+	return fa->first - fb->first;
+}
+
+/*
+ * a file that shares clusters with another is not moved
+ */
+int _fatdefragmentshared(fat *f, struct selectivestruct *s,
+		struct fragmentedfile *file) {
+	int32_t cl;
+
+	for (cl = file->first; cl != FAT_EOF; cl = fatgetnextcluster(f, cl))
+		if (FATBIT(s->shared, cl))
+			return 1;
+	return 0;
+}
+
+/*
+ * when only testing, the destination of a file is marked used until the end,
+ * so that the next files are not given the same
+ */
+void _fatdefragmentreserve(fat *f, struct fragmentedfile *file, int32_t next) {
+	int32_t i;
+
+	if (file->dst == FAT_ERR)
+		return;
+	for (i = 0; i < file->size; i++)
+		fatsetnextcluster(f, file->dst + i, next);
+}
+
+/*
+ * move a file to consecutive free clusters starting from dst
+ */
+int _fatdefragmentfile(fat *f, struct selectivestruct *s,
+		struct fragmentedfile *file, int32_t dst) {
+	unit *directory;
+	int index;
+	int32_t previous, target;
+	int moved, num, i, res;
+
+	directory = fatclusterread(f, file->directory);
+	if (directory == NULL) {
+		printf("cannot read directory cluster %d\n", file->directory);
+		return -1;
+	}
+	index = file->index;
+	previous = -1;
+
+	for (moved = 0; moved < file->size; moved += num) {
+		if (FATINTERRUPTIBLECHECK(selective))
+			return -1;
+
+		target = fatreferencegettarget(f, directory, index, previous);
+		if (target < FAT_FIRST)
+			break;
+		num = fatclusterrunlength(f, target, dst + moved, FATMOVERUN);
+		if (num > file->size - moved)
+			num = file->size - moved;
+		if (num < 1)
+			num = 1;
+
+		dprintf("%d -> %d", target, dst + moved);
+		if (num > 1)
+			dprintf(" (%d clusters)", num);
+		dprintf("\n");
+		if (s->journal != NULL)
+			_fatjournalbegin(f, s->journal,
+				target, dst + moved, num, dst + moved,
+				directory, index, previous);
+		res = fatclustermoverun(f, directory, index, previous,
+			dst + moved, num, 1);
+		if (res != 0) {
+			if (s->journal != NULL)
+				_fatjournalcancel(s->journal);
+			printf("move: %s cluster %d\n",
+				res == -1 ? "cannot move" : "IO error on",
+				target);
+			FATINTERRUPTIBLEABORT(selective,
+				FATINTERRUPTIBLEIOERROR);
+			return -1;
+		}
+
+		for (i = 0; i < num; i++)
+			fatunitdelete(&f->clusters, dst + moved + i);
+		fatprogressstep(f, num, (uint64_t) num *
+			fatgetbytespersector(f) * fatgetsectorspercluster(f));
+		if (s->journal != NULL)
+			_fatjournalcommit(f, s->journal);
+
+		directory = NULL;
+		index = 0;
+		previous = dst + moved + num - 1;
+	}
+
+	return 0;
+}
+
+int fatdefragmentselective(fat *f, int minfragments, int32_t budget,
+		int testonly, int *nchanges) {
+	struct selectivestruct s;
+	struct fragmentedfile *file;
+	int32_t param[4], dst, moved;
+	int i, selected, res;
+
+	s.files = NULL;
+	s.nfiles = 0;
+	s.maxfiles = 0;
+	s.minfragments = minfragments;
+	s.testonly = testonly;
+	s.seen = calloc(fatlastcluster(f) / 8 + 1, 1);
+	s.shared = calloc(fatlastcluster(f) / 8 + 1, 1);
+	if (s.seen == NULL || s.shared == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	s.journal = NULL;
+	if (fatjournalfile != NULL && ! testonly) {
+		param[0] = minfragments;
+		param[1] = budget;
+		param[2] = 0;
+		param[3] = 0;
+		s.journal = _fatjournalopen(f, FATJOURNALSELECTIVE, param, 0);
+		if (s.journal == NULL)
+			return -1;
+		_fatjournalstart(f, s.journal);
+	}
+
+	FATINTERRUPTIBLEINIT(selective);
+
+			/* score and rank the files */
+
+	fatprogressbegin(f, "score", _fatprogressused(f));
+	res = fatfileexecute(f, NULL, 0, -1, _fatdefragmentscore, &s);
+	fatprogressend(f);
+	qsort(s.files, s.nfiles, sizeof(struct fragmentedfile),
+		_fatdefragmentcompare);
+
+			/* choose the files and their destinations */
+
+	moved = 0;
+	selected = 0;
+	for (i = 0; i < s.nfiles; i++) {
+		file = &s.files[i];
+		if (_fatdefragmentshared(f, &s, file)) {
+			dprintf("file at %d is crosslinked, not moved\n",
+				file->first);
+			file->size = 0;
+			continue;
+		}
+		if (budget > 0 && moved + file->size > budget)
+			continue;
+		moved += file->size;
+		selected++;
+	}
+
+	fatprogressbegin(f, "move", moved);
+	moved = 0;
+	for (i = 0; i < s.nfiles && res == 0; i++) {
+		if (FATINTERRUPTIBLECHECK(selective))
+			break;
+		file = &s.files[i];
+		if (file->size == 0 ||
+		    (budget > 0 && moved + file->size > budget))
+			continue;
+		dst = fatclusterfindfreeextent(f, file->size);
+		file->dst = dst;
+		if (testonly) {
+			printf("file %s: %d fragments, %d clusters, ",
+				file->path, file->fragments, file->size);
+			if (dst == FAT_ERR)
+				printf("no free space\n");
+			else
+				printf("to %d-%d\n", dst, dst + file->size - 1);
+		}
+		if (dst == FAT_ERR)
+			continue;
+		if (testonly)
+			_fatdefragmentreserve(f, file, FAT_EOF);
+		else {
+			dprintf("file at %d: %d fragments, %d clusters\n",
+				file->first, file->fragments, file->size);
+			if (_fatdefragmentfile(f, &s, file, dst))
+				break;
+		}
+		moved += file->size;
+	}
+	fatprogressend(f);
+
+	if (testonly) {
+		for (i = 0; i < s.nfiles; i++)
+			_fatdefragmentreserve(f, &s.files[i], FAT_UNUSED);
+		printf("%d fragmented files, %d selected, %d clusters\n",
+			s.nfiles, selected, moved);
+	}
+
+	if (nchanges != NULL)
+		*nchanges = moved;
+
+	fatflush(f);
+	_fatjournalclose(f, s.journal,
+		res == 0 && ! FATINTERRUPTIBLECHECK(selective));
+	FATINTERRUPTIBLEFINISH(selective);
+
+	for (i = 0; i < s.nfiles; i++)
+		free(s.files[i].path);
+	free(s.files);
+	free(s.seen);
+	free(s.shared);
+	return res != 0 ? res : FATINTERRUPTIBLECHECK(selective);
+}
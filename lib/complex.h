@@ -53,6 +53,13 @@
 
 #include "fs.h"
 
+/*
+ * file where defragmentation and moving an area keep track of their progress,
+ * if not NULL; an operation interrupted or crashed is resumed from it
+ * libllfat.txt: [Journal]
+ */
+extern char *fatjournalfile;
+
 /*
  * uninterruptible flush
  */
@@ -76,6 +83,28 @@ int fatcompact(fat *f);
  */
 int fattruncate(fat *f, int numclusters);
 
+/*
+ * cost of shrinking a filesystem, without changing anything
+ */
+typedef struct {
+	int32_t clusters;	/* clusters of files over the bound */
+	int32_t moved;		/* clusters that would be moved */
+	uint64_t bytes;		/* bytes read and then written to move them */
+	int files;		/* files with some cluster over the bound */
+	int truncated;		/* files that would be cut */
+	int32_t lost;		/* clusters cut from them */
+	int32_t other;		/* used clusters over the bound of no file */
+	double seconds;		/* time to move, at the given throughput */
+} fatshrinkcost;
+
+int fatshrinkestimate(fat *f, int32_t numclusters, int move,
+		double throughput, fatshrinkcost *c);
+
+/*
+ * enlarge a filesystem, moving the first clusters if the fats have to grow
+ */
+int fatgrow(fat *f, uint32_t sectors);
+
 /*
  * defragment a part of a filesystem, or all of it
  */
@@ -83,6 +112,17 @@ int fatlinearize(fat *f, unit *directory, int index, int32_t previous,
 		int32_t start, int recur, int testonly, int *nchanges);
 int fatdefragment(fat *f, int testonly, int *nchanges);
 
+/*
+ * move all directories at the start of the data area, in breadth-first order
+ */
+int fatdirectoriesfirst(fat *f, int testonly, int *nchanges);
+
+/*
+ * defragment only the most fragmented files, within a budget of clusters
+ */
+int fatdefragmentselective(fat *f, int minfragments, int32_t budget,
+		int testonly, int *nchanges);
+
 /*
  * macros for dealing with signals (see top of file)
  */
@@ -25,6 +25,7 @@ extern int fatinversedebug;
 extern int fatreferencedebug;
 extern int fatreferenceerror;
 extern int fatlongdebug;
+extern int fatparalleldebug;
 extern int fatdirectorydebug;
 extern int fatdebug;
 extern int fattabledebug;
@@ -59,6 +59,55 @@ int fatnextentry(fat *f, unit **directory, int *index) {
 	return fatentryend(*directory, *index);
 }
 
+/*
+ * next entry of a directory among the classes in mask, or the end marker
+ *
+ * the entries of each cluster are classified once when the scan gets to it;
+ * the classes are stored in *class, which is allocated and reallocated as
+ * needed, is to be NULL on the first call and freed by the caller at the end
+ */
+int fatnextentryclass(fat *f, unit **directory, int *index,
+		unsigned char **class, int mask) {
+	int num;
+	int32_t cn;
+
+	num = (*directory)->size / 32;
+	if (*class == NULL || *index < 0) {
+		*class = realloc(*class, num);
+		if (*class == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		fatentryclassify(*directory, *class);
+	}
+
+	while ((*index = fatentryclassnext(*class, num, *index,
+			mask | FAT_CLASS_END)) >= num) {
+		cn = fatgetnextcluster(f, (*directory)->n);
+		if (cn < FAT_FIRST) {
+			*index = 0;
+			*directory = NULL;
+			return cn == FAT_EOF || cn == FAT_UNUSED ? -1 : -2;
+		}
+		*directory = fatclusterread(f, cn);
+		if (*directory == NULL) {
+			*index = 0;
+			return -3;
+		}
+
+		num = (*directory)->size / 32;
+		*class = realloc(*class, num);
+		if (*class == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		fatentryclassify(*directory, *class);
+		*index = -1;
+	}
+
+	return (*class)[*index] == FAT_CLASS_END;
+}
+
 /*
  * string matching, case sensitive or not depending on f->insensitive
  */
@@ -74,6 +123,7 @@ int fatlookupfile(fat *f, int32_t dir,
 	char name[13];
 	unit *scandirectory;
 	int scanindex;
+	unsigned char *class;
 	uint32_t cl;
 
 	dprintf("lookup file %s:", shortname);
@@ -86,19 +136,26 @@ int fatlookupfile(fat *f, int32_t dir,
 	}
 
 	scandirectory = fatclusterread(f, dir);
+	if (scandirectory == NULL)
+		return -1;
 
-	for (scanindex = -1; ! fatnextentry(f, &scandirectory, &scanindex); ) {
+	class = NULL;
+	for (scanindex = -1;
+	     ! fatnextentryclass(f, &scandirectory, &scanindex,
+			&class, FAT_CLASS_EXISTS); ) {
 		dprintf(" %d,%d", (scandirectory)->n, scanindex);
 		fatentrygetshortname(scandirectory, scanindex, name);
 		if (! _fatcmp(f, name, shortname)) {
 			*directory = scandirectory;
 			*index = scanindex;
 			dprintf(" (found)\n");
+			free(class);
 			return 0;
 		}
 	}
 
 	dprintf(" (not found)\n");
+	free(class);
 	return -1;
 }
 
@@ -497,3 +554,164 @@ int fatcreatefile(fat *f, int32_t dir, char *path,
 	return fatcreatefiledir(f, &dir, path, directory, index);
 }
 
+
+/*
+ * read the clusters of all directories below dir in disk order, so that a
+ * later traversal finds them in cache; the tree is scanned a level at time:
+ * the clusters of the directories in the level are collected from the fat,
+ * sorted and read in runs of consecutive clusters; their entries then give
+ * the directories of the next level
+ */
+
+#define FAT_PREFETCH_RUN (1024 * 1024)
+
+void _fatdirectoryappend(int32_t **list, int *num, int *size, int32_t cl) {
+	if (*num >= *size) {
+		*size = *size == 0 ? 64 : *size * 2;
+		*list = realloc(*list, *size * sizeof(int32_t));
+		if (*list == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+	(*list)[(*num)++] = cl;
+}
+
+int _fatdirectorycompare(const void *a, const void *b) {
+	int32_t x = *(const int32_t *) a, y = *(const int32_t *) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int fatdirectoryprefetch(fat *f, int32_t dir) {
+	unsigned char *visited;
+	int32_t *level, *next, *chain, *sorted, *swap, cl, first;
+	int nlevel, nnext, nchain, slevel, snext, schain;
+	int i, j, index, end, maxrun, res;
+	unit *directory;
+
+	if (fat_simulate_errors != NULL)
+		return 0;		/* errors are shown by the traversal */
+
+	if (dir < FAT_FIRST)
+		dir = fatgetrootbegin(f);
+	if (dir != FAT_ROOT && ! fatisvalidcluster(f, dir))
+		return -1;
+
+	visited = calloc(fatlastcluster(f) / 8 + 1, 1);
+	if (visited == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+#define VISITED(c) (visited[(c) / 8] & (1 << ((c) % 8)))
+#define SETVISITED(c) (visited[(c) / 8] |= (1 << ((c) % 8)))
+
+	maxrun = FAT_PREFETCH_RUN / fatbytespercluster(f);
+	if (maxrun < 1)
+		maxrun = 1;
+
+	level = NULL;
+	next = NULL;
+	chain = NULL;
+	nlevel = 0;
+	slevel = 0;
+	snext = 0;
+	schain = 0;
+	res = 0;
+
+	_fatdirectoryappend(&level, &nlevel, &slevel, dir);
+	while (nlevel > 0) {
+		dprintf("prefetch level of %d directories\n", nlevel);
+
+				/* clusters of the directories in the level, in
+				 * chain order, each directory ended by zero */
+
+		nchain = 0;
+		for (i = 0; i < nlevel; i++) {
+			if (level[i] == FAT_ROOT)
+				_fatdirectoryappend(&chain, &nchain, &schain,
+					FAT_ROOT);
+			for (cl = level[i];
+			     fatisvalidcluster(f, cl) && ! VISITED(cl);
+			     cl = fatgetnextcluster(f, cl)) {
+				SETVISITED(cl);
+				_fatdirectoryappend(&chain, &nchain, &schain,
+					cl);
+			}
+			_fatdirectoryappend(&chain, &nchain, &schain,
+				FAT_UNUSED);
+		}
+
+				/* read them in disk order */
+
+		sorted = malloc(nchain * sizeof(int32_t));
+		if (sorted == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		memcpy(sorted, chain, nchain * sizeof(int32_t));
+		qsort(sorted, nchain, sizeof(int32_t), _fatdirectorycompare);
+		for (i = 0; i < nchain && sorted[i] < FAT_FIRST; i++) {
+		}
+		for (; i < nchain; i = j) {
+			for (j = i + 1;
+			     j < nchain && j - i < maxrun &&
+			     sorted[j] == sorted[j - 1] + 1;
+			     j++) {
+			}
+			dprintf("prefetch run %d-%d\n", sorted[i], sorted[j - 1]);
+			if (fatclusterreadrun(f, sorted[i], j - i))
+				res = -1;
+		}
+		free(sorted);
+
+				/* subdirectories, from the clusters in cache */
+
+		nnext = 0;
+		end = 0;
+		for (i = 0; i < nchain; i++) {
+			if (chain[i] == FAT_UNUSED) {
+				end = 0;
+				continue;
+			}
+			if (end)
+				continue;
+			directory = fatclusterread(f, chain[i]);
+			if (directory == NULL) {
+				end = 1;
+				continue;
+			}
+			for (index = 0; index < directory->size / 32; index++) {
+				if (fatentryend(directory, index)) {
+					end = 1;
+					break;
+				}
+				if (! fatentryexists(directory, index) ||
+				    ! fatentryisdirectory(directory, index) ||
+				    fatentryisdotfile(directory, index))
+					continue;
+				first = fatentrygetfirstcluster(directory,
+					index, f->bits);
+				if (fatisvalidcluster(f, first) &&
+				    ! VISITED(first))
+					_fatdirectoryappend(&next, &nnext,
+						&snext, first);
+			}
+		}
+
+		swap = level;
+		level = next;
+		next = swap;
+		nlevel = nnext;
+		i = slevel;
+		slevel = snext;
+		snext = i;
+	}
+
+#undef VISITED
+#undef SETVISITED
+	free(level);
+	free(next);
+	free(chain);
+	free(visited);
+	return res;
+}
@@ -43,6 +43,8 @@ int fatentrynumclusters(fat *f, unit *directory, int index);
  * next entry of a directory
  */
 int fatnextentry(fat *f, unit **directory, int *index);
+int fatnextentryclass(fat *f, unit **directory, int *index,
+		unsigned char **class, int mask);
 
 /*
  * cluster/index pair of a file, given its short name
@@ -98,5 +100,10 @@ int fatcreatefiledir(fat *f, int32_t *dir, char *path,
 int fatcreatefile(fat *f, int32_t dir, char *path,
 		unit **directory, int *index);
 
+/*
+ * read all directories below dir in disk order, to have them in cache
+ */
+int fatdirectoryprefetch(fat *f, int32_t dir);
+
 #endif
 
@@ -53,6 +53,53 @@ int fatentryislongpart(unit *directory, int index) {
 		FAT_ATTR_LONGNAME;
 }
 
+/*
+ * class of an entry: end marker, deleted, part of a long name, volume label,
+ * directory or other file
+ */
+#define _FATENTRYCLASS(first, attr)					\
+	((first) == 0x00 ? FAT_CLASS_END :				\
+	 (first) == 0xE5 ? FAT_CLASS_DELETED :				\
+	 ((attr) & FAT_ATTR_ALL) == FAT_ATTR_LONGNAME ? FAT_CLASS_LONG :	\
+	 (attr) & FAT_ATTR_VOLUME ? FAT_CLASS_VOLUME :			\
+	 (attr) & FAT_ATTR_DIR ? FAT_CLASS_DIR :			\
+	 FAT_CLASS_FILE)
+
+int fatentryclass(unit *directory, int index) {
+	return _FATENTRYCLASS(ENTRYPOS(directory, index, 0),
+		ENTRYPOS(directory, index, 11));
+}
+
+/*
+ * classify all entries of a directory cluster at once; class has an element
+ * for each entry, which is size/32; return this number
+ *
+ * only the first and the attribute byte of each entry are read, from a single
+ * pointer to the data of the cluster; the conditional expressions compile to
+ * conditional moves rather than branches
+ */
+int fatentryclassify(unit *directory, unsigned char *class) {
+	unsigned char *data, *end;
+
+	data = fatunitgetdata(directory);
+	end = data + directory->size / 32 * 32;
+
+	for (; data < end; data += 32)
+		*class++ = _FATENTRYCLASS(data[0], data[11]);
+
+	return directory->size / 32;
+}
+
+/*
+ * first entry after index whose class is in mask; num if none
+ */
+int fatentryclassnext(unsigned char *class, int num, int index, int mask) {
+	for (index++; index < num; index++)
+		if (class[index] & mask)
+			return index;
+	return num;
+}
+
 /*
  * convert the name between the 11-byte array to a max-13-char string
  */
@@ -189,19 +236,7 @@ void _fattimetotm(uint16_t d, struct tm *tm) {
 }
 
 void _fattmfixday(struct tm *tm) {
-	char *tz;
-
-	tz = getenv("TZ");
-	setenv("TZ", "", 1);
-	tzset();
-
-	mktime(tm);
-
-	if (tz)
-		setenv("TZ", tz, 1);
-	else
-		unsetenv("TZ");
-	tzset();
+	timegm(tm);
 }
 
 int _fatentrygettime(unit *directory, int index, int time_pos, int date_pos,
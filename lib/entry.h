@@ -59,6 +59,26 @@ int fatentryexists(unit *directory, int index);
 int fatentryend(unit *directory, int index);
 int fatentryislongpart(unit *directory, int index);
 
+/*
+ * classify the entries of a directory cluster, and skip to the next entry of
+ * the given classes
+ */
+#define FAT_CLASS_END     0x01
+#define FAT_CLASS_DELETED 0x02
+#define FAT_CLASS_LONG    0x04
+#define FAT_CLASS_VOLUME  0x08
+#define FAT_CLASS_DIR     0x10
+#define FAT_CLASS_FILE    0x20
+
+#define FAT_CLASS_EXISTS \
+	(FAT_CLASS_VOLUME | FAT_CLASS_DIR | FAT_CLASS_FILE)
+#define FAT_CLASS_ALL \
+	(FAT_CLASS_DELETED | FAT_CLASS_LONG | FAT_CLASS_EXISTS)
+
+int fatentryclass(unit *directory, int index);
+int fatentryclassify(unit *directory, unsigned char *class);
+int fatentryclassnext(unsigned char *class, int num, int index, int mask);
+
 /*
  * get and set parts of a directory entry
  */
@@ -0,0 +1,333 @@
+/*
+ * file.c
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * file.c
+ *
+ * copy the content of files from and to file descriptors, bypassing the cache
+ * of clusters
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include "fs.h"
+#include "unit.h"
+#include "table.h"
+#include "file.h"
+
+/*
+ * how data is copied between file descriptors; each is tried until one works,
+ * then it is used for the rest of the copy
+ */
+#define FATFILECOPYRANGE 0
+#define FATFILESENDFILE  1
+#define FATFILEREADWRITE 2
+
+#define FATFILEBUFFER (64 * 1024)
+
+/*
+ * copy len bytes from position pos of in to the current position of out
+ */
+int _fatfilecopy(int in, off_t pos, int out, size_t len, int *method) {
+	char *buffer;
+	ssize_t res, w;
+	size_t n;
+
+	buffer = NULL;
+	while (len > 0) {
+		if (*method == FATFILECOPYRANGE) {
+			res = copy_file_range(in, &pos, out, NULL, len, 0);
+			if (res == -1 && (errno == EXDEV || errno == EINVAL ||
+			    errno == EBADF || errno == ENOSYS ||
+			    errno == EOPNOTSUPP)) {
+				*method = FATFILESENDFILE;
+				continue;
+			}
+		}
+		else if (*method == FATFILESENDFILE) {
+			res = sendfile(out, in, &pos, len);
+			if (res == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				*method = FATFILEREADWRITE;
+				continue;
+			}
+		}
+		else {
+			if (buffer == NULL)
+				buffer = malloc(FATFILEBUFFER);
+			if (buffer == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
+			}
+			n = len < FATFILEBUFFER ? len : FATFILEBUFFER;
+			res = pread(in, buffer, n, pos);
+			for (n = 0; res > 0 && n < (size_t) res; n += w) {
+				w = write(out, buffer + n, res - n);
+				if (w == -1) {
+					res = -1;
+					break;
+				}
+			}
+			if (res > 0)
+				pos += res;
+		}
+
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			if (res == 0)
+				errno = EIO;
+			free(buffer);
+			return -1;
+		}
+		len -= res;
+	}
+	free(buffer);
+	return 0;
+}
+
+/*
+ * copy a chain of clusters to a file descriptor, one run of consecutive
+ * clusters at time
+ */
+int64_t fatfilestream(fat *f, fat *data, int32_t first, int64_t size, int fd) {
+	int32_t cl, next, begin, num, count;
+	uint64_t origin;
+	int csize, method;
+	int64_t copied, len;
+
+			/* the data on disk is the current one */
+
+	fatunitflush(data->clusters);
+
+	method = FATFILECOPYRANGE;
+	copied = 0;
+	count = 0;
+	for (begin = first;
+	     begin >= FAT_ROOT && begin <= fatlastcluster(f) &&
+	     (size == -1 || copied < size);
+	     begin = next) {
+
+				/* run of consecutive clusters */
+
+		num = 0;
+		next = begin;
+		do {
+			cl = next;
+			num++;
+			next = cl == FAT_ROOT ? FAT_EOF : fatgetnextcluster(f, cl);
+		} while (next == cl + 1 && count + num <= fatlastcluster(f));
+		count += num;
+		if (next == FAT_UNUSED || next == FAT_BAD)
+			next = FAT_EOF;
+
+				/* copy it */
+
+		fatclusterposition(data, begin, &origin, &csize);
+		len = (int64_t) csize * num;
+		if (size != -1 && len > size - copied)
+			len = size - copied;
+		if (_fatfilecopy(data->fd,
+				data->offset + origin + (uint64_t) begin * csize,
+				fd, len, &method)) {
+			perror("copying file");
+			return -1;
+		}
+		copied += len;
+
+				/* a loop in the chain */
+
+		if (count > fatlastcluster(f))
+			break;
+	}
+
+	return copied;
+}
+
+/*
+ * write a file in chunks, allocating the clusters by sequences
+ */
+
+#define FATFILECHUNK (4 * 1024 * 1024)
+
+struct filewrite {
+	int32_t begin;
+	int32_t end;
+	int32_t first;		/* first cluster of the chain */
+	int32_t last;		/* last cluster of the chain */
+	int32_t want;		/* clusters expected, for the first search */
+	int fragmented;		/* no free sequence long enough */
+};
+
+/*
+ * allocate a sequence of at most num consecutive clusters and append it to
+ * the chain; return its first cluster and its length in *len
+ */
+int32_t _fatfileallocate(fat *f, struct filewrite *w, int32_t num, int *len) {
+	int32_t start, cl;
+
+				/* continue the chain, or look for a sequence */
+
+	start = FAT_ERR;
+	if (w->last >= FAT_FIRST && w->last < fatlastcluster(f) &&
+	    fatclusterisbetween(w->last + 1, w->begin, w->end) &&
+	    fatgetnextcluster(f, w->last + 1) == FAT_UNUSED)
+		start = w->last + 1;
+	if (start == FAT_ERR && ! w->fragmented &&
+	    (w->want > 1 || num > 1)) {
+		start = fatclusterfindfreesequencebetween(f,
+			w->begin, w->end, -1, w->want > num ? w->want : num);
+		if (start == FAT_ERR)
+			w->fragmented = 1;
+	}
+	if (start == FAT_ERR)
+		start = fatclusterfindfreebetween(f, w->begin, w->end, -1);
+	if (start == FAT_ERR)
+		return FAT_ERR;
+	w->want = 0;
+
+				/* extend it and link it */
+
+	for (*len = 1;
+	     *len < num && start + *len <= fatlastcluster(f) &&
+	     fatclusterisbetween(start + *len, w->begin, w->end) &&
+	     fatgetnextcluster(f, start + *len) == FAT_UNUSED;
+	     (*len)++);
+
+	if (w->last >= FAT_FIRST)
+		fatsetnextcluster(f, w->last, start);
+	else
+		w->first = start;
+	for (cl = start; cl < start + *len - 1; cl++)
+		fatsetnextcluster(f, cl, cl + 1);
+	fatsetnextcluster(f, cl, FAT_EOF);
+	w->last = cl;
+
+	for (cl = start; cl < start + *len; cl++)
+		fatunitdelete(&f->clusters, cl);
+	return start;
+}
+
+/*
+ * read a chunk, as long as possible
+ */
+ssize_t _fatfileread(int fd, char *buffer, size_t size) {
+	size_t pos;
+	ssize_t res;
+
+	for (pos = 0; pos < size; pos += res) {
+		res = read(fd, buffer + pos, size - pos);
+		if (res == -1 && errno == EINTR)
+			res = 0;
+		else if (res == -1)
+			return -1;
+		else if (res == 0)
+			break;
+	}
+	return pos;
+}
+
+int64_t fatfilewrite(fat *f, int fd, int64_t size,
+		int32_t begin, int32_t end, int32_t *first) {
+	struct filewrite w;
+	char *buffer;
+	uint64_t origin;
+	int csize, len, res;
+	int64_t written, chunk, n, pos;
+	int32_t start, num;
+
+	fatclusterposition(f, FAT_FIRST, &origin, &csize);
+	chunk = FATFILECHUNK / csize > 0 ?
+		FATFILECHUNK / csize * csize : csize;
+	buffer = NULL;
+	if (fd != -1) {
+		buffer = malloc(chunk);
+		if (buffer == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+
+	w.begin = begin;
+	w.end = end;
+	w.first = FAT_UNUSED;
+	w.last = FAT_UNUSED;
+	w.want = size <= 0 ? 0 : (size + csize - 1) / csize;
+	w.fragmented = 0;
+
+	fatprogressbegin(f, "write", size <= 0 ? 0 : size);
+	res = 0;
+	written = 0;
+	while (fd != -1 || written < size) {
+
+				/* next chunk */
+
+		if (fd == -1)
+			n = size - written < chunk ? size - written : chunk;
+		else {
+			n = _fatfileread(fd, buffer, chunk);
+			if (n == -1) {
+				perror("reading file");
+				res = -1;
+				break;
+			}
+			memset(buffer + n, 0, (csize - n % csize) % csize);
+		}
+		if (n == 0)
+			break;
+
+				/* write it to sequences of clusters */
+
+		for (pos = 0; pos < n; pos += (int64_t) len * csize) {
+			num = (n - pos + csize - 1) / csize;
+			start = _fatfileallocate(f, &w, num, &len);
+			if (start == FAT_ERR) {
+				res = -2;
+				break;
+			}
+			if (fd != -1 &&
+			    pwrite(f->fd, buffer + pos, (size_t) len * csize,
+			    	f->offset + origin + (uint64_t) start * csize) !=
+			    (ssize_t) len * csize) {
+				perror("writing file");
+				res = -1;
+				break;
+			}
+		}
+		if (res != 0)
+			break;
+
+		written += n;
+		fatprogressstep(f, n, n);
+	}
+	fatprogressend(f);
+
+	free(buffer);
+	if (res != 0) {
+		fatclusterfreechain(f, w.first);
+		*first = FAT_UNUSED;
+		return res;
+	}
+	*first = w.first;
+	return written;
+}
@@ -0,0 +1,71 @@
+/*
+ * file.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * file.h
+ *
+ * copy the content of files from and to file descriptors, bypassing the cache
+ * of clusters
+ *
+ * the data clusters of a file are only copied, never interpreted; caching
+ * them like the directory clusters would only fill memory; the first cluster
+ * and the size in the directory entry of the file are left to the caller
+ */
+
+#ifdef _FILE_H
+#else
+#define _FILE_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/*
+ * copy a chain of clusters to a file descriptor
+ *
+ * the chain starts at cluster first and is followed in the fat of f; the
+ * data is read from the same clusters in the device of data, which is usually
+ * f itself; at most size bytes are copied, or the whole chain if size is -1;
+ * each run of consecutive clusters is copied by a single copy_file_range(),
+ * or by sendfile() if fd does not allow it (like a pipe), or by read() and
+ * write() as a last resort; the data does not go through the cache
+ *
+ * return the number of bytes copied, less than size if the chain is shorter,
+ * or -1 on error
+ */
+int64_t fatfilestream(fat *f, fat *data, int32_t first, int64_t size, int fd);
+
+/*
+ * write what is read from a file descriptor to a new chain of clusters
+ *
+ * the clusters are allocated between begin and end; size is the expected
+ * length, or -1 if unknown: if given, a single sequence of free clusters this
+ * long is searched first; the data is read from fd in chunks of some
+ * megabytes, each written by a pwrite() for every sequence of consecutive
+ * clusters it goes to; the clusters are linked in the fat when allocated, by
+ * extending the previous sequence if the next cluster is free or by taking
+ * the next free one otherwise; if fd is -1, nothing is read or written: the
+ * clusters for size bytes are only allocated
+ *
+ * return the number of bytes written and the first cluster of the chain in
+ * *first (FAT_UNUSED if nothing was written); on error, the chain is freed
+ * and -1 is returned for an IO error, -2 if the filesystem is full
+ */
+int64_t fatfilewrite(fat *f, int fd, int64_t size,
+		int32_t begin, int32_t end, int32_t *first);
+
+#endif
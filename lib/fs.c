@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
 #include "fs.h"
 #include "boot.h"
 #include "table.h"
@@ -66,6 +67,17 @@ fat *fatcreate() {
 
 	f->last = 2;
 	f->free = -1;
+	f->changes = 0;
+
+	pthread_rwlock_init(&f->lock, NULL);
+	f->writer = 0;
+
+	f->progress = NULL;
+	f->progressevery = 0;
+	f->progressinterval = 0;
+	f->progressstate.depth = 0;
+	pthread_mutex_init(&f->progressstate.mutex, NULL);
+
 	f->user = NULL;
 
 	return f;
@@ -207,10 +219,40 @@ int fatcheck(fat *f) {
 /*
  * flush to the filesystem
  */
+void _fatflushcount(unit *u, void *user) {
+	if (u->dirty)
+		(* (int64_t *) user)++;
+}
+
+void _fatflushunit(unit *u, void *user) {
+	int dirty;
+
+	dirty = u->dirty;
+	fatunitwriteback(u);
+	if (dirty)
+		fatprogressstep((fat *) user, 1, u->size);
+}
+
 int fatflush(fat *f) {
+	int64_t dirty;
+
 	/* boot and info sectors are also in the cache */
-	fatunitflush(f->sectors);
-	fatunitflush(f->clusters);
+	if (! fatprogressactive(f)) {
+		fatunitflush(f->sectors);
+		fatunitflush(f->clusters);
+		return 0;
+	}
+
+	dirty = 0;
+	fatunitwalk(f->sectors, _fatflushcount, &dirty);
+	fatunitwalk(f->clusters, _fatflushcount, &dirty);
+	if (dirty == 0)
+		return 0;
+
+	fatprogressbegin(f, "flush", dirty);
+	fatunitwalk(f->sectors, _fatflushunit, f);
+	fatunitwalk(f->clusters, _fatflushunit, f);
+	fatprogressend(f);
 	return 0;
 }
 
@@ -227,10 +269,145 @@ int fatquit(fat *f) {
 		perror("closing");
 		return -1;
 	}
+	pthread_rwlock_destroy(&f->lock);
+	pthread_mutex_destroy(&f->progressstate.mutex);
 	free(f);
 	return 0;
 }
 
+/*
+ * lock the filesystem for reading or writing
+ */
+int fatlockread(fat *f) {
+	if (pthread_rwlock_rdlock(&f->lock))
+		return -1;
+	fatunitreaderbegin();
+	return 0;
+}
+
+int fatlockwrite(fat *f) {
+	if (pthread_rwlock_wrlock(&f->lock))
+		return -1;
+	f->writer = 1;
+	return 0;
+}
+
+int fatunlock(fat *f) {
+	if (f->writer)
+		f->writer = 0;
+	else
+		fatunitreaderend();
+	return pthread_rwlock_unlock(&f->lock) ? -1 : 0;
+}
+
+/*
+ * progress of long operations
+ */
+void fatprogressregister(fat *f, void (*progress)(fat *f, fatprogress *p),
+		int64_t every, int milliseconds) {
+	f->progress = progress;
+	f->progressevery = every;
+	f->progressinterval = milliseconds;
+}
+
+uint64_t _fatprogressnow() {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+void _fatprogresscall(fat *f, fatprogress *p, uint64_t now) {
+	uint64_t elapsed;
+
+	if (p->finished) {
+		p->lasttime = p->starttime;
+		p->lastdone = 0;
+		p->lastbytes = 0;
+	}
+	elapsed = now - p->lasttime;
+	p->rate = elapsed == 0 ? 0 :
+		(p->done - p->lastdone) * 1000.0 / elapsed;
+	p->throughput = elapsed == 0 ? 0 :
+		(p->bytes - p->lastbytes) * 1000.0 / elapsed;
+	f->progress(f, p);
+	p->lastdone = p->done;
+	p->lastbytes = p->bytes;
+	p->lasttime = now;
+}
+
+void fatprogressbegin(fat *f, char *operation, int64_t total) {
+	fatprogress *p;
+
+	if (f->progress == NULL)
+		return;
+
+	p = &f->progressstate;
+	pthread_mutex_lock(&p->mutex);
+	if (p->depth++ == 0) {
+		p->operation = operation;
+		p->done = 0;
+		p->total = total;
+		p->bytes = 0;
+		p->finished = 0;
+		p->lastdone = 0;
+		p->lastbytes = 0;
+		p->starttime = _fatprogressnow();
+		p->lasttime = p->starttime;
+		_fatprogresscall(f, p, p->lasttime);
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+
+void fatprogressstep(fat *f, int64_t done, uint64_t bytes) {
+	fatprogress *p;
+	uint64_t now;
+
+	if (f->progress == NULL)
+		return;
+
+	p = &f->progressstate;
+	pthread_mutex_lock(&p->mutex);
+	if (p->depth == 1) {
+		p->done += done;
+		p->bytes += bytes;
+		if (f->progressevery > 0 &&
+		    p->done - p->lastdone >= f->progressevery)
+			_fatprogresscall(f, p, _fatprogressnow());
+		else if (f->progressinterval > 0) {
+			now = _fatprogressnow();
+			if (now - p->lasttime >= (uint64_t) f->progressinterval)
+				_fatprogresscall(f, p, now);
+		}
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+
+void fatprogressend(fat *f) {
+	fatprogress *p;
+
+	if (f->progress == NULL)
+		return;
+
+	p = &f->progressstate;
+	pthread_mutex_lock(&p->mutex);
+	if (p->depth > 0 && --p->depth == 0) {
+		p->finished = 1;
+		_fatprogresscall(f, p, _fatprogressnow());
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+ * whether a new operation would be reported: a callback is registered and no
+ * other operation is in progress; used to skip the work needed only for
+ * calculating the total
+ */
+int fatprogressactive(fat *f) {
+	return f->progress != NULL &&
+		__atomic_load_n(&f->progressstate.depth, __ATOMIC_ACQUIRE) == 0;
+}
+
 /*
  * close the file
  */
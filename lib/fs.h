@@ -29,12 +29,34 @@
 #define _FS_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include "unit.h"
 
 /*
- * an open fat device or image
+ * progress of a long operation, passed to the callback registered by
+ * fatprogressregister()
  */
 typedef struct {
+	char *operation;			/* what is being done */
+	int64_t done;				/* clusters or units done */
+	int64_t total;				/* estimate, 0 if unknown */
+	uint64_t bytes;				/* bytes moved or written */
+	double rate;				/* done per second */
+	double throughput;			/* bytes per second */
+	int finished;				/* last call */
+
+	int depth;				/* nested operations */
+	uint64_t starttime;			/* milliseconds */
+	int64_t lastdone;			/* at the previous call */
+	uint64_t lastbytes;
+	uint64_t lasttime;			/* milliseconds */
+	pthread_mutex_t mutex;
+} fatprogress;
+
+/*
+ * an open fat device or image
+ */
+typedef struct fat {
 	int fd;
 	char *devicename;
 	uint64_t offset;
@@ -50,6 +72,15 @@ typedef struct {
 
 	int32_t last;				/* last found free cluster */
 	int32_t free;				/* number of free clusters */
+	uint64_t changes;			/* writes to the fat */
+
+	pthread_rwlock_t lock;			/* see fatlockread() */
+	int writer;				/* lock held for writing */
+
+	void (*progress)(struct fat *f, fatprogress *p);
+	int64_t progressevery;			/* call every this many done */
+	int progressinterval;			/* or this many milliseconds */
+	fatprogress progressstate;
 
 	void *user;				/* free for program use */
 } fat;
@@ -68,6 +99,32 @@ int fatflush(fat *f);
 int fatquit(fat *f);
 int fatclose(fat *f);
 
+/*
+ * threads: many threads can read the filesystem at the same time, each
+ * holding the lock for reading; a thread that changes anything (including
+ * cluster allocation, which changes f->last and f->free) holds the lock for
+ * writing, which excludes all others; the unit caches are safe for the
+ * concurrent readers, and no unit is removed from them while any reader holds
+ * the lock
+ */
+int fatlockread(fat *f);
+int fatlockwrite(fat *f);
+int fatunlock(fat *f);
+
+/*
+ * progress of long operations: the callback is called when an operation
+ * begins and ends, and in between every that many clusters or units done or
+ * every that many milliseconds, whichever comes first (0 disables either);
+ * rate and throughput are since the previous call, or since the beginning in
+ * the last call; an operation called by another is not reported separately
+ */
+void fatprogressregister(fat *f, void (*progress)(fat *f, fatprogress *p),
+		int64_t every, int milliseconds);
+void fatprogressbegin(fat *f, char *operation, int64_t total);
+void fatprogressstep(fat *f, int64_t done, uint64_t bytes);
+void fatprogressend(fat *f);
+int fatprogressactive(fat *f);
+
 /*
  * global parameters of a fat
  */
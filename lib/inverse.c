@@ -19,7 +19,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
 #include "fs.h"
 #include "table.h"
@@ -31,6 +34,7 @@
 
 int fatinversedebug = 0;
 #define dprintf if (fatinversedebug) printf
+#define pprintf if (fatparalleldebug) printf
 
 /*
  * set an entry in an inverse fat
@@ -39,18 +43,16 @@ int fatinversedebug = 0;
 void fatinverseclear(fatinverse *rev, int32_t cluster) {
 	if (cluster < 0)
 		return;
-	rev[cluster].directory = NULL;
-	rev[cluster].index = 0;
 	rev[cluster].previous = FAT_UNUSED;
+	rev[cluster].index = 0;
+	rev[cluster].isentry = 0;
 	rev[cluster].isdir = 0;
 }
 
 int fatinverseisvoid(fatinverse *rev, int32_t cluster) {
 	if (cluster < 0)
 		return 1;
-	return fatreferenceisvoid(rev[cluster].directory,
-			rev[cluster].index,
-			rev[cluster].previous);
+	return ! rev[cluster].isentry && rev[cluster].previous == FAT_UNUSED;
 }
 
 int32_t fatinverseset(fat *f, fatinverse *rev,
@@ -59,12 +61,12 @@ int32_t fatinverseset(fat *f, fatinverse *rev,
 	int32_t target;
 
 	target = fatreferencegettarget(f, directory, index, previous);
-	if (target < FAT_ROOT)
+	if (target < FAT_ROOT || target > fatlastcluster(f))
 		return FAT_ERR;
 
-	rev[target].directory = directory;
-	rev[target].index = index;
-	rev[target].previous = previous;
+	rev[target].previous = directory == NULL ? previous : directory->n;
+	rev[target].index = directory == NULL ? 0 : index;
+	rev[target].isentry = directory != NULL;
 	if (isdir != -1)
 		rev[target].isdir = isdir;
 
@@ -72,76 +74,217 @@ int32_t fatinverseset(fat *f, fatinverse *rev,
 }
 
 /*
- * create an empty inverse fat
+ * a directory cluster moved from src to dst: its entries are now in dst
  */
-fatinverse *fatinverseempty(fat *f, int file) {
-	fatinverse *rev;
+void _fatinverserenumber(fat *f, fatinverse *rev, int32_t src, int32_t dst) {
+	unit *directory;
+	int index;
+	int32_t target;
+
+	directory = fatclusterread(f, dst);
+	if (directory == NULL)
+		return;
+
+	for (index = 0; index < directory->size / 32; index++) {
+		if (fatentryend(directory, index))
+			break;
+		target = fatentrygetfirstcluster(directory, index, f->bits);
+		if (target < FAT_FIRST || target > fatlastcluster(f))
+			continue;
+		if (rev[target].isentry && rev[target].previous == src &&
+		    (int) rev[target].index == index)
+			rev[target].previous = dst;
+	}
+}
+
+/*
+ * create an empty inverse fat; it is preceded by a header telling how it was
+ * allocated; when saved to a file, the header also identifies the filesystem
+ * and the state of its fat
+ */
+
+#define FATINVERSEMAGIC "llfatin1"
+
+struct fatinverseheader {
+	char magic[8];				/* only when complete */
+	uint32_t dirty;				/* in use, or not closed */
+	int32_t last;				/* last cluster */
+	uint64_t geometry;			/* hash of boot parameters */
+	uint64_t checksum;			/* hash of the fat */
+	uint64_t changes;			/* f->changes when in sync */
+
+	char *filename;				/* not meaningful on file */
+	size_t size;
+	int file;				/* memory, temporary, saved */
+	int loaded;				/* entries not yet checked */
+};
+
+#define FATINVERSEHEADER(rev) (((struct fatinverseheader *) (rev)) - 1)
+
+fatinverse *_fatinverseempty(fat *f, char *name, int file) {
+	struct fatinverseheader *header;
 	char filename[] = "/tmp/inversefat-XXXXXX";
 	char c = '\0';
 	int fd;
-	int size;
+	size_t size;
 
-	size = sizeof(fatinverse) * (fatlastcluster(f) + 2);
+	size = sizeof(struct fatinverseheader) +
+		sizeof(fatinverse) * (fatlastcluster(f) + 2);
 
 	if (! file)
-		rev = malloc(size);
+		header = calloc(1, size);
 	else {
-		fd = mkstemp(filename);
+		if (name == NULL)
+			fd = mkstemp(filename);
+		else
+			fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
 		if (fd == -1) {
-			perror("mkstemp");
+			perror(name == NULL ? "mkstemp" : name);
 			return NULL;
 		}
 
 		if ((off_t) -1 == lseek(fd, size - 1, SEEK_SET)) {
 			perror("inverse FAT creation, lseek");
+			close(fd);
 			return NULL;
 		}
 		if (1 > write(fd, &c, 1)) {
 			perror("inverse FAT creation, write");
+			close(fd);
 			return NULL;
 		}
 
-		rev = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
 			fd, 0);
+		close(fd);
+		if (header == MAP_FAILED)
+			header = NULL;
 	}
 
-	if (rev == NULL) {
+	if (header == NULL) {
 		dprintf("not enough memory/disk space for an inverse FAT ");
 		dprintf("array for %d clusters\n", fatlastcluster(f) + 1);
 		return NULL;
 	}
 
-	rev[0].directory = file ? (unit *) strdup(filename) : NULL;
-	rev[0].index = size;
-	rev[0].previous = file;
+	header->filename = file ? strdup(name == NULL ? filename : name) : NULL;
+	header->size = size;
+	header->file = file;
+	header->loaded = 0;
+	header->changes = f->changes;
 
-	return rev;
+	return (fatinverse *) (header + 1);
+}
+
+fatinverse *fatinverseempty(fat *f, int file) {
+	return _fatinverseempty(f, NULL, file);
+}
+
+/*
+ * hash of the boot parameters, to tell whether a saved inverse fat is for the
+ * filesystem
+ */
+uint64_t _fatinversegeometry(fat *f) {
+	return fathash(fatgeometry(f), sizeof(fatinverse));
+}
+
+/*
+ * map a saved inverse fat, if it is valid for the filesystem
+ */
+fatinverse *_fatinverseload(fat *f, char *name) {
+	struct fatinverseheader saved, *header;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	fd = open(name, O_RDWR);
+	if (fd == -1) {
+		dprintf("no saved inverse fat %s\n", name);
+		return NULL;
+	}
+
+	size = sizeof(struct fatinverseheader) +
+		sizeof(fatinverse) * (fatlastcluster(f) + 2);
+
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size != size ||
+	    pread(fd, &saved, sizeof(saved), 0) != sizeof(saved) ||
+	    memcmp(saved.magic, FATINVERSEMAGIC, 8) ||
+	    saved.dirty ||
+	    saved.last != fatlastcluster(f) ||
+	    saved.geometry != _fatinversegeometry(f) ||
+	    saved.checksum != fathashtable(f)) {
+		dprintf("saved inverse fat %s is not valid\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED)
+		return NULL;
+
+	header->filename = strdup(name);
+	header->size = size;
+	header->file = 2;
+	header->loaded = 1;
+
+	dprintf("reusing saved inverse fat %s\n", name);
+	return (fatinverse *) (header + 1);
+}
+
+/*
+ * whether the fat was only changed by the functions of the inverse fat since
+ * it was last in sync with it; each of them calls _fatinversesync() at the
+ * end, so that a change by any other function is detected when saving
+ */
+int _fatinversesynced(fat *f, fatinverse *rev) {
+	return FATINVERSEHEADER(rev)->changes == f->changes;
+}
+
+void _fatinversesync(fat *f, fatinverse *rev, int synced) {
+	if (synced)
+		FATINVERSEHEADER(rev)->changes = f->changes;
 }
 
 /*
- * delete an inverse fat
+ * delete an inverse fat; a saved one is marked as valid for the current
+ * state of the fat and left in its file, unless the fat was changed without
+ * updating it
  */
 int fatinversedelete(fat *f, fatinverse *rev) {
-	int32_t cl;
+	struct fatinverseheader *header;
 	char *filename;
+	int file;
 
 	if (rev == NULL)
 		return -1;
 
-	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
-		if (rev[cl].directory != NULL &&
-				--rev[cl].directory->refer == 0) {
-			dprintf("delete %d\n", rev[cl].directory->n);
-			fatunitdelete(&f->clusters, rev[cl].directory->n);
+	header = FATINVERSEHEADER(rev);
+	if (! header->file)
+		free(header);
+	else if (header->file == 2 &&
+	         ! memcmp(header->magic, FATINVERSEMAGIC, 8)) {
+		filename = header->filename;
+		if (! _fatinversesynced(f, rev)) {
+			dprintf("fat changed, inverse fat %s left invalid\n",
+				filename);
 		}
-
-	if (! rev[0].previous)
-		free(rev);
+		else {
+			header->checksum = fathashtable(f);
+			header->dirty = 0;
+		}
+		header->filename = NULL;
+		msync(header, header->size, MS_SYNC);
+		munmap(header, header->size);
+		free(filename);
+	}
 	else {
-		filename = (char *) rev[0].directory;
-		munmap(rev, rev[0].index);
+		filename = header->filename;
+		file = header->file;
+		munmap(header, header->size);
 		unlink(filename);
-		printf("rm %s\n", filename);
+		if (file == 1)
+			printf("rm %s\n", filename);
 		free(filename);
 	}
 	return 0;
@@ -177,29 +320,392 @@ int _fatinversecreate(fat *f,
 
 	isdir = FATEXECUTEISDIR;
 
-	target = fatinverseset(f, rev, directory, index, previous, isdir);
-
-	/* the cluster is now the target of another pointer */
-	if (directory != NULL && target != FAT_ERR)
-		directory->refer++;
+	fatinverseset(f, rev, directory, index, previous, isdir);
+	if (target >= FAT_FIRST)
+		fatprogressstep(f, 1, 0);
 
 	return FAT_REFERENCE_NORMAL;
 }
 
-fatinverse *fatinversecreate(fat *f, int file) {
+/*
+ * build an inverse fat with many threads
+ *
+ * each thread links the clusters in a range of the fat to their successors;
+ * then the threads take directories from a queue, set the references of their
+ * entries and follow the chains from them, marking the clusters reached; the
+ * clusters not reached are cleared at the end
+ *
+ * the serial construction stops a chain at a cluster already referenced, so
+ * that its result depends on the order of visit when a cluster is the target
+ * of two references; this and the other cases where the two constructions may
+ * differ make the threads stop, and the serial construction is used instead
+ */
+
+int fatinversethreads = 0;
+
+struct fatinversedir {
+	int32_t cluster;
+	int depth;
+	struct fatinversedir *next;
+};
+
+struct fatinverseparallel {
+	fat *f;
 	fatinverse *rev;
-	int res;
-	int cl;
+	int32_t last;
+	int chains;				/* for fatinversechains() */
+	unsigned char *reached;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;
+	struct fatinversedir *queue;
+	int pending;				/* queued or being read */
+	int fallback;				/* use the serial one */
+};
+
+struct fatinversethread {
+	pthread_t thread;
+	struct fatinverseparallel *p;
+	int32_t first;
+	int32_t end;
+};
+
+void _fatinversefallback(struct fatinverseparallel *p, char *why, int32_t cl) {
+	if (__atomic_exchange_n(&p->fallback, 1, __ATOMIC_ACQ_REL))
+		return;
+	pprintf("%s %d, using the serial inverse fat\n", why, cl);
+}
 
-	rev = fatinverseempty(f, file);
-	if (rev == NULL)
-		return NULL;
+int _fatinverseisfallback(struct fatinverseparallel *p) {
+	return __atomic_load_n(&p->fallback, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * mark a cluster as reached; return whether it already was
+ */
+int _fatinversereached(struct fatinverseparallel *p, int32_t cl) {
+	unsigned char bit;
+
+	bit = 1 << (cl % 8);
+	return __atomic_fetch_or(&p->reached[cl / 8], bit, __ATOMIC_ACQ_REL) &
+		bit;
+}
+
+/*
+ * link each cluster in a range to its successor
+ */
+void *_fatinverselink(void *arg) {
+	struct fatinversethread *t;
+	struct fatinverseparallel *p;
+	int32_t cl, next, old;
+
+	t = (struct fatinversethread *) arg;
+	p = t->p;
+
+	fatlockread(p->f);
+	for (cl = t->first; cl < t->end && ! _fatinverseisfallback(p); cl++) {
+		next = fatgetnextcluster(p->f, cl);
+		if (next < FAT_ROOT || next > p->last)
+			continue;
+
+		old = __atomic_load_n(&p->rev[next].previous, __ATOMIC_ACQUIRE);
+
+				/* fatinversechains: the last one wins */
+
+		if (p->chains) {
+			while (cl > old &&
+			       ! __atomic_compare_exchange_n(
+					&p->rev[next].previous, &old, cl, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				;
+			continue;
+		}
+
+		if (next < FAT_FIRST || old != FAT_UNUSED ||
+		    ! __atomic_compare_exchange_n(&p->rev[next].previous,
+				&old, cl, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			_fatinversefallback(p, "two predecessors for cluster",
+				next);
+	}
+	fatunlock(p->f);
+
+	return NULL;
+}
+
+/*
+ * set the reference of the first cluster of a chain and follow it
+ */
+void _fatinversefollow(struct fatinverseparallel *p,
+		int32_t previous, int index, int isentry,
+		int32_t target, int isdir) {
+	fatinverse *rev;
+	int32_t scan, next;
+	int n;
+
+	rev = p->rev;
+
+	if (target > p->last || (target == FAT_ROOT && isentry)) {
+		_fatinversefallback(p, "invalid first cluster", target);
+		return;
+	}
+	if (_fatinversereached(p, target) ||
+	    (target >= FAT_FIRST && rev[target].previous != FAT_UNUSED)) {
+		_fatinversefallback(p, "cross-linked cluster", target);
+		return;
+	}
+	rev[target].previous = previous;
+	rev[target].index = index;
+	rev[target].isentry = isentry;
+	rev[target].isdir = isdir;
+
+	n = 1;
+	for (scan = target; ! _fatinverseisfallback(p); scan = next) {
+		next = fatgetnextcluster(p->f, scan);
+		if (next < FAT_ROOT)
+			break;
+		if (next < FAT_FIRST || next > p->last) {
+			_fatinversefallback(p, "invalid next cluster", scan);
+			break;
+		}
+		if (_fatinversereached(p, next) ||
+		    rev[next].previous != scan || rev[next].isentry) {
+			_fatinversefallback(p, "cross-linked cluster", next);
+			break;
+		}
+		rev[next].isdir = isdir;
+		n++;
+	}
+	fatprogressstep(p->f, n, 0);
+}
+
+void _fatinversequeue(struct fatinverseparallel *p, int32_t cl, int depth) {
+	struct fatinversedir *d;
+
+	d = malloc(sizeof(struct fatinversedir));
+	if (d == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	d->cluster = cl;
+	d->depth = depth;
+
+	pthread_mutex_lock(&p->mutex);
+	d->next = p->queue;
+	p->queue = d;
+	p->pending++;
+	pthread_cond_broadcast(&p->queued);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+ * set the references of the entries of a directory, the same that
+ * fatreferenceexecute() visits
+ */
+void _fatinversedirectory(struct fatinverseparallel *p,
+		struct fatinversedir *d) {
+	unit *directory;
+	int index, err, isdir;
+	int32_t target;
+
+	directory = fatclusterread(p->f, d->cluster);
+	if (directory == NULL) {
+		_fatinversefallback(p, "cannot read directory", d->cluster);
+		return;
+	}
+
+	for (index = -1; ! _fatinverseisfallback(p); ) {
+		err = fatnextentry(p->f, &directory, &index);
+		if (err == -1 || err == 1)
+			break;
+		if (err) {
+			_fatinversefallback(p, "cannot read directory",
+				d->cluster);
+			break;
+		}
+
+		if (! (fatentryclass(directory, index) & FAT_CLASS_EXISTS) ||
+		    ! fatentryexists(directory, index) ||
+		    fatentryislongpart(directory, index) ||
+		    fatentryisdotfile(directory, index))
+			continue;
+
+		target = fatentrygetfirstcluster(directory, index, p->f->bits);
+		if (target == FAT_UNUSED)
+			continue;
+		isdir = ! ! fatentryisdirectory(directory, index);
+
+		_fatinversefollow(p, directory->n, index, 1, target, isdir);
+		if (! isdir)
+			continue;
+
+		if (fatreferencemaxdepth > 0 &&
+		    d->depth + 1 >= fatreferencemaxdepth)
+			_fatinversefallback(p, "too deep directory", target);
+		else
+			_fatinversequeue(p, target, d->depth + 1);
+	}
+}
+
+/*
+ * a thread: process directories from the queue until none is left
+ */
+void *_fatinversewalk(void *arg) {
+	struct fatinversethread *t;
+	struct fatinverseparallel *p;
+	struct fatinversedir *d;
+
+	t = (struct fatinversethread *) arg;
+	p = t->p;
+
+	fatlockread(p->f);
+	pthread_mutex_lock(&p->mutex);
+	while (1) {
+		while (p->queue == NULL && p->pending > 0)
+			pthread_cond_wait(&p->queued, &p->mutex);
+		if (p->queue == NULL)
+			break;
+		d = p->queue;
+		p->queue = d->next;
+		pthread_mutex_unlock(&p->mutex);
+
+		if (! _fatinverseisfallback(p))
+			_fatinversedirectory(p, d);
+		free(d);
+
+		pthread_mutex_lock(&p->mutex);
+		p->pending--;
+		pthread_cond_broadcast(&p->queued);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	fatunlock(p->f);
+
+	return NULL;
+}
+
+/*
+ * clear the clusters in a range that are not reached from any directory
+ */
+void *_fatinverseunreached(void *arg) {
+	struct fatinversethread *t;
+	int32_t cl;
+
+	t = (struct fatinversethread *) arg;
+	for (cl = t->first; cl < t->end; cl++)
+		if (! (t->p->reached[cl / 8] & (1 << (cl % 8))))
+			fatinverseclear(t->p->rev, cl);
+
+	return NULL;
+}
+
+/*
+ * run a function in each thread, on a range of clusters each
+ */
+void _fatinverserun(struct fatinverseparallel *p, int threads,
+		void *(*run)(void *)) {
+	struct fatinversethread *t;
+	int32_t n;
+	int i;
+
+	t = malloc(threads * sizeof(struct fatinversethread));
+	if (t == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	n = (p->last - FAT_FIRST + threads) / threads;
+	for (i = 0; i < threads; i++) {
+		t[i].p = p;
+		t[i].first = FAT_FIRST + i * n;
+		t[i].end = t[i].first + n > p->last + 1 ?
+			p->last + 1 : t[i].first + n;
+		pthread_create(&t[i].thread, NULL, run, &t[i]);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(t[i].thread, NULL);
+
+	free(t);
+}
+
+/*
+ * fill an inverse fat with many threads; return 0 if done, 1 if the serial
+ * construction is to be used instead
+ */
+int _fatinversefillparallel(fat *f, fatinverse *rev, int chains, int threads) {
+	struct fatinverseparallel p;
+	int32_t root;
+
+	p.f = f;
+	p.rev = rev;
+	p.last = fatlastcluster(f);
+	p.chains = chains;
+	p.fallback = 0;
+	p.queue = NULL;
+	p.pending = 0;
+	p.reached = calloc(p.last / 8 + 1, 1);
+	if (p.reached == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	pthread_mutex_init(&p.mutex, NULL);
+	pthread_cond_init(&p.queued, NULL);
+
+	pprintf("inverse fat with %d threads\n", threads);
+
+	_fatinverserun(&p, threads, _fatinverselink);
+
+	if (! chains && ! p.fallback) {
+		root = fatreferencegettarget(f, NULL, 0, -1);
+		_fatinversefollow(&p, -1, 0, 0, root, 1);
+		_fatinversequeue(&p, root, 0);
+		_fatinverserun(&p, threads, _fatinversewalk);
+	}
+
+	if (! chains && ! p.fallback)
+		_fatinverserun(&p, threads, _fatinverseunreached);
+
+	pthread_cond_destroy(&p.queued);
+	pthread_mutex_destroy(&p.mutex);
+	free(p.reached);
+	return p.fallback;
+}
+
+int _fatinversefill(fat *f, fatinverse *rev) {
+	int64_t used;
+	int cl, res;
+
+	used = ! fatprogressactive(f) ? 0 :
+		fatlastcluster(f) - FAT_FIRST + 1 - fatclusternumfree(f);
+
+	for (cl = FAT_ROOT; cl <= fatlastcluster(f); cl++)
+		fatinverseclear(rev, cl);
+
+	if (fatinversethreads > 1) {
+		fatprogressbegin(f, "inverse fat", used);
+		res = _fatinversefillparallel(f, rev, 0, fatinversethreads);
+		fatprogressend(f);
+		if (! res)
+			return 0;
+	}
 
 	for (cl = FAT_ROOT; cl <= fatlastcluster(f); cl++)
 		fatinverseclear(rev, cl);
 
+	fatprogressbegin(f, "inverse fat", used);
+	fatdirectoryprefetch(f, FAT_ROOT);
 	res = fatreferenceexecute(f, NULL, 0, -1, _fatinversecreate, rev);
-	if (res) {
+	fatprogressend(f);
+	return res;
+}
+
+fatinverse *fatinversecreate(fat *f, int file) {
+	fatinverse *rev;
+
+	rev = fatinverseempty(f, file);
+	if (rev == NULL)
+		return NULL;
+
+	if (_fatinversefill(f, rev)) {
 		dprintf("error while filling the inverse FAT\n");
 		fatinversedelete(f, rev);
 		return NULL;
@@ -208,6 +714,103 @@ fatinverse *fatinversecreate(fat *f, int file) {
 	return rev;
 }
 
+/*
+ * whether the entry of a loaded inverse fat no longer points to the cluster
+ */
+int _fatinversestale(fat *f, fatinverse *rev, int32_t cluster,
+		unit *directory, int index) {
+	if (! FATINVERSEHEADER(rev)->loaded)
+		return 0;
+	return ! fatentryexists(directory, index) ||
+		fatentryislongpart(directory, index) ||
+		fatentrygetfirstcluster(directory, index, fatbits(f)) !=
+			cluster ||
+		! ! fatentryisdirectory(directory, index) != rev[cluster].isdir;
+}
+
+/*
+ * refill a loaded inverse fat that does not match the directory entries
+ */
+int _fatinverserebuild(fat *f, fatinverse *rev) {
+	printf("saved inverse fat does not match the directories, ");
+	printf("rebuilding it\n");
+	FATINVERSEHEADER(rev)->loaded = 0;
+	if (_fatinversefill(f, rev)) {
+		dprintf("error while filling the inverse FAT\n");
+		return -1;
+	}
+	_fatinversesync(f, rev, 1);
+	return 0;
+}
+
+/*
+ * the reference to a cluster; the directory cluster is read if necessary
+ *
+ * a saved inverse fat is only known to match the fat; the directory entries
+ * may have changed since it was saved, so each is checked the first time it
+ * is used, and the whole inverse fat is rebuilt if one is not as recorded
+ */
+int fatinverseget(fat *f, fatinverse *rev, int32_t cluster,
+		unit **directory, int *index, int32_t *previous) {
+	if (! rev[cluster].isentry) {
+		*directory = NULL;
+		*index = 0;
+		*previous = rev[cluster].previous;
+		return 0;
+	}
+
+	*directory = fatclusterread(f, rev[cluster].previous);
+	*index = rev[cluster].index;
+	*previous = 0;
+	if (*directory == NULL)
+		return -1;
+
+	if (_fatinversestale(f, rev, cluster, *directory, *index)) {
+		if (_fatinverserebuild(f, rev))
+			return -1;
+		return fatinverseget(f, rev, cluster,
+			directory, index, previous);
+	}
+	return 0;
+}
+
+/*
+ * open the inverse fat saved in a file, or create it there; the file is
+ * marked dirty until the inverse fat is deleted, so that it is rebuilt if the
+ * program terminates in between
+ */
+char *fatinversefile = NULL;
+
+fatinverse *fatinverseopen(fat *f, char *filename) {
+	struct fatinverseheader *header;
+	fatinverse *rev;
+
+	if (filename == NULL)
+		return fatinversecreate(f, 0);
+
+	rev = _fatinverseload(f, filename);
+	if (rev == NULL) {
+		rev = _fatinverseempty(f, filename, 2);
+		if (rev == NULL)
+			return NULL;
+		if (_fatinversefill(f, rev)) {
+			dprintf("error while filling the inverse FAT\n");
+			fatinversedelete(f, rev);
+			return NULL;
+		}
+	}
+
+	header = FATINVERSEHEADER(rev);
+	memcpy(header->magic, FATINVERSEMAGIC, 8);
+	header->dirty = 1;
+	header->last = fatlastcluster(f);
+	header->geometry = _fatinversegeometry(f);
+	header->changes = f->changes;
+	msync(header, sizeof(struct fatinverseheader), MS_SYNC);
+
+	return rev;
+}
+
 /*
  * inverse fat of all chains of clusters, including the unrecheable ones
  */
@@ -219,8 +822,11 @@ fatinverse *fatinversechains(fat *f, int file) {
 	if (rev == NULL)
 		return NULL;
 
-	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
-		fatinverseset(f, rev, NULL, 0, cl, 0);
+	if (fatinversethreads > 1)
+		_fatinversefillparallel(f, rev, 1, fatinversethreads);
+	else
+		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+			fatinverseset(f, rev, NULL, 0, cl, 0);
 
 	return rev;
 }
@@ -229,16 +835,19 @@ fatinverse *fatinversechains(fat *f, int file) {
  * print a reverse reference
  */
 void fatinverseprint(fat *f, fatinverse *rev, int32_t cl) {
-	int32_t target;
+	unit *directory;
+	int index;
+	int32_t previous, target;
 
 	printf("%d", cl);
-	if (rev[cl].directory == NULL)
+	if (! rev[cl].isentry)
 		printf(" [- - %d", rev[cl].previous);
 	else
-		printf(" [%d %d -", rev[cl].directory->n, rev[cl].index);
+		printf(" [%d %d -", rev[cl].previous, rev[cl].index);
 	printf("%s", rev[cl].isdir ? " dir]" : "]");
-	target = fatreferencegettarget(f,
-			rev[cl].directory, rev[cl].index, rev[cl].previous);
+	target = fatinverseget(f, rev, cl, &directory, &index, &previous) ?
+		FAT_ERR :
+		fatreferencegettarget(f, directory, index, previous);
 	if (target == FAT_ERR)
 		printf(" -");
 	else
@@ -288,6 +897,9 @@ int fatinversecheck(fat *f, fatinverse *rev, int file) {
 void fatinversesettarget(fat *f, fatinverse *rev,
 		unit *directory, int index, int32_t previous,
 		int32_t new, int isdir) {
+	int synced;
+
+	synced = _fatinversesynced(f, rev);
 	fatreferencesettarget(f, directory, index, previous, new);
 
 	if (isdir == -1) {
@@ -302,14 +914,16 @@ void fatinversesettarget(fat *f, fatinverse *rev,
 		fatinverseclear(rev, previous);
 	else
 		fatinverseset(f, rev, directory, index, previous, isdir);
+	_fatinversesync(f, rev, synced);
 }
 
 int fatinversemovereference(fat *f, fatinverse *rev,
 		unit *directory, int index, int32_t previous, int isdir,
 		int32_t dst, int writeback) {
 	int32_t src;
-	int res;
+	int synced, res;
 
+	synced = _fatinversesynced(f, rev);
 	src = fatreferencegettarget(f, directory, index, previous);
 
 	/* fail if the source cluster cannot be read or is unused or the
@@ -322,6 +936,9 @@ int fatinversemovereference(fat *f, fatinverse *rev,
 	fatinverseset(f, rev, NULL, 0, dst, -1);
 
 	fatinverseclear(rev, src);
+	if (rev[dst].isdir)
+		_fatinverserenumber(f, rev, src, dst);
+	_fatinversesync(f, rev, synced);
 	return 0;
 }
 
@@ -332,23 +949,54 @@ int fatinversemove(fat *f, fatinverse *rev,
 	int32_t previous;
 	int isdir;
 
-	directory = rev[src].directory;
-	index =     rev[src].index;
-	previous =  rev[src].previous;
-	isdir =     rev[src].isdir;
+	if (fatinverseget(f, rev, src, &directory, &index, &previous))
+		return -1;
+	isdir = rev[src].isdir;
 
 	return fatinversemovereference(f, rev,
 			directory, index, previous, isdir,
 			dst, writeback);
 }
 
+int fatinversemoverun(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous, int isdir,
+		int32_t dst, int num, int writeback) {
+	int32_t src;
+	int i, synced, res;
+
+	synced = _fatinversesynced(f, rev);
+	src = fatreferencegettarget(f, directory, index, previous);
+
+	/* fail if the source clusters cannot be read or are not a run, or the
+	   destination clusters are not free */
+	res = fatclustermoverun(f, directory, index, previous,
+		dst, num, writeback);
+	if (res)
+		return res;
+
+	for (i = 0; i < num; i++) {
+		rev[dst + i] = rev[src + i];
+		fatinverseclear(rev, src + i);
+	}
+	for (i = 0; i < num; i++)
+		fatinverseset(f, rev, NULL, 0, dst + i, -1);
+	fatinverseset(f, rev, directory, index, previous, isdir);
+
+	for (i = 0; i < num; i++)
+		if (rev[dst + i].isdir)
+			_fatinverserenumber(f, rev, src + i, dst + i);
+	_fatinversesync(f, rev, synced);
+	return 0;
+}
+
 int fatinverseswapreference(fat *f, fatinverse *rev,
 		unit *srcdir, int srcindex, int32_t srcprevious, int srcisdir,
 		unit *dstdir, int dstindex, int32_t dstprevious, int dstisdir,
 		int writeback) {
 	int32_t src, dst;
-	int res;
+	int synced, res;
 
+	synced = _fatinversesynced(f, rev);
 	src = fatreferencegettarget(f, srcdir, srcindex, srcprevious);
 	dst = fatreferencegettarget(f, dstdir, dstindex, dstprevious);
 
@@ -366,6 +1014,12 @@ int fatinverseswapreference(fat *f, fatinverse *rev,
 	fatinverseset(f, rev, dstdir, dstindex, dstprevious, dstisdir);
 	fatinverseset(f, rev, NULL, 0, dst, -1);
 
+	if (rev[dst].isdir)
+		_fatinverserenumber(f, rev, src, dst);
+	if (rev[src].isdir)
+		_fatinverserenumber(f, rev, dst, src);
+
+	_fatinversesync(f, rev, synced);
 	return 0;
 }
 
@@ -377,15 +1031,13 @@ int fatinverseswap(fat *f, fatinverse *rev,
 	int32_t srcprevious, dstprevious;
 	int srcisdir, dstisdir;
 
-	srcdir =      rev[src].directory;
-	srcindex =    rev[src].index;
-	srcprevious = rev[src].previous;
-	srcisdir =    rev[src].isdir;
+	if (fatinverseget(f, rev, src, &srcdir, &srcindex, &srcprevious))
+		return -1;
+	srcisdir = rev[src].isdir;
 
-	dstdir =      rev[dst].directory;
-	dstindex =    rev[dst].index;
-	dstprevious = rev[dst].previous;
-	dstisdir =    rev[dst].isdir;
+	if (fatinverseget(f, rev, dst, &dstdir, &dstindex, &dstprevious))
+		return -1;
+	dstisdir = rev[dst].isdir;
 
 	return fatinverseswapreference(f, rev,
 			srcdir, srcindex, srcprevious, srcisdir,
@@ -393,17 +1045,167 @@ int fatinverseswap(fat *f, fatinverse *rev,
 			writeback);
 }
 
+/*
+ * rotate clusters: cycle[i] goes to cycle[i+1] and the last to cycle[0]; all
+ * clusters are read before anything is written, so that each is read and
+ * written once; the references to a cluster from outside the cycle change
+ * with it, those from inside follow the rotation
+ */
+
+struct fatinverserotation {
+	int32_t cl;
+	int pos;
+};
+
+int _fatinversecomparerotation(const void *a, const void *b) {
+	int32_t x, y;
+	x = ((struct fatinverserotation *) a)->cl;
+	y = ((struct fatinverserotation *) b)->cl;
+	return x < y ? -1 : x == y ? 0 : 1;
+}
+
+int32_t _fatinverserotated(struct fatinverserotation *sorted,
+		int32_t *cycle, int n, int32_t cl) {
+	struct fatinverserotation k, *r;
+
+	if (cl < FAT_FIRST)
+		return cl;
+	k.cl = cl;
+	r = bsearch(&k, sorted, n, sizeof(k), _fatinversecomparerotation);
+	return r == NULL ? cl : cycle[(r->pos + 1) % n];
+}
+
+int fatinverserotate(fat *f, fatinverse *rev, int32_t *cycle, int n,
+		int writeback) {
+	struct fatinverserotation *sorted;
+	unit **units, *directory;
+	int32_t *next, dst, previous;
+	fatinverse *old;
+	int i, index, synced, res;
+
+	if (n <= 1)
+		return n == 1 ? 0 : -1;
+
+	synced = _fatinversesynced(f, rev);
+
+	sorted = malloc(n * sizeof(struct fatinverserotation));
+	units = malloc(n * sizeof(unit *));
+	next = malloc(n * sizeof(int32_t));
+	old = malloc(n * sizeof(fatinverse));
+	if (sorted == NULL || units == NULL || next == NULL || old == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+			/* save the chains and the references */
+
+	res = -1;
+	for (i = 0; i < n; i++)
+		if (rev[cycle[i]].isentry &&
+		    fatinverseget(f, rev, cycle[i],
+				&directory, &index, &previous))
+			goto out;
+	for (i = 0; i < n; i++) {
+		next[i] = fatgetnextcluster(f, cycle[i]);
+		if (next[i] == FAT_UNUSED)
+			goto out;
+		old[i] = rev[cycle[i]];
+		sorted[i].cl = cycle[i];
+		sorted[i].pos = i;
+	}
+	qsort(sorted, n, sizeof(struct fatinverserotation),
+		_fatinversecomparerotation);
+
+			/* read all clusters before changing anything */
+
+	res = -2;
+	for (i = 0; i < n; i++) {
+		units[i] = fatclusterread(f, cycle[i]);
+		if (units[i] == NULL)
+			goto out;
+	}
+
+			/* move them in cache and write them */
+
+	for (i = 0; i < n; i++)
+		fatunitdetach(&f->clusters, cycle[i]);
+	for (i = 0; i < n; i++) {
+		units[i]->n = cycle[(i + 1) % n];
+		fatunitinsert(&f->clusters, units[i], 1);
+	}
+
+	res = -3;
+	for (i = 0; writeback && i < n; i++)
+		if (fatunitwriteback(units[i])) {
+			for (i = 0; i < n; i++)
+				fatunitdetach(&f->clusters, units[i]->n);
+			for (i = 0; i < n; i++) {
+				units[i]->n = cycle[i];
+				fatunitinsert(&f->clusters, units[i], 1);
+				fatunitwriteback(units[i]);
+			}
+			goto out;
+		}
+
+			/* chains and references from outside the cycle */
+
+	for (i = 0; i < n; i++) {
+		dst = cycle[(i + 1) % n];
+		fatsetnextcluster(f, dst,
+			_fatinverserotated(sorted, cycle, n, next[i]));
+
+		if (old[i].isentry) {
+			directory = fatclusterread(f, _fatinverserotated(sorted,
+				cycle, n, old[i].previous));
+			if (directory != NULL)
+				fatreferencesettarget(f,
+					directory, old[i].index, 0, dst);
+		}
+		else if (old[i].previous == -1)
+			fatreferencesettarget(f, NULL, 0, -1, dst);
+		else if (old[i].previous >= FAT_FIRST &&
+		         _fatinverserotated(sorted, cycle, n,
+					old[i].previous) == old[i].previous)
+			fatsetnextcluster(f, old[i].previous, dst);
+	}
+
+			/* inverse fat */
+
+	for (i = 0; i < n; i++) {
+		dst = cycle[(i + 1) % n];
+		rev[dst] = old[i];
+		if (old[i].isentry || old[i].previous >= FAT_FIRST)
+			rev[dst].previous = _fatinverserotated(sorted,
+				cycle, n, old[i].previous);
+	}
+	for (i = 0; i < n; i++)
+		fatinverseset(f, rev, NULL, 0, cycle[(i + 1) % n], -1);
+	for (i = 0; i < n; i++)
+		if (old[i].isdir)
+			_fatinverserenumber(f, rev,
+				cycle[i], cycle[(i + 1) % n]);
+
+	res = 0;
+	_fatinversesync(f, rev, synced);
+
+out:
+	free(sorted);
+	free(units);
+	free(next);
+	free(old);
+	return res;
+}
+
 /*
  * go upstream from a cluster reference to a directory entry, if any
  */
-int fatinversereferencetoentry(fatinverse *rev,
+int fatinversereferencetoentry(fat *f, fatinverse *rev,
 		unit **directory, int *index, int32_t *previous) {
 
-	while (fatreferenceiscluster(*directory, *index, *previous)) {
-		*directory =	rev[*previous].directory;
-		*index = 	rev[*previous].index;
-		*previous =	rev[*previous].previous;
-	}
+	while (fatreferenceiscluster(*directory, *index, *previous))
+		if (fatinverseget(f, rev, *previous,
+				directory, index, previous))
+			return 1;
 
 	return *directory == NULL;
 }
@@ -411,7 +1213,7 @@ int fatinversereferencetoentry(fatinverse *rev,
 /*
  * reconstruct the path of the file from a reference
  */
-char *fatinversepath(fatinverse *rev,
+char *fatinversepath(fat *f, fatinverse *rev,
 		unit *directory, int index, int32_t previous) {
 	char shortname[13];
 	char *path;
@@ -423,7 +1225,8 @@ char *fatinversepath(fatinverse *rev,
 	while (! fatreferenceisvoid(directory, index, previous) &&
 	       ! fatreferenceisboot(directory, index, previous)) {
 
-		fatinversereferencetoentry(rev, &directory, &index, &previous);
+		fatinversereferencetoentry(f, rev,
+			&directory, &index, &previous);
 
 		if (fatreferenceisboot(directory, index, previous))
 			shortname[0] = '\0';
@@ -459,7 +1262,8 @@ int fatinversepreventry(fat *f, fatinverse *rev,
 	if (*index > 0)
 		(*index)--;
 	else {
-		dir = rev[(*directory)->n].previous;
+		dir = rev[(*directory)->n].isentry ?
+			FAT_UNUSED : rev[(*directory)->n].previous;
 		if (dir < FAT_ROOT)
 			return -1;
 		*directory = fatclusterread(f, dir);
@@ -473,10 +1277,46 @@ int fatinversepreventry(fat *f, fatinverse *rev,
 
 /*
  * view and possibly fix the unused clusters marked used
+ *
+ * instead of an inverse fat, three bitmaps: the clusters reached from the
+ * directories, marked by the same walk that creates the inverse fat; the
+ * clusters that are the successor of another, from a pass over the fat; the
+ * clusters in the chain being printed, to stop at loops
  */
+
+int _fatunreachablemark(fat *f,
+		unit *directory, int index, int32_t previous,
+		unit __attribute__((unused)) *startdirectory,
+		int __attribute__((unused)) startindex,
+		int32_t __attribute__((unused)) startprevious,
+		unit __attribute__((unused)) *dirdirectory,
+		int __attribute__((unused)) dirindex,
+		int32_t __attribute__((unused)) dirprevious,
+		int direction, void *user) {
+	unsigned char *reached;
+	int32_t target;
+
+	if (direction != 0)
+		return FAT_REFERENCE_DELETE;
+
+	if (directory != NULL && fatentryisdotfile(directory, index))
+		return 0;
+
+	reached = (unsigned char *) user;
+
+	target = fatreferencegettarget(f, directory, index, previous);
+	if (target < FAT_ROOT || target > fatlastcluster(f))
+		return FAT_REFERENCE_NORMAL;
+	if (target >= FAT_FIRST && FATBIT(reached, target))
+		return 0;
+	FATSETBIT(reached, target);
+
+	return FAT_REFERENCE_NORMAL;
+}
+
 int fatunreachable(fat *f, int fix, int each) {
-	fatinverse *rev, *unreach;
-	int32_t cl, start, next, prev;
+	unsigned char *reached, *successor, *chain;
+	int32_t last, cl, start, next, prev;
 	int count;
 	char sep, end;
 	int preverror;
@@ -484,38 +1324,44 @@ int fatunreachable(fat *f, int fix, int each) {
 	preverror = fattableerror;
 	fattableerror = 0;
 
-	rev = fatinversecreate(f, 0);
-	if (rev == NULL) {
-		printf("cannot create inverse FAT\n");
+	last = fatlastcluster(f);
+	reached = calloc(last / 8 + 1, 1);
+	successor = calloc(last / 8 + 1, 1);
+	chain = calloc(last / 8 + 1, 1);
+	if (reached == NULL || successor == NULL || chain == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	fatdirectoryprefetch(f, FAT_ROOT);
+	if (fatreferenceexecute(f, NULL, 0, -1, _fatunreachablemark, reached)) {
+		printf("cannot read the directories\n");
+		free(chain);
+		free(successor);
+		free(reached);
 		fattableerror = preverror;
 		return -1;
 	}
 
-	if (fix > 0)
-		unreach = NULL;
-	else {
-		unreach = fatinversechains(f, 0);
-		if (unreach == NULL) {
-			printf("cannot create inverse FAT\n");
-			fattableerror = preverror;
-			return -1;
+	if (fix <= 0)
+		for (cl = FAT_FIRST; cl <= last; cl++) {
+			next = fatgetnextcluster(f, cl);
+			if (next >= FAT_ROOT && next <= last)
+				FATSETBIT(successor, next);
 		}
-	}
 
 	count = 0;
 	dprintf("clusters:");
 
 	start = FAT_ERR;
 	prev = FAT_ERR;
-	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+	for (cl = FAT_FIRST; cl <= last; cl++) {
 		next = fatgetnextcluster(f, cl);
 		if (next == FAT_UNUSED)
 			continue;
 		if (next == FAT_BAD)
 			continue;
-		if (! fatreferenceisvoid(rev[cl].directory,
-		                         rev[cl].index,
-		                         rev[cl].previous))
+		if (FATBIT(reached, cl))
 			continue;
 
 		if (fix > 0) {
@@ -538,20 +1384,17 @@ int fatunreachable(fat *f, int fix, int each) {
 			continue;
 		}
 
-		if (! fatreferenceisvoid(unreach[cl].directory,
-		                         unreach[cl].index,
-		                         unreach[cl].previous))
+		if (FATBIT(successor, cl))
 			continue;
 
 		start = cl;
 		prev = cl;
 		sep = ' ';
 		end = ' ';
+		FATSETBIT(chain, cl);
 		for (;
-		     next >= FAT_FIRST && next <= fatlastcluster(f) &&
-		     fatreferenceisvoid(rev[next].directory,
-		                        rev[next].index,
-		                        rev[next].previous);
+		     next >= FAT_FIRST && next <= last &&
+		     ! FATBIT(reached, next) && ! FATBIT(chain, next);
 		     next = fatgetnextcluster(f, prev)) {
 			if (next != prev + 1 || end == '|' || each) {
 				if (prev == start || each) {
@@ -564,6 +1407,7 @@ int fatunreachable(fat *f, int fix, int each) {
 			}
 			count++;
 			prev = next;
+			FATSETBIT(chain, next);
 		}
 		if (prev == start || each) {
 			dprintf("%c%d", sep, prev);
@@ -576,13 +1420,18 @@ int fatunreachable(fat *f, int fix, int each) {
 		}
 		else if (next == FAT_EOF) {
 		}
-		else if (next < FAT_FIRST || next > fatlastcluster(f)) {
+		else if (next < FAT_FIRST || next > last) {
 			dprintf("?");
 		}
-		else if (! fatreferenceisvoid(rev[next].directory,
-		                              rev[next].index,
-		                              rev[next].previous))
+		else
 			dprintf("|%d...", next);
+
+				/* clear the chain for the next one */
+
+		for (next = cl; next >= FAT_FIRST && next <= last &&
+				FATBIT(chain, next);
+		     next = fatgetnextcluster(f, next))
+			FATCLEARBIT(chain, next);
 	}
 
 	if (fix && prev != FAT_ERR && ! each) {
@@ -594,6 +1443,9 @@ int fatunreachable(fat *f, int fix, int each) {
 	}
 	dprintf("\n");
 
+	free(chain);
+	free(successor);
+	free(reached);
 	fattableerror = preverror;
 	return count;
 }
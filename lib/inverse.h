@@ -32,17 +32,36 @@
 
 #include "unit.h"
 
+/*
+ * the reference to a cluster, in 8 bytes; a directory cluster is stored by its
+ * number, so that it needs not to stay in memory:
+ * - isentry=1: entry index of the directory cluster previous
+ * - isentry=0: previous cluster in the chain, or -1 (boot) or 0 (none)
+ */
 typedef struct {
-	unit *directory;
-	int index;
 	int32_t previous;
-	int isdir;
+	uint32_t index : 30;
+	uint32_t isentry : 1;
+	uint32_t isdir : 1;
 } fatinverse;
 
+/*
+ * file where the inverse fat used by complex operations is saved between
+ * runs, if not NULL
+ */
+extern char *fatinversefile;
+
+/*
+ * number of threads building the inverse fat, if more than one; the result is
+ * the same as the one built serially
+ */
+extern int fatinversethreads;
+
 /*
  * create, delete, update and print an inverse fat
  */
 fatinverse *fatinversecreate(fat *f, int file);
+fatinverse *fatinverseopen(fat *f, char *filename);
 fatinverse *fatinversechains(fat *f, int file);
 int fatinversedelete(fat *f, fatinverse *rev);
 void fatinverseclear(fatinverse *rev, int32_t cluster);
@@ -50,6 +69,8 @@ int fatinverseisvoid(fatinverse *rev, int32_t cluster);
 int32_t fatinverseset(fat *f, fatinverse *rev,
 		unit *directory, int index, int32_t previous,
 		int isdir);
+int fatinverseget(fat *f, fatinverse *rev, int32_t cluster,
+		unit **directory, int *index, int32_t *previous);
 void fatinverseprint(fat *f, fatinverse *rev, int32_t cl);
 
 /*
@@ -69,19 +90,24 @@ int fatinversemovereference(fat *f, fatinverse *rev,
 		int32_t dst, int writeback);
 int fatinversemove(fat *f, fatinverse *rev,
 		int32_t src, int32_t dst, int writeback);
+int fatinversemoverun(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous, int isdir,
+		int32_t dst, int num, int writeback);
 int fatinverseswapreference(fat *f, fatinverse *rev,
 		unit *srcdir, int srcindex, int32_t srcprevious, int srcisdir,
 		unit *dstdir, int dstindex, int32_t dstprevious, int dstisdir,
 		int writeback);
 int fatinverseswap(fat *f, fatinverse *rev,
 		int32_t src, int32_t dst, int writeback);
+int fatinverserotate(fat *f, fatinverse *rev, int32_t *cycle, int n,
+		int writeback);
 
 /*
  * go back from clusters or directory entries
  */
-int fatinversereferencetoentry(fatinverse *rev,
+int fatinversereferencetoentry(fat *f, fatinverse *rev,
 	unit **directory, int *index, int32_t *previous);
-char *fatinversepath(fatinverse *rev,
+char *fatinversepath(fat *f, fatinverse *rev,
 	unit *directory, int index, int32_t previous);
 int fatinversepreventry(fat *f, fatinverse *rev, unit **directory, int *index);
 
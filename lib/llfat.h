@@ -0,0 +1,1718 @@
+/*
+ * llfat.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * llfat.h
+ *
+ * a lowlevel fat filesystem access library
+ *
+ * this is not for reading and writing files in a fat filesystem (the
+ * msdos/vfat kernel modules and the mtools program do this well already) but
+ * for operations that require low-level access like resizing the filesystem
+ *
+ * general principle: sectors (boot and fats) and clusters (containing
+ * directory entries) are cached locally when they are read; they are not
+ * converted to structures, but left as they are; appropriate functions read
+ * and write them as necessary; when requested, they are written where they
+ * come from
+ *
+ * a pointer to the boot sector (and possibly the extended boot sector) goes in
+ * the cache like the other sectors, but also in the f->boot field to allow
+ * reading the fat data without searching in the cache
+ */
+
+/*
+ * fs.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fs.h
+ *
+ * the global data of a fat filesystem: the structure representing it and the
+ * functions for reading/flushing/closing and for accessing the global
+ * parameters (number of sectors, etc)
+ */
+
+#ifdef _FS_H
+#else
+#define _FS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "unit.h"
+
+/*
+ * progress of a long operation, passed to the callback registered by
+ * fatprogressregister()
+ */
+typedef struct {
+	char *operation;			/* what is being done */
+	int64_t done;				/* clusters or units done */
+	int64_t total;				/* estimate, 0 if unknown */
+	uint64_t bytes;				/* bytes moved or written */
+	double rate;				/* done per second */
+	double throughput;			/* bytes per second */
+	int finished;				/* last call */
+
+	int depth;				/* nested operations */
+	uint64_t starttime;			/* milliseconds */
+	int64_t lastdone;			/* at the previous call */
+	uint64_t lastbytes;
+	uint64_t lasttime;			/* milliseconds */
+	pthread_mutex_t mutex;
+} fatprogress;
+
+/*
+ * an open fat device or image
+ */
+typedef struct fat {
+	int fd;
+	char *devicename;
+	uint64_t offset;
+
+	int bits;				/* 12, 16 or 32 */
+	int nfat;				/* file alloc. table to use */
+	int insensitive;			/* case-insensitive lookup? */
+
+	unit *boot;				/* boot sector */
+	unit *info; 				/* fs info sector (fat32) */
+	unit *sectors;				/* cache for sectors */
+	unit *clusters;				/* cache for clusters */
+
+	int32_t last;				/* last found free cluster */
+	int32_t free;				/* number of free clusters */
+	uint64_t changes;			/* writes to the fat */
+
+	pthread_rwlock_t lock;			/* see fatlockread() */
+	int writer;				/* lock held for writing */
+
+	void (*progress)(struct fat *f, fatprogress *p);
+	int64_t progressevery;			/* call every this many done */
+	int progressinterval;			/* or this many milliseconds */
+	fatprogress progressstate;
+
+	void *user;				/* free for program use */
+} fat;
+
+/*
+ * global operations on a fat: create, read, check, flush, quit and close
+ */
+fat *fatcreate();
+int fatreadbootsector(fat *f, int boot);
+fat *fatopenonly(char *filename, off_t offset, int boot);
+int fatreadinfosector(fat *f, int info);
+fat *fatopen(char *filename, off_t offset);
+fat *fatsignatureopen(char *filename, off_t offset);
+int fatcheck(fat *f);
+int fatflush(fat *f);
+int fatquit(fat *f);
+int fatclose(fat *f);
+
+/*
+ * threads: many threads can read the filesystem at the same time, each
+ * holding the lock for reading; a thread that changes anything (including
+ * cluster allocation, which changes f->last and f->free) holds the lock for
+ * writing, which excludes all others; the unit caches are safe for the
+ * concurrent readers, and no unit is removed from them while any reader holds
+ * the lock
+ */
+int fatlockread(fat *f);
+int fatlockwrite(fat *f);
+int fatunlock(fat *f);
+
+/*
+ * progress of long operations: the callback is called when an operation
+ * begins and ends, and in between every that many clusters or units done or
+ * every that many milliseconds, whichever comes first (0 disables either);
+ * rate and throughput are since the previous call, or since the beginning in
+ * the last call; an operation called by another is not reported separately
+ */
+void fatprogressregister(fat *f, void (*progress)(fat *f, fatprogress *p),
+		int64_t every, int milliseconds);
+void fatprogressbegin(fat *f, char *operation, int64_t total);
+void fatprogressstep(fat *f, int64_t done, uint64_t bytes);
+void fatprogressend(fat *f);
+int fatprogressactive(fat *f);
+
+/*
+ * global parameters of a fat
+ */
+int fatbits(fat *f);
+int fatsignaturebits(fat *f);
+int fatgetbytespersector(fat *f);
+int fatsetbytespersector(fat *f, int bytes);
+uint8_t fatgetsectorspercluster(fat *f);
+int fatsetsectorspercluster(fat *f, int sectors);
+int fatbytespercluster(fat *f);
+int fatgetreservedsectors(fat *f);
+int fatsetreservedsectors(fat *f, int sectors);
+int fatgetnumfats(fat *f);
+int fatsetnumfats(fat *f, int nfat);
+uint32_t fatgetnumsectors(fat *f);
+int fatsetnumsectors(fat *f, uint32_t sectors);
+int fatgetfatsize16(fat *f);
+int fatsetfatsize16(fat *f, int size);
+int fatgetfatsize32(fat *f);
+int fatsetfatsize32(fat *f, int size);
+int fatgetfatsize(fat *f);
+int fatsetfatsize(fat *f, int size);
+int fatminfatsize(fat *f, int32_t nclusters);
+int fatbestfatsize(fat *f);
+int fatconsistentsize(fat *f);
+int32_t fatgetrootbegin(fat *f);
+int fatsetrootbegin(fat *f, int32_t num);
+int fatgetrootentries(fat *f);
+int fatsetrootentries(fat *f, int entries);
+int32_t fatnumrootsectors(fat *f);
+int32_t fatnumdataclusters(fat *f);
+int32_t fatlastcluster(fat *f);
+int fatisvalidcluster(fat *f, int32_t n);
+#define FAT_UNCLEAN 0x01
+#define FAT_IOERROR 0x02
+int fatgetdirtybits(fat *f);
+int fatsetdirtybits(fat *f, int dirty);
+int fatgetextendedbootsignature(fat *f);
+int fataddextendedbootsignature(fat *f);
+int fatdeleteextendedbootsignature(fat *f);
+uint32_t fatgetserialnumber(fat *f);
+int fatsetserialnumber(fat *f, uint32_t serial);
+char* fatgetvolumelabel(fat *f);
+int fatsetvolumelabel(fat *f, const char l[11]);
+char* fatgetfilesystemtype(fat *f);
+int fatsetfilesystemtype(fat *f, char t[8]);
+int fatgetbackupsector(fat *f);
+int fatsetbackupsector(fat *f, int sector);
+int fatcopyboottobackup(fat *f);
+int fatgetinfopos(fat *f);
+int fatsetinfopos(fat *f, int pos);
+uint8_t fatgetmedia(fat *f);
+int fatsetmedia(fat *f, uint8_t media);
+int fatgetbootsignature(fat *f);
+int fatsetbootsignature(fat *f);
+
+/*
+ * fs information sector
+ */
+int fatgetinfosignatures(fat *f);
+int fatsetinfosignatures(fat *f);
+int32_t fatgetlastallocatedcluster(fat *f);		/* README: Note 4 */
+void fatsetlastallocatedcluster(fat *f, int32_t last);
+int32_t fatgetfreeclusters(fat *f);
+void fatsetfreeclusters(fat *f, int32_t last);
+
+/*
+ * summary of fs
+ */
+void fatsummary(fat *f);
+
+#endif
+
+/*
+ * boot.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * boot.h
+ *
+ * access data stored in the boot and information sectors
+ */
+
+#ifdef _BOOT_H
+#else
+#define _BOOT_H
+
+#include <stdint.h>
+#include "unit.h"
+
+/*
+ * boot sector
+ */
+int fatbootcheck(unit *boot);
+int fatbootbits(unit *boot);
+int fatbootsignaturebits(unit *boot);
+int fatbootgetbytespersector(unit *boot);
+int fatbootsetbytespersector(unit *boot, int bytes);
+uint8_t fatbootgetsectorspercluster(unit *boot);
+int fatbootsetsectorspercluster(unit *boot, int sectors);
+int fatbootbytespercluster(unit *boot);
+int fatbootgetreservedsectors(unit *boot);
+int fatbootsetreservedsectors(unit *boot, int sectors);
+int fatbootgetnumfats(unit *boot);
+int fatbootsetnumfats(unit *boot, int nfat);
+uint32_t fatbootgetnumsectors(unit *boot, int *bits);
+int fatbootsetnumsectors(unit *boot, int *bits, uint32_t sectors);
+int fatbootgetfatsize16(unit *boot);
+int fatbootsetfatsize16(unit *boot, int size);
+int fatbootgetfatsize32(unit *boot);
+int fatbootsetfatsize32(unit *boot, int size);
+int fatbootgetfatsize(unit *boot, int *bits);
+int fatbootsetfatsize(unit *boot, int *bits, int size);
+int fatbootminfatsize(unit *boot, int32_t nclusters);
+int fatbitsfromclusters(int32_t nclusters);
+int fatbootbestfatsize(unit *boot);
+int fatbootconsistentsize(unit *boot, int *bits);
+int32_t fatbootgetrootbegin(unit *boot, int *bits);
+int fatbootsetrootbegin(unit *boot, int *bits, int32_t num);
+int fatbootgetrootentries(unit *boot, int *bits);
+int fatbootsetrootentries(unit *boot, int *bits, int entries);
+int32_t fatbootnumrootsectors(unit *boot, int *bits);
+int32_t fatbootnumdataclusters(unit *boot, int *bits);
+int32_t fatbootlastcluster(unit *boot, int *bits);
+int fatbootisvalidcluster(unit *boot, int *bits, int32_t n);
+#define fatboot_UNCLEAN 0x01
+#define fatboot_IOERROR 0x02
+int fatbootgetdirtybits(unit *boot, int *bits);
+int fatbootsetdirtybits(unit *boot, int *bits, int dirty);
+int fatbootgetextendedbootsignature(unit *boot, int *bits);
+int fatbootaddextendedbootsignature(unit *boot, int *bits);
+int fatbootdeleteextendedbootsignature(unit *boot, int *bits);
+uint32_t fatbootgetserialnumber(unit *boot, int *bits);
+int fatbootsetserialnumber(unit *boot, int *bits, uint32_t serial);
+char* fatbootgetvolumelabel(unit *boot, int *bits);
+int fatbootsetvolumelabel(unit *boot, int *bits, const char l[11]);
+char* fatbootgetfilesystemtype(unit *boot, int *bits);
+int fatbootsetfilesystemtype(unit *boot, int *bits, char t[8]);
+int fatbootgetbackupsector(unit *boot);
+int fatbootsetbackupsector(unit *boot, int sector);
+int fatbootgetinfopos(unit *boot);
+int fatbootsetinfopos(unit *boot, int pos);
+uint8_t fatbootgetmedia(unit *boot);
+int fatbootsetmedia(unit *boot, uint8_t media);
+int fatbootgetbootsignature(unit *boot);
+int fatbootsetbootsignature(unit *boot);
+
+/*
+ * fs information sector
+ */
+int fatinfogetinfosignatures(unit *info);
+int fatinfosetinfosignatures(unit *info);
+int32_t fatinfogetlastallocatedcluster(unit *info);
+void fatinfosetlastallocatedcluster(unit *info, int32_t last);
+int32_t fatinfogetfreeclusters(unit *info);
+void fatinfosetfreeclusters(unit *info, int32_t last);
+
+#endif
+
+/*
+ * entry.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * entry.h
+ *
+ * read and write data in a directory entry
+ *
+ * every file in the filesystem has a 32-bytes entry that contains its short
+ * name, size and first cluster; each directory contains some such entries in
+ * one or more clusters
+ *
+ * all functions in this modules take as a parameter the pair cluster/index
+ * that identifies the entry for a file
+ */
+
+#ifdef _DIRECTORY_H
+#else
+#define _DIRECTORY_H
+
+#include <time.h>
+#include "unit.h"
+
+#define FAT_ATTR_RO      0x01
+#define FAT_ATTR_HIDDEN  0x02
+#define FAT_ATTR_SYSTEM  0x04
+#define FAT_ATTR_VOLUME  0x08
+#define FAT_ATTR_DIR     0x10
+#define FAT_ATTR_ARCHIVE 0x20
+
+#define FAT_ATTR_ALL \
+	(FAT_ATTR_RO | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM | \
+	FAT_ATTR_VOLUME | FAT_ATTR_DIR | FAT_ATTR_ARCHIVE)
+#define FAT_ATTR_LONGNAME \
+	(FAT_ATTR_RO | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM | FAT_ATTR_VOLUME)
+
+#define DOTFILE    ".\0           "
+#define DOTDOTFILE "..\0          "
+
+/*
+ * is an entry actually a file? part of a long name? is the directory over?
+ */
+int fatentryexists(unit *directory, int index);
+int fatentryend(unit *directory, int index);
+int fatentryislongpart(unit *directory, int index);
+
+/*
+ * classify the entries of a directory cluster, and skip to the next entry of
+ * the given classes
+ */
+#define FAT_CLASS_END     0x01
+#define FAT_CLASS_DELETED 0x02
+#define FAT_CLASS_LONG    0x04
+#define FAT_CLASS_VOLUME  0x08
+#define FAT_CLASS_DIR     0x10
+#define FAT_CLASS_FILE    0x20
+
+#define FAT_CLASS_EXISTS \
+	(FAT_CLASS_VOLUME | FAT_CLASS_DIR | FAT_CLASS_FILE)
+#define FAT_CLASS_ALL \
+	(FAT_CLASS_DELETED | FAT_CLASS_LONG | FAT_CLASS_EXISTS)
+
+int fatentryclass(unit *directory, int index);
+int fatentryclassify(unit *directory, unsigned char *class);
+int fatentryclassnext(unsigned char *class, int num, int index, int mask);
+
+/*
+ * get and set parts of a directory entry
+ */
+void fatshortnametostring(char dst[13], unsigned char src[11]);
+int fatstringtoshortname(unsigned char dst[11], char src[13]);
+void fatentrygetshortname(unit *directory, int index, char shortname[13]);
+int fatentrysetshortname(unit *directory, int index, char shortname[13]);
+void fatentryprintshortname(unit *directory, int index);
+int fatentrycompareshortname(unit *directory, int index, char shortname[13]);
+int fatentryisdotfile(unit *directory, int index);
+
+int32_t fatentrygetfirstcluster(unit *directory, int index, int bits);
+int fatentrysetfirstcluster(unit *directory, int index, int bits, int32_t n);
+
+unsigned char fatentrygetattributes(unit *directory, int index);
+void fatentrysetattributes(unit *directory, int index, unsigned char attr);
+int fatentryisdirectory(unit *directory, int index);
+
+uint32_t fatentrygetsize(unit *directory, int index);
+void fatentrysetsize(unit *directory, int index, uint32_t size);
+
+int fatentrygetwritetime(unit *directory, int index, struct tm *tm);
+int fatentrygetcreatetime(unit *directory, int index, struct tm *tm);
+int fatentrygetreadtime(unit *directory, int index, struct tm *tm);
+
+int fatentrysetwritetime(unit *directory, int index, struct tm *tm);
+int fatentrysetcreatetime(unit *directory, int index, struct tm *tm);
+int fatentrysetreadtime(unit *directory, int index, struct tm *tm);
+
+int fatentrysetwritetimenow(unit *directory, int index);
+int fatentrysetcreatetimenow(unit *directory, int index);
+int fatentrysetreadtimenow(unit *directory, int index);
+
+/*
+ * delete a directory entry
+ * zeroing it is only for initialization and when no other entry follows
+ */
+void fatentryfirst(unit *directory, int index, char first);
+void fatentrydelete(unit *directory, int index);
+void fatentryzero(unit *directory, int index);
+
+/*
+ * print a summary of a directory entry
+ */
+void fatentryprintpos(unit *directory, int index, int minsize);
+void fatentryprint(unit *directory, int index);
+
+#endif
+
+/*
+ * table.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * table.h
+ *
+ * functions for the file allocation table, which contains the next of each
+ * cluster and whether the cluster is unused
+ */
+
+#ifdef _TABLE_H
+#else
+#define _TABLE_H
+
+#include <stdint.h>
+#include "unit.h"
+#include "fs.h"
+
+/* all FATs when writing, FAT0 when reading */
+#define FAT_ALL (-1)
+
+/*
+ * load in cache a whole FAT, or all of them if nfat == FAT_ALL
+ */
+int fatreadfat(fat *f, int nfat);
+
+/* specific values for a cluster number */
+#define FAT_FIRST (2)
+#define FAT_ROOT (1)
+#define FAT_UNUSED (0)
+#define FAT_EOF (-1)
+#define FAT_BAD (-2)
+#define FAT_ERR (-1000)
+
+/*
+ * access a fat entry
+ *
+ * this is for raw access to the elements of a specific file allocation table:
+ * the resulting element is returned as-is, not converted into FAT_EOF or
+ * FAT_BAD; also, FAT_ALL is invalid here
+ *
+ * below are the functions for getting/setting the successor of a cluster
+ */
+int32_t fatgetfat(fat *f, int nfat, int32_t n);
+int fatsetfat(fat *f, int nfat, int32_t n, int32_t next);
+
+/*
+ * set the first two entries in a fat (the table "header")
+ */
+int fatfixtableheader(fat *f, int nfat);
+
+/*
+ * dirty bits
+ * they are inverted and shifted to make them the same as the
+ * dirty bits in the boot sector
+ */
+int fatgetfatdirtybits(fat *f, int nfat);
+int fatsetfatdirtybits(fat *f, int nfat, uint32_t dirty);
+
+/*
+ * tell whether an entry in a fat is UNUSED, EOF or BAD; print it
+ */
+int fatisfatunused(fat *f, int32_t n);
+int fatisfateof(fat *f, int32_t n);
+int fatisfatbad(fat *f, int32_t n);
+void fatprintfat(fat *f, int32_t n);
+
+/*
+ * get and set the next (or eof/unused) of a cluster
+ */
+int32_t fatgetnextcluster(fat *f, int32_t cluster);
+int fatsetnextcluster(fat *f, int32_t cluster, int32_t next);
+
+/*
+ * initialize a file allocation table
+ */
+int fatinittable(fat *f, int nfat);
+
+/*
+ * check if a cluster is within an interval; wrap if end < begin
+ */
+int fatclusterisbetween(int32_t cluster, int32_t begin, int32_t end);
+
+/*
+ * wrapping decrease/increase of a cluster number in an interval
+ */
+int32_t fatclusterintervalprev(fat *f, int32_t c, int32_t begin, int32_t end);
+int32_t fatclusterintervalnext(fat *f, int32_t c, int32_t begin, int32_t end);
+
+/*
+ * number of free clusters; wrap if end < begin
+ */
+int32_t fatclusternumfreebetween(fat *f, int32_t begin, int32_t end);
+int32_t fatclusternumfree(fat *f);
+
+/*
+ * find a free cluster or sequence
+ */
+int32_t fatclusterfindfreesequencebetween(fat *f,
+		int32_t begin, int32_t end, int32_t start, int length);
+int32_t fatclusterfindfreesequence(fat *f, int length);
+int32_t fatclusterfindfreebetween(fat *f,
+		int32_t begin, int32_t end, int32_t start);
+int32_t fatclusterfindfree(fat *f);
+
+/*
+ * find the smallest sequence of free clusters that is at least length long
+ */
+int32_t fatclusterfindfreeextent(fat *f, int length);
+
+/*
+ * presence and count of bad clusters in an area
+ */
+int fatclusterareaisbad(fat *f, int32_t begin, int32_t end);
+int fatclusternumbadbetween(fat *f, int32_t begin, int32_t end);
+
+/*
+ * find the "most free" area of a given size
+ * if allowbad==0, an area is discarded if it has even a single bad sector
+ * return: start of the best area, size of this area (in maxfree)
+ */
+int32_t fatclustermostfree(fat *f, int size, int allowbad, int *maxfree);
+
+/*
+ * find the first longest linear subchain of a chain
+ * return: first cluster of the subchain; maxindex is its ordinal in the chain
+ * (starting from zero); maxlen is the length of the longest subchain
+ */
+int32_t fatclusterlongestlinear(fat *f, int32_t start,
+		int *maxlen, int *maxindex);
+
+/*
+ * find an allocated cluster
+ */
+int fatclusterfindallocatedbetween(fat *f,
+		int32_t begin, int32_t end, int32_t start);
+int fatclusterfindallocated(fat *f, int32_t begin, int32_t end);
+
+/*
+ * free a chain of clusters
+ */
+int fatclusterfreechain(fat *f, int32_t begin);
+
+/*
+ * bitmaps of clusters, fatlastcluster(f) / 8 + 1 bytes long
+ */
+#define FATBIT(bitmap, cl) ((bitmap)[(cl) / 8] & (1 << ((cl) % 8)))
+#define FATSETBIT(bitmap, cl) ((bitmap)[(cl) / 8] |= 1 << ((cl) % 8))
+#define FATCLEARBIT(bitmap, cl) ((bitmap)[(cl) / 8] &= ~(1 << ((cl) % 8)))
+
+/*
+ * length and last cluster of the chain from every cluster, computed from the
+ * fat only; also tell the clusters that are the next of more than one
+ * (cross-links) and the ones that lead to a loop (FAT_ERR as length and end)
+ */
+typedef struct {
+	int32_t last;		/* last cluster of the filesystem */
+	int32_t *length;	/* clusters from n to the end of the chain */
+	int32_t *end;		/* last cluster of the chain from n */
+	unsigned char *in;	/* clusters having n as next, up to 255 */
+} fatchains;
+
+fatchains *fatchainscreate(fat *f);
+void fatchainsdelete(fatchains *c);
+int32_t fatchainslength(fatchains *c, int32_t cl);
+int32_t fatchainsend(fatchains *c, int32_t cl);
+int fatchainscrosslinked(fatchains *c, int32_t cl);
+int fatchainsloop(fatchains *c, int32_t cl);
+
+/*
+ * create and read a cluster; writeback is done by fatunitwriteback(unit *)
+ */
+int fatclusterposition(fat *f, int32_t cl, uint64_t *origin, int *size);
+unit *fatclustercreate(fat *f, int32_t cl);
+unit *fatclusterread(fat *f, int32_t cl);
+int fatclusterprefetch(fat *f, int32_t cl);
+int fatclusterreadrun(fat *f, int32_t cl, int num);
+
+/*
+ * the cluster that contains a sector
+ */
+int32_t fatsectorposition(fat *f, uint32_t sector);
+
+/*
+ * hashes of the boot parameters and of the fat, to tell whether a file saved
+ * by a previous run still matches the filesystem; the hash of the fat is the
+ * xor of the hashes of its entries, so that it can be updated entry by entry
+ */
+uint64_t fathash(uint64_t h, uint32_t v);
+uint64_t fatgeometry(fat *f);
+uint64_t fathashentry(int32_t cl, int32_t next);
+uint64_t fathashtable(fat *f);
+
+#endif
+
+/*
+ * directory.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * directory.h
+ *
+ * access a directory
+ *
+ * all these function have a "int32_t dir" argument, which is the number of the
+ * first cluster of the directory to search
+ *
+ * a path may or may not be preceded by '/'; if it does, the directory argument
+ * is ignored and the lookup starts from the root directory
+ */
+
+#ifdef _LOOKUP_H
+#else
+#define _LOOKUP_H
+
+#include "fs.h"
+
+/*
+ * number of clusters of a file
+ */
+int fatentrynumclusters(fat *f, unit *directory, int index);
+
+/*
+ * next entry of a directory
+ */
+int fatnextentry(fat *f, unit **directory, int *index);
+int fatnextentryclass(fat *f, unit **directory, int *index,
+		unsigned char **class, int mask);
+
+/*
+ * cluster/index pair of a file, given its short name
+ */
+int fatlookupfile(fat *f, int32_t dir,
+		const char *shortname, unit **directory, int *index);
+
+/*
+ * number of the first cluster of a file, given its short name
+ */
+int32_t fatlookupfirstcluster(fat *f, int32_t dir, const char *shortname);
+
+/*
+ * position of file, given its path
+ */
+int fatlookuppathdir(fat *f, int32_t *dir,
+		const char *path, unit **directory, int *ind);
+int fatlookuppath(fat *f, int32_t dir,
+		const char *path, unit **directory, int *index);
+
+/*
+ * first cluster of file, given its path
+ */
+int32_t fatlookuppathfirstclusterdir(fat *f, int32_t *dir, const char *path);
+int32_t fatlookuppathfirstcluster(fat *f, int32_t dir, const char *path);
+
+/*
+ * find first available directory entry
+ */
+int fatfindfreeentry(fat *f, unit **directory, int *index);
+
+/*
+ * find first free entry, given the path of the directory
+ */
+int fatfindfreeentrypathdir(fat *f, int32_t *dir, const char *path,
+		unit **directory, int *index);
+int fatfindfreeentrypath(fat *f, int32_t dir, const char *path,
+		unit **directory, int *index);
+
+/*
+ * file names
+ */
+int fatinvalidname(const char *name);
+int fatinvalidpath(const char *path);
+char *fatstoragename(const char *name);
+char *fatstoragepath(const char *name);
+
+/*
+ * create a file given its path
+ */
+int fatcreatefiledir(fat *f, int32_t *dir, char *path,
+		unit **directory, int *index);
+int fatcreatefile(fat *f, int32_t dir, char *path,
+		unit **directory, int *index);
+
+/*
+ * read all directories below dir in disk order, to have them in cache
+ */
+int fatdirectoryprefetch(fat *f, int32_t dir);
+
+#endif
+
+/*
+ * reference.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _REFERENCE_H
+#else
+#define _REFERENCE_H
+
+#include "fs.h"
+#include "table.h"
+
+/*
+ * next of a cluster reference (a pointer to a cluster): get and set
+ */
+int32_t fatreferencegettarget(fat *f,
+		unit *directory, int index, int32_t previous);
+int fatreferencesettarget(fat *f,
+		unit *directory, int index, int32_t previous, int32_t new);
+
+/*
+ * check conditions on a cluster reference
+ */
+
+int fatreferenceiscluster(unit *directory, int index, int32_t previous);
+int fatreferenceisentry(unit *directory, int index, int32_t previous);
+int fatreferenceisdotfile(unit *directory, int index, int32_t previous);
+int fatreferenceisboot(unit *directory, int index, int32_t previous);
+int fatreferenceisvoid(unit *directory, int index, int32_t previous);
+
+/*
+ * advance a cluster reference
+ */
+int32_t fatreferencenext(fat *f,
+		unit **directory, int *index, int32_t *previous);
+int fatreferencelast(fat *f,
+		unit **directory, int *index, int32_t *previous);
+
+/*
+ * check if a cluster reference points to the directory entry of a directory
+ */
+int fatreferenceisdirectory(unit *directory, int index, int32_t previous);
+
+/*
+ * print a cluster reference, for debugging
+ */
+void fatreferenceprint(unit *directory, int index, int32_t previous);
+
+/*
+ * cluster chain change
+ */
+int fatclustermove(fat *f,
+		unit *directory, int index, int32_t previous,
+		int32_t new,
+		int writeback);
+int fatclusterswap(fat *f,
+		unit *dfirst, int ifirst, int32_t pfirst,
+		unit *dsecond, int isecond, int32_t psecond,
+		int writeback);
+
+/*
+ * move a run of consecutive clusters of a chain to consecutive free clusters
+ * by a single read and a single write
+ */
+int fatclusterrunlength(fat *f, int32_t src, int32_t dst, int max);
+int fatclustermoverun(fat *f,
+		unit *directory, int index, int32_t previous,
+		int32_t new, int num,
+		int writeback);
+
+/*
+ * follow the first part of a path or all of it as much as possible
+ */
+int fatfollowfirst(fat *f, char **path,
+		unit **directory, int *index, int32_t *previous);
+int fatfollowpath(fat *f, const char *path,
+		char **left, unit **directory, int *index, int32_t *previous);
+
+/*
+ * execute a refrun function on every cluster _reference_
+ *
+ * the refrun function is called with:
+ * - the cluster reference
+ * - a reference to the directory entry of the file containing the cluster;
+ *   in other words: the target cluster is part of a chain that belongs to a
+ *   file; this is a reference to the directory entry of this file
+ * - a reference to the directory entry of the directory containing this file
+ * - the direction, which distinguishes when the refrun function has been
+ *   called, since it is called:
+ *	. on every cluster reference, with direction=0
+ *	. if the reference is a directory entry (that is, a file) of a
+ *	  directory (that is, this file is a directory):
+ *	  	_ with direction=1 before entering the directory
+ *		_ with direction=-1 when leaving it
+ *		_ with direction=-2 again on every cluster reference of the
+ *		  chain
+ * - a void * parameter, free for program use
+ *
+ * the return value of refrun tells:
+ *	a. whether to follow the chain of clusters (FAT_REFERENCE_CHAIN)
+ *	b. whether to recurse if this is a directory (FAT_REFERENCE_RECUR)
+ *	c. whether to follow the original chain, even if the function changed
+ *	   the next of the cluster (FAT_REFERENCE_ORIG)
+ *	d. whether to call on all directory entries, including long name parts
+ *	   and deleted entries (FAT_REFERENCE_ALL)
+ *
+ * directories nested more than fatreferencemaxdepth levels (0 = no limit) and
+ * directories containing themselves are not entered, and chains longer than
+ * the number of clusters are not followed further; all make the function
+ * return -1
+ */
+#define FAT_REFERENCE_CHAIN  0x01
+#define FAT_REFERENCE_RECUR  0x02
+#define FAT_REFERENCE_ORIG   0x04
+#define FAT_REFERENCE_ALL    0x08
+#define FAT_REFERENCE_DELETE 0x10
+
+#define FAT_REFERENCE_NORMAL \
+	FAT_REFERENCE_CHAIN | FAT_REFERENCE_RECUR | FAT_REFERENCE_DELETE
+#define FAT_REFERENCE_COND(r) \
+	FAT_REFERENCE_CHAIN | FAT_REFERENCE_DELETE | \
+	((r) ? FAT_REFERENCE_RECUR : 0)
+#define FAT_REFERENCE_ABORT 0
+
+extern int fatreferencemaxdepth;
+
+typedef int(* refrun)(fat *f,
+	unit *directory, int index, int32_t previous,
+	unit *startdirectory, int startindex, int32_t startprevious,
+	unit *dirdirectory, int dirindex, int32_t dirprevious,
+	int direction, void *user);
+int fatreferenceexecute(fat *f,
+		unit *directory, int index, int32_t previous,
+		refrun act, void *user);
+
+/*
+ * same visit, calling a function only on the events in a mask:
+ * - FAT_EVENT_ENTRY	the first reference of a chain: a directory entry or
+ *			the starting reference (direction=0 above)
+ * - FAT_EVENT_CHAIN	the other references of the chain (direction=0)
+ * - FAT_EVENT_ENTER	before entering a directory (direction=1)
+ * - FAT_EVENT_LEAVE	when leaving it (direction=-1)
+ * - FAT_EVENT_POST	the chain of the directory again (direction=-2)
+ *
+ * the function receives a cursor with the three references, the event and the
+ * depth in the tree, and returns the same flags as a refrun; events not in
+ * the mask are not dispatched: the visit goes on as if FAT_REFERENCE_NORMAL
+ * were returned, but the chain is not followed if FAT_EVENT_CHAIN is not in the
+ * mask, and it is not followed again when leaving a directory if
+ * FAT_EVENT_POST is not
+ */
+#define FAT_EVENT_ENTRY 0x01
+#define FAT_EVENT_CHAIN 0x02
+#define FAT_EVENT_ENTER 0x04
+#define FAT_EVENT_LEAVE 0x08
+#define FAT_EVENT_POST  0x10
+#define FAT_EVENT_ALL   0x1F
+
+struct fatreference {
+	unit *directory;
+	int index;
+	int32_t previous;
+};
+
+struct fatcursor {
+	struct fatreference ref;	/* the cluster reference */
+	struct fatreference file;	/* entry of the file of the chain */
+	struct fatreference dir;	/* entry of the directory of the file */
+	int event;
+	int depth;
+};
+
+typedef int (* eventrun)(fat *f, struct fatcursor *c, void *user);
+int fatreferencewalk(fat *f,
+		unit *directory, int index, int32_t previous,
+		int mask, eventrun act, void *user);
+
+/*
+ * execute a function on every file
+ */
+typedef void (* filerun)(fat *f, char *path, unit *directory, int index,
+		void *user);
+int fatfileexecute(fat *f,
+		unit *directory, int index, int32_t previous,
+		filerun act, void *user);
+
+/*
+ * print a summary of the filesystem
+ */
+void fatdump(fat *f, unit* directory, int index, int32_t previous,
+		int recur, int all, int chains);
+void fatcalls(fat *f, int all);
+
+/*
+ * count number of clusters
+ */
+int32_t fatcountclusters(fat *f,
+	unit *directory, int index, int32_t previous, int recur);
+int32_t fatcountclusterschains(fat *f, fatchains *c,
+	unit *directory, int index, int32_t previous, int recur);
+
+/*
+ * fix the dot and dotdot files
+ */
+int fatfixdot(fat *f);
+
+/*
+ * cut the chains at FAT_BAD; call fatcleanunused() if they return 1
+ */
+int fatcutbadstart(fat *f,
+	unit *directory, int index, uint32_t previous);
+int fatcutbad(fat *f, int verbose);
+
+/*
+ * use in a refrun function for debugging
+ */
+
+#define FATEXECUTEDEBUG							\
+	{								\
+		fatreferenceprint(dirdirectory, dirindex, dirprevious);	\
+		printf("->");						\
+		fatreferenceprint(startdirectory, startindex, startprevious); \
+		printf("->");						\
+		fatreferenceprint(directory, index, previous);		\
+		printf(" (%d)\n", direction);				\
+		fflush(NULL);						\
+	}
+
+/*
+ * use in a refrun function for fixing . and .. in case of cluster moves/swaps
+ */
+
+#define FATEXECUTEFIXDOT						\
+	if (directory != NULL && fatentryisdotfile(directory, index)) {	\
+		cl = fatentrycompareshortname(directory, index, DOTFILE) ? \
+			fatreferencegettarget(f,			\
+				dirdirectory, dirindex, dirprevious) :	\
+			fatreferencegettarget(f,			\
+				startdirectory, startindex, startprevious); \
+		cl = cl == fatgetrootbegin(f) ? 0 : cl;			\
+		fatreferencesettarget(f,				\
+			directory, index, previous, cl);		\
+		dprintf(" (.%c->%d)", directory->data[index * 32 + 1], cl); \
+		return 0;						\
+	}
+
+#endif
+
+/*
+ * use in a refrun to determine whether the reference is to a directory cluster
+ */
+
+#define FATEXECUTEISDIR							\
+	(directory == NULL &&						\
+	fatreferenceisdirectory(startdirectory, startindex, startprevious)) \
+	||								\
+	(directory != NULL &&						\
+	fatreferenceisdirectory(directory, index, previous));
+
+/*
+ * inverse.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * inverse.h
+ *
+ * an inverse fat is a table linking each clusters to its reference, if any
+ *
+ * it is the inverse of fatreferencegetnext(); it also tells whether the chain
+ * of a cluster is of a directory (as opposed to a regular file), that is, it
+ * contains directory entries (rather than the content of a regular file)
+ */
+
+#ifdef _inverse_H
+#else
+#define _inverse_H
+
+#include "unit.h"
+
+/*
+ * the reference to a cluster, in 8 bytes; a directory cluster is stored by its
+ * number, so that it needs not to stay in memory:
+ * - isentry=1: entry index of the directory cluster previous
+ * - isentry=0: previous cluster in the chain, or -1 (boot) or 0 (none)
+ */
+typedef struct {
+	int32_t previous;
+	uint32_t index : 30;
+	uint32_t isentry : 1;
+	uint32_t isdir : 1;
+} fatinverse;
+
+/*
+ * file where the inverse fat used by complex operations is saved between
+ * runs, if not NULL
+ */
+extern char *fatinversefile;
+
+/*
+ * number of threads building the inverse fat, if more than one; the result is
+ * the same as the one built serially
+ */
+extern int fatinversethreads;
+
+/*
+ * create, delete, update and print an inverse fat
+ */
+fatinverse *fatinversecreate(fat *f, int file);
+fatinverse *fatinverseopen(fat *f, char *filename);
+fatinverse *fatinversechains(fat *f, int file);
+int fatinversedelete(fat *f, fatinverse *rev);
+void fatinverseclear(fatinverse *rev, int32_t cluster);
+int fatinverseisvoid(fatinverse *rev, int32_t cluster);
+int32_t fatinverseset(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous,
+		int isdir);
+int fatinverseget(fat *f, fatinverse *rev, int32_t cluster,
+		unit **directory, int *index, int32_t *previous);
+void fatinverseprint(fat *f, fatinverse *rev, int32_t cl);
+
+/*
+ * check if an updated inverse fat is the same as a recalculated one;
+ * intended for debugging
+ */
+int fatinversecheck(fat *f, fatinverse *rev, int file);
+
+/*
+ * set target, move and swap clusters, updating the inverse fat
+ */
+void fatinversesettarget(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous,
+		int32_t new, int isdir);
+int fatinversemovereference(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous, int isdir,
+		int32_t dst, int writeback);
+int fatinversemove(fat *f, fatinverse *rev,
+		int32_t src, int32_t dst, int writeback);
+int fatinversemoverun(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous, int isdir,
+		int32_t dst, int num, int writeback);
+int fatinverseswapreference(fat *f, fatinverse *rev,
+		unit *srcdir, int srcindex, int32_t srcprevious, int srcisdir,
+		unit *dstdir, int dstindex, int32_t dstprevious, int dstisdir,
+		int writeback);
+int fatinverseswap(fat *f, fatinverse *rev,
+		int32_t src, int32_t dst, int writeback);
+int fatinverserotate(fat *f, fatinverse *rev, int32_t *cycle, int n,
+		int writeback);
+
+/*
+ * go back from clusters or directory entries
+ */
+int fatinversereferencetoentry(fat *f, fatinverse *rev,
+	unit **directory, int *index, int32_t *previous);
+char *fatinversepath(fat *f, fatinverse *rev,
+	unit *directory, int index, int32_t previous);
+int fatinversepreventry(fat *f, fatinverse *rev, unit **directory, int *index);
+
+/*
+ * view and possibly fix the unused clusters marked used
+ */
+int fatunreachable(fat *f, int fix, int each);
+
+#endif
+
+/*
+ * long.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <wchar.h>
+#include <time.h>
+#include "fs.h"
+
+/*
+ * wide strings
+ */
+#define WNULL ((wchar_t) (L'\0'))
+
+/*
+ * find next directory entry, possibly with long filename
+ */
+#define FAT_END        0x8000
+#define FAT_SHORT      0x4000
+#define FAT_LONG_ALL   0x2000
+#define FAT_LONG_SOME  0x1000
+#define FAT_LONG_FIRST 0x0800
+#define FAT_LONG_ERR   0x0400
+
+struct fatlongscan {
+	int n;
+	uint8_t checksum;
+	unit *longdirectory;
+	int longindex;
+	wchar_t *name;
+	int len;
+	int err;
+};
+
+void fatlonginit(struct fatlongscan *scan);
+void fatlongend(struct fatlongscan *scan);
+int fatlongscan(unit *directory, int index, struct fatlongscan *scan);
+
+int fatlongentrytoshort(fat *f, unit *longdirectory, int longindex,
+		unit **directory, int *index, wchar_t **name);
+int fatlongnext(fat *f, unit **directory, int *index,
+		unit **longdirectory, int *longindex, wchar_t **name);
+int fatnextname(fat *f, unit **directory, int *index, wchar_t **name);
+
+/*
+ * read a directory as arrays of decoded entries
+ */
+struct fatdirent {
+	wchar_t *name;
+	char shortname[13];
+	unsigned char attributes;
+	uint32_t size;
+	int32_t first;
+	struct tm write;
+	struct tm create;
+	struct tm read;
+	int32_t cluster;
+	int index;
+	int32_t longcluster;
+	int longindex;
+	int err;
+};
+
+struct fatreaddir {
+	unit *directory;
+	int index;
+	unsigned char *class;	/* classes of the entries of directory */
+	int32_t clusters;	/* clusters of the directory read so far */
+	struct fatlongscan scan;
+	int n;
+	int max;
+	struct fatdirent *entries;
+	int err;		/* -2 bad or looping chain, -3 read error */
+};
+
+struct fatreaddir *fatreaddiropen(fat *f, int32_t dir, int max);
+int fatreaddir(fat *f, struct fatreaddir *r);
+void fatreaddirclose(struct fatreaddir *r);
+
+/*
+ * long file name lookup
+ */
+int fatlookupfilelongboth(fat *f, int32_t dir, wchar_t *name,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex);
+int fatlookupfilelong(fat *f, int32_t dir, wchar_t *name,
+		unit **directory, int *index);
+int32_t fatlookupfirstclusterlong(fat *f, int32_t dir, wchar_t *name);
+
+/*
+ * path lookup
+ */
+int fatlookuppathlongbothdir(fat *f, int32_t *dir, wchar_t *path,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex);
+int fatlookuppathlongboth(fat *f, int32_t dir, wchar_t *path,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex);
+int fatlookuppathlongdir(fat *f, int32_t *dir, wchar_t *path,
+		unit **directory, int *index);
+int fatlookuppathlong(fat *f, int32_t dir, wchar_t *path,
+		unit **directory, int *index);
+int32_t fatlookuppathfirstclusterlong(fat *f, int32_t dir, wchar_t *path);
+
+/*
+ * find free entries
+ */
+int fatfindfreelong(fat *f, int len, unit **directory, int *index,
+		unit **startdirectory, int *startindex);
+int fatfindfreepathlong(fat *f, int32_t dir, wchar_t *path, int len,
+		unit **directory, int *index,
+		unit **startdirectory, int *startindex);
+
+/*
+ * file names
+ */
+int fatinvalidnamelong(const wchar_t *name);
+int fatinvalidpathlong(const wchar_t *path);
+wchar_t *fatlegalizenamelong(const wchar_t *path);
+wchar_t *fatlegalizepathlong(const wchar_t *path);
+wchar_t *fatstoragenamelong(const wchar_t *name);
+wchar_t *fatstoragepathlong(const wchar_t *path);
+
+/*
+ * create an empty file
+ */
+int fatcreatefileshortlong(fat *f, int32_t dir,
+		unsigned char shortname[11], unsigned char casebyte,
+		wchar_t *longname,
+		unit **directory, int *index,
+		unit **startdirectory, int *startindex);
+int fatcreatefilelongboth(fat *f, int32_t dir, wchar_t *longname,
+		unit **directory, int *index,
+		unit **startdirectory, int *startindex);
+int fatcreatefilelong(fat *f, int32_t dir, wchar_t *longname,
+		unit **directory, int *index);
+int fatcreatefilepathlongbothdir(fat *f, int32_t *dir, wchar_t *path,
+		unit **directory, int *index,
+		unit **startdirectory, int *startindex);
+int fatcreatefilepathlongboth(fat *f, int32_t dir, wchar_t *path,
+		unit **directory, int *index,
+		unit **startdirectory, int *startindex);
+int fatcreatefilepathlongdir(fat *f, int32_t *dir, wchar_t *path,
+		unit **directory, int *index);
+int fatcreatefilepathlong(fat *f, int32_t dir, wchar_t *path,
+		unit **directory, int *index);
+int fatcreatefileslong(fat *f, int32_t dir, int n, wchar_t **longnames,
+		unit **directory, int *index);
+
+/*
+ * free a long file name (does not free its short name entry)
+ */
+int fatdeletelong(fat *f, unit *directory, int index);
+
+/*
+ * fatreferenceexecute(), longname version
+ */
+typedef int(* refrunlong)(fat *f,
+	unit *directory, int index, int32_t previous,
+	unit *startdirectory, int startindex, int32_t startprevious,
+	unit *dirdirectory, int dirindex, int32_t dirprevious,
+	wchar_t *name, int err, unit *longdirectory, int longindex,
+	int direction, void *user);
+int fatreferenceexecutelong(fat *f,
+		unit *directory, int index, int32_t previous,
+		refrunlong act, void *user);
+
+void fatdumplong(fat *f, unit* directory, int index, int32_t previous,
+		int recur, int all, int chains);
+
+/*
+ * fatfileexexcute(), longname version
+ */
+typedef void (* longrun)(fat *f, wchar_t *path, unit *directory, int index,
+		wchar_t *name, int err, unit *longdirectory, int longindex,
+		void *user);
+int fatfileexecutelong(fat *f, unit *directory, int index, int32_t previous,
+		longrun act, void *user);
+
+/*
+ * go back to the start of a long name
+ */
+int fatshortentrytolong(fat *f, fatinverse *rev,
+		unit *directory, int index,
+		unit **longdirectory, int *longindex);
+int fatlongreferencetoentry(fat *f, fatinverse *rev,
+		unit **directory, int *index, int32_t *previous,
+		unit **longdirectory, int *longindex);
+int fatshortentrytolongname(fat *f, fatinverse *rev,
+		unit *directory, int index, wchar_t **longname);
+wchar_t *fatinversepathlong(fat *f, fatinverse *rev,
+		unit *directory, int index, int32_t previous);
+
+/*
+ * complex.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * complex.h
+ *
+ * operations that may long to execute and cannot arbitrarily interrupted, so
+ * that some signal handling is necessary
+ *
+ *	FATINTERRUPTIBLEGLOBALS(name)
+ *		declare some globals; choose an arbitrary name that is then
+ *		used in the following macros
+ *
+ *	FATINTERRUPTIBLESTART(name)
+ * 		before starting the entire complex operation, stop SIGTERM and
+ *		SIGINT
+ *
+ *	FATINTERRUPTIBLECHECK(name)
+ *		tells whether operation has to be aborted; if different than
+ *		zero, execution should be cut short as soon as possible
+ *
+ *		check it also at the end if some cleanup code has to be run due
+ *		to the aborted operation
+ *
+ *	FATINTERRUPTIBLEABORT(name, condition)
+ * 		used to abort the operation, as if a signal arrived; condition
+ * 		is a number >0 that FATINTERRUPTIBLECHECK(name) returns; -1
+ * 		signals abortion due to signal
+ *
+ *	FATINTERRUPTIBLEFINISH(name) enable the signals again
+ *
+ * due to globals, a function using these macros is not reentrant
+ */
+
+#ifdef _COMPLEX_H
+#else
+#define _COMPLEX_H
+
+#include "fs.h"
+
+/*
+ * file where defragmentation and moving an area keep track of their progress,
+ * if not NULL; an operation interrupted or crashed is resumed from it
+ * libllfat.txt: [Journal]
+ */
+extern char *fatjournalfile;
+
+/*
+ * uninterruptible flush
+ */
+int fatuflush(fat *f);
+
+/*
+ * move the clusters in an area to another, in cluster reference order
+ * libllfat.txt: [Cluster reference order]
+ */
+int fatmovearea(fat *f,
+		int32_t srcbegin, int32_t srcend,
+		int32_t dstbegin, int32_t dstend);
+
+/*
+ * compact a filesystem by moving used clusters at the beginning
+ */
+int fatcompact(fat *f);
+
+/*
+ * truncate a filesystem
+ */
+int fattruncate(fat *f, int numclusters);
+
+/*
+ * cost of shrinking a filesystem, without changing anything
+ */
+typedef struct {
+	int32_t clusters;	/* clusters of files over the bound */
+	int32_t moved;		/* clusters that would be moved */
+	uint64_t bytes;		/* bytes read and then written to move them */
+	int files;		/* files with some cluster over the bound */
+	int truncated;		/* files that would be cut */
+	int32_t lost;		/* clusters cut from them */
+	int32_t other;		/* used clusters over the bound of no file */
+	double seconds;		/* time to move, at the given throughput */
+} fatshrinkcost;
+
+int fatshrinkestimate(fat *f, int32_t numclusters, int move,
+		double throughput, fatshrinkcost *c);
+
+/*
+ * enlarge a filesystem, moving the first clusters if the fats have to grow
+ */
+int fatgrow(fat *f, uint32_t sectors);
+
+/*
+ * defragment a part of a filesystem, or all of it
+ */
+int fatlinearize(fat *f, unit *directory, int index, int32_t previous,
+		int32_t start, int recur, int testonly, int *nchanges);
+int fatdefragment(fat *f, int testonly, int *nchanges);
+
+/*
+ * move all directories at the start of the data area, in breadth-first order
+ */
+int fatdirectoriesfirst(fat *f, int testonly, int *nchanges);
+
+/*
+ * defragment only the most fragmented files, within a budget of clusters
+ */
+int fatdefragmentselective(fat *f, int minfragments, int32_t budget,
+		int testonly, int *nchanges);
+
+/*
+ * macros for dealing with signals (see top of file)
+ */
+
+#define FATINTERRUPTIBLEINTERRUPTED -1
+#define FATINTERRUPTIBLENORMAL 0
+#define FATINTERRUPTIBLEIOERROR 1
+
+#define FATINTERRUPTIBLEGLOBAL(name)					\
+	int _##name##killed;						\
+	void _##name##handler(int __attribute__((unused)) signum) {	\
+		_##name##killed = FATINTERRUPTIBLEINTERRUPTED;		\
+	}
+#define FATINTERRUPTIBLEINIT(name)					\
+	_##name##killed = FATINTERRUPTIBLENORMAL;			\
+	signal(SIGINT, _##name##handler);				\
+	signal(SIGTERM, _##name##handler);
+#define FATINTERRUPTIBLECHECK(name) (_##name##killed)
+#define FATINTERRUPTIBLEABORT(name, condition) {_##name##killed = condition;}
+#define FATINTERRUPTIBLEFINISH(name)					\
+	signal(SIGINT, SIG_DFL);					\
+	signal(SIGTERM, SIG_DFL);
+
+#endif
+
+/*
+ * parallel.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * parallel.h
+ *
+ * walk the directory tree with many threads
+ *
+ * each thread opens the filesystem again, so it has its own file descriptor
+ * and caches; nothing of the filesystem is modified, and the fat passed to
+ * the functions is to be flushed before
+ */
+
+#ifdef _PARALLEL_H
+#else
+#define _PARALLEL_H
+
+#include <stdint.h>
+#include <wchar.h>
+#include "fs.h"
+
+struct fatdirent;
+
+/*
+ * call a function on every file in a directory and its subdirectories
+ *
+ * the directories are read by the given number of threads; the function is
+ * called with the decoded directory entry and the path of the directory that
+ * contains it (the same as fatfileexecutelong); it is called:
+ *
+ * - by the threads, concurrently and in no particular order; the fat is the
+ *   one opened by the thread, and is only to be read
+ *
+ * - with FAT_WALK_ORDERED: by the calling thread, in the order of
+ *   fatfileexecutelong(); the fat is the one passed to fatwalk()
+ *
+ * return -1 if some directory could not be read
+ */
+#define FAT_WALK_ORDERED 0x01
+
+typedef void (* walkrun)(fat *f, wchar_t *path, struct fatdirent *entry,
+		void *user);
+int fatwalk(fat *f, int32_t dir, int threads, int flags,
+		walkrun act, void *user);
+
+/*
+ * copy a directory and all its content to the directory dest of the host
+ *
+ * the tree is walked by the given number of threads, each also copying the
+ * data of the files it finds with fatfilestream(); subdirectories are created
+ * as needed; the write time is the modification time of the host files and
+ * directories, the read date their access time; read-only files are made
+ * read-only on the host; the other attributes have no equivalent; files and
+ * directories named dot, dotdot or with a slash in the name are not copied;
+ * errors are printed and the extraction continues with the next file
+ *
+ * return -1 if some file or directory could not be read or written
+ */
+int fatextract(fat *f, int32_t dir, char *dest, int threads);
+
+#endif
+/*
+ * file.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * file.h
+ *
+ * copy the content of files from and to file descriptors, bypassing the cache
+ * of clusters
+ *
+ * the data clusters of a file are only copied, never interpreted; caching
+ * them like the directory clusters would only fill memory; the first cluster
+ * and the size in the directory entry of the file are left to the caller
+ */
+
+#ifdef _FILE_H
+#else
+#define _FILE_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/*
+ * copy a chain of clusters to a file descriptor
+ *
+ * the chain starts at cluster first and is followed in the fat of f; the
+ * data is read from the same clusters in the device of data, which is usually
+ * f itself; at most size bytes are copied, or the whole chain if size is -1;
+ * each run of consecutive clusters is copied by a single copy_file_range(),
+ * or by sendfile() if fd does not allow it (like a pipe), or by read() and
+ * write() as a last resort; the data does not go through the cache
+ *
+ * return the number of bytes copied, less than size if the chain is shorter,
+ * or -1 on error
+ */
+int64_t fatfilestream(fat *f, fat *data, int32_t first, int64_t size, int fd);
+
+/*
+ * write what is read from a file descriptor to a new chain of clusters
+ *
+ * the clusters are allocated between begin and end; size is the expected
+ * length, or -1 if unknown: if given, a single sequence of free clusters this
+ * long is searched first; the data is read from fd in chunks of some
+ * megabytes, each written by a pwrite() for every sequence of consecutive
+ * clusters it goes to; the clusters are linked in the fat when allocated, by
+ * extending the previous sequence if the next cluster is free or by taking
+ * the next free one otherwise; if fd is -1, nothing is read or written: the
+ * clusters for size bytes are only allocated
+ *
+ * return the number of bytes written and the first cluster of the chain in
+ * *first (FAT_UNUSED if nothing was written); on error, the chain is freed
+ * and -1 is returned for an IO error, -2 if the filesystem is full
+ */
+int64_t fatfilewrite(fat *f, int fd, int64_t size,
+		int32_t begin, int32_t end, int32_t *first);
+
+#endif
+/*
+ * debug.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG_H
+#else
+#define _DEBUG_H
+
+extern int fatcomplexdebug;
+extern int fatinversedebug;
+extern int fatreferencedebug;
+extern int fatreferenceerror;
+extern int fatlongdebug;
+extern int fatparalleldebug;
+extern int fatdirectorydebug;
+extern int fatdebug;
+extern int fattabledebug;
+extern int fattableerror;
+extern int fatunitdebug;
+
+#endif
+
@@ -34,6 +34,7 @@
 #include <wctype.h>
 #include <iconv.h>
 #include <errno.h>
+#include <search.h>
 #include "entry.h"
 #include "directory.h"
 #include "table.h"
@@ -368,6 +369,129 @@ int fatnextname(fat *f, unit **directory, int *index, wchar_t **name) {
 	return res == FAT_END ? -1 : 0;
 }
 
+/*
+ * read a directory a batch of decoded entries at time
+ */
+struct fatreaddir *fatreaddiropen(fat *f, int32_t dir, int max) {
+	struct fatreaddir *r;
+
+	r = malloc(sizeof(struct fatreaddir));
+	if (r == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	r->directory = fatclusterread(f, dir);
+	if (r->directory == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->index = 0;
+	r->class = NULL;
+	r->clusters = 1;
+	r->err = 0;
+	fatlonginit(&r->scan);
+
+	r->n = 0;
+	r->max = max <= 0 ? 64 : max;
+	r->entries = malloc(r->max * sizeof(struct fatdirent));
+	if (r->entries == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	return r;
+}
+
+int fatreaddir(fat *f, struct fatreaddir *r) {
+	struct fatdirent *e;
+	int res;
+	int32_t next;
+	unit *directory;
+	int index;
+
+	for (; r->n > 0; r->n--)
+		free(r->entries[r->n - 1].name);
+
+	while (r->directory != NULL && r->n < r->max) {
+		res = fatlongscan(r->directory, r->index, &r->scan);
+		if (res == FAT_END) {
+			r->directory = NULL;
+			break;
+		}
+
+		if (res & FAT_SHORT) {
+			e = &r->entries[r->n++];
+
+			e->name = r->scan.name;
+			r->scan.name = NULL;
+			e->err = r->scan.err;
+			fatentrygetshortname(r->directory, r->index,
+				e->shortname);
+			e->attributes =
+				fatentrygetattributes(r->directory, r->index);
+			e->size = fatentrygetsize(r->directory, r->index);
+			e->first = fatentrygetfirstcluster(r->directory,
+				r->index, fatbits(f));
+			fatentrygetwritetime(r->directory, r->index,
+				&e->write);
+			fatentrygetcreatetime(r->directory, r->index,
+				&e->create);
+			fatentrygetreadtime(r->directory, r->index, &e->read);
+			e->cluster = r->directory->n;
+			e->index = r->index;
+			e->longcluster = r->scan.longdirectory->n;
+			e->longindex = r->scan.longindex;
+
+			fatlongend(&r->scan);
+		}
+
+				/* deleted entries only matter in the middle of
+				   a long name, where they break it */
+
+		directory = r->directory;
+		index = r->index;
+		res = fatnextentryclass(f, &r->directory, &r->index,
+			&r->class, r->scan.n < 0 ?
+				FAT_CLASS_LONG | FAT_CLASS_EXISTS :
+				FAT_CLASS_ALL);
+
+				/* a new cluster; more than the filesystem has
+				   means a loop in the chain */
+
+		if (res >= 0 &&
+		    (r->directory != directory || r->index <= index) &&
+		    ++r->clusters > fatlastcluster(f))
+			res = -2;
+		if (res < 0) {
+			r->directory = NULL;
+			if (res != -1)
+				r->err = res;
+		}
+	}
+
+			/* read ahead the next cluster of the directory */
+
+	if (r->directory != NULL) {
+		next = fatgetnextcluster(f, r->directory->n);
+		if (next >= FAT_FIRST)
+			fatclusterprefetch(f, next);
+	}
+
+			/* an error comes after the entries read before it */
+
+	return r->n > 0 || r->err == 0 ? r->n : r->err;
+}
+
+void fatreaddirclose(struct fatreaddir *r) {
+	for (; r->n > 0; r->n--)
+		free(r->entries[r->n - 1].name);
+	fatlongend(&r->scan);
+	free(r->class);
+	free(r->entries);
+	free(r);
+}
+
 /*
  * string matching, case sensitive or not depending on f->insensitive
  */
@@ -390,6 +514,8 @@ int fatlookupfilelongboth(fat *f, int32_t dir, wchar_t *name,
 	wchar_t *sname;
 	int32_t cl;
 	int res;
+	struct fatlongscan scan;
+	unsigned char *class;
 
 	dprintf("lookup file %ls:", name);
 
@@ -403,21 +529,38 @@ int fatlookupfilelongboth(fat *f, int32_t dir, wchar_t *name,
 	}
 
 	*directory = fatclusterread(f, dir);
+	if (*directory == NULL)
+		return -1;
 
-	for (*index = 0;
-	     fatlongnext(f, directory, index,
-	     		longdirectory, longindex, &sname) != FAT_END;
-	     fatnextentry(f, directory, index)) {
-		dprintf(" %ls", sname);
-		if (! _fatwcscmp(f, name, sname)) {
-			dprintf(" <- (found)\n");
-			free(sname);
-			return 0;
+			/* as in fatreaddir(), deleted entries are skipped
+			   unless they break a long name */
+
+	fatlonginit(&scan);
+	class = NULL;
+	*index = 0;
+	while ((res = fatlongscan(*directory, *index, &scan)) != FAT_END) {
+		if (res & FAT_SHORT) {
+			dprintf(" %ls", scan.name);
+			if (! _fatwcscmp(f, name, scan.name)) {
+				dprintf(" <- (found)\n");
+				*longdirectory = scan.longdirectory;
+				*longindex = scan.longindex;
+				fatlongend(&scan);
+				free(class);
+				return 0;
+			}
 		}
-		free(sname);
+
+		if (fatnextentryclass(f, directory, index, &class,
+				scan.n < 0 ?
+					FAT_CLASS_LONG | FAT_CLASS_EXISTS :
+					FAT_CLASS_ALL))
+			break;
 	}
 
 	dprintf(" (not found)\n");
+	fatlongend(&scan);
+	free(class);
 	*directory = NULL;
 	return -1;
 }
@@ -760,9 +903,10 @@ void _fatsetlongpart(unit *directory, int index, wchar_t *part,
 }
 
 /*
- * create an empty file from its short and long name, in a given directory
+ * create an empty file from its short and long name, looking for free entries
+ * after directory,index
  */
-int fatcreatefileshortlong(fat *f, int32_t dir,
+int _fatcreatefileshortlongafter(fat *f,
 		unsigned char shortname[11], unsigned char casebyte,
 		wchar_t *longname,
 		unit **directory, int *index,
@@ -782,13 +926,6 @@ int fatcreatefileshortlong(fat *f, int32_t dir,
 	len = wcslen(longname);
 	n = (len + 12) / 13 + 1;
 
-	*directory = fatclusterread(f, dir);
-	if (*directory == NULL) {
-		dprintf("cannot read cluster %d\n", dir);
-		return -1;
-	}
-	*index = -1;
-
 	if (fatfindfreelong(f, n, directory, index,
 			startdirectory, startindex)) {
 		dprintf("not enough free entries for file\n");
@@ -825,6 +962,25 @@ int fatcreatefileshortlong(fat *f, int32_t dir,
 	return 0;
 }
 
+/*
+ * create an empty file from its short and long name, in a given directory
+ */
+int fatcreatefileshortlong(fat *f, int32_t dir,
+		unsigned char shortname[11], unsigned char casebyte,
+		wchar_t *longname,
+		unit **directory, int *index,
+		unit **startdirectory, int *startindex) {
+	*directory = fatclusterread(f, dir);
+	if (*directory == NULL) {
+		dprintf("cannot read cluster %d\n", dir);
+		return -1;
+	}
+	*index = -1;
+
+	return _fatcreatefileshortlongafter(f, shortname, casebyte, longname,
+		directory, index, startdirectory, startindex);
+}
+
 /*
  * determine the short name of a file from its long name
  */
@@ -898,25 +1054,86 @@ int _fatshorttoshort(wchar_t *name,
 	return 0;
 }
 
-int _fatshortexists(fat *f, int32_t dir, unsigned char shortname[11]) {
+/*
+ * set of the short names in a directory, so that generating a short name
+ * does not require scanning the directory for each candidate; the numeric
+ * tails already used for each stem are kept in a second set, so that a
+ * sequence of similar names does not try ~1, ~2, ... every time
+ */
+struct fatshortnames {
+	void *names;
+	void *tails;
+	int usetails;
+};
+
+struct fatshorttail {
+	unsigned char stem[11];
+	int n;
+};
+
+int _fatshortcompare(const void *a, const void *b) {
+	return memcmp(a, b, 11);
+}
+
+int _fatshortadd(struct fatshortnames *set, unsigned char shortname[11]) {
+	unsigned char *name;
+
+	name = malloc(11);
+	if (name == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	memcpy(name, shortname, 11);
+
+	if (*(unsigned char **) tsearch(name, &set->names, _fatshortcompare)
+			!= name)
+		free(name);
+	return 0;
+}
+
+int _fatshortexists(struct fatshortnames *set, unsigned char shortname[11]) {
+	return tfind(shortname, &set->names, _fatshortcompare) != NULL;
+}
+
+struct fatshortnames *_fatshortnames(fat *f, int32_t dir, int tails) {
+	struct fatshortnames *set;
 	unit *directory;
 	int index;
+	unsigned char *class;
 
 	directory = fatclusterread(f, dir);
 	if (directory == NULL)
-		return 0;
+		return NULL;
 
+	set = malloc(sizeof(struct fatshortnames));
+	if (set == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	set->names = NULL;
+	set->tails = NULL;
+	set->usetails = tails;
+
+	class = NULL;
 	for (index = -1;
-	     ! fatnextentry(f, &directory, &index); )
-		if (! memcmp(& ENTRYPOS(directory, index, 0), shortname, 11))
-			return 1;
+	     ! fatnextentryclass(f, &directory, &index,
+			&class, FAT_CLASS_EXISTS); )
+		_fatshortadd(set, & ENTRYPOS(directory, index, 0));
+	free(class);
 
-	return 0;
+	return set;
+}
+
+void _fatshortnamesfree(struct fatshortnames *set) {
+	tdestroy(set->names, free);
+	tdestroy(set->tails, free);
+	free(set);
 }
 
-int _fatlongtoshort(fat *f, int32_t dir, wchar_t *name,
+int _fatlongtoshort(struct fatshortnames *set, wchar_t *name,
 		unsigned char shortname[11]) {
-	unsigned char stem[11], num[9];
+	unsigned char stem[11], num[12];
+	struct fatshorttail *tail, **found;
 	wchar_t *dot;
 	int i, n;
 
@@ -939,10 +1156,25 @@ int _fatlongtoshort(fat *f, int32_t dir, wchar_t *name,
 
 	// dprintf("%.11s\n", stem);
 	memcpy(shortname, stem, 11);
-	if (_fatshortexists(f, dir, shortname) == 0)
+	if (! _fatshortexists(set, shortname))
 		return 0;
 
-	for (n = 1; n < 99999; n++) {
+	tail = NULL;
+	if (set->usetails) {
+		tail = malloc(sizeof(struct fatshorttail));
+		if (tail == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		memcpy(tail->stem, stem, 11);
+		tail->n = 0;
+		found = tsearch(tail, &set->tails, _fatshortcompare);
+		if (*found != tail)
+			free(tail);
+		tail = *found;
+	}
+
+	for (n = tail == NULL ? 1 : tail->n + 1; n < 99999; n++) {
 		sprintf((char *) num, "%+8d", n);
 
 		for (i = 0; i < 11; i++)
@@ -954,8 +1186,11 @@ int _fatlongtoshort(fat *f, int32_t dir, wchar_t *name,
 				shortname[i] = num[i];
 
 		// dprintf("%.11s\n", shortname);
-		if (_fatshortexists(f, dir, shortname) == 0)
+		if (! _fatshortexists(set, shortname)) {
+			if (tail != NULL)
+				tail->n = n;
 			return 0;
+		}
 	}
 
 	return -1;
@@ -969,6 +1204,8 @@ int fatcreatefilelongboth(fat *f, int32_t dir, wchar_t *name,
 		unit **startdirectory, int *startindex) {
 	unsigned char shortname[11];
 	unsigned char casebyte;
+	struct fatshortnames *set;
+	int res;
 
 	if (name[0] == L'\0')
 		return -1;
@@ -977,8 +1214,15 @@ int fatcreatefilelongboth(fat *f, int32_t dir, wchar_t *name,
 
 	if (! _fatshorttoshort(name, shortname, &casebyte))
 		name = L"";
-	else if (_fatlongtoshort(f, dir, name, shortname))
-		return -1;
+	else {
+		set = _fatshortnames(f, dir, 0);
+		if (set == NULL)
+			return -1;
+		res = _fatlongtoshort(set, name, shortname);
+		_fatshortnamesfree(set);
+		if (res)
+			return -1;
+	}
 
 	dprintf("shortname: |%11.11s|\t\tlongname: |%ls|\n", shortname, name);
 
@@ -994,6 +1238,55 @@ int fatcreatefilelong(fat *f, int32_t dir, wchar_t *name,
 		&startdirectory, &startindex);
 }
 
+/*
+ * create many empty files in the same directory: the short names are checked
+ * against a set built by a single scan of the directory, and the search for
+ * free entries for each file starts where the previous one ended
+ */
+int fatcreatefileslong(fat *f, int32_t dir, int n, wchar_t **names,
+		unit **directory, int *index) {
+	unsigned char shortname[11];
+	unsigned char casebyte;
+	wchar_t *name;
+	struct fatshortnames *set;
+	unit *scandirectory, *startdirectory;
+	int scanindex, startindex;
+	int i;
+
+	set = _fatshortnames(f, dir, 1);
+	if (set == NULL)
+		return -1;
+
+	scandirectory = fatclusterread(f, dir);
+	scanindex = -1;
+
+	for (i = 0; i < n; i++) {
+		name = names[i];
+		if (name[0] == L'\0')
+			break;
+
+		if (! _fatshorttoshort(name, shortname, &casebyte))
+			name = L"";
+		else if (_fatlongtoshort(set, name, shortname))
+			break;
+
+		dprintf("shortname: |%11.11s|\t\tlongname: |%ls|\n",
+			shortname, name);
+
+		if (_fatcreatefileshortlongafter(f, shortname, casebyte, name,
+				&scandirectory, &scanindex,
+				&startdirectory, &startindex))
+			break;
+		_fatshortadd(set, shortname);
+
+		directory[i] = scandirectory;
+		index[i] = scanindex;
+	}
+
+	_fatshortnamesfree(set);
+	return i;
+}
+
 /*
  * create an empty file from a long path, starting from directory dir
  */
@@ -1356,7 +1649,7 @@ int fatshortentrytolong(fat *f, fatinverse *rev,
 int fatlongreferencetoentry(fat *f, fatinverse *rev,
 		unit **directory, int *index, int32_t *previous,
 		unit **longdirectory, int *longindex) {
-	if (fatinversereferencetoentry(rev, directory, index, previous))
+	if (fatinversereferencetoentry(f, rev, directory, index, previous))
 		return -2;
 
 	return fatshortentrytolong(f, rev,
@@ -1394,7 +1687,8 @@ wchar_t *fatinversepathlong(fat *f, fatinverse *rev,
 	while (! fatreferenceisvoid(directory, index, previous) &&
 	      ! fatreferenceisboot(directory, index, previous)) {
 
-		fatinversereferencetoentry(rev, &directory, &index, &previous);
+		fatinversereferencetoentry(f, rev,
+			&directory, &index, &previous);
 
 		if (fatreferenceisboot(directory, index, previous))
 			longname = wcsdup(L"");
@@ -17,6 +17,7 @@
  */
 
 #include <wchar.h>
+#include <time.h>
 #include "fs.h"
 
 /*
@@ -54,6 +55,41 @@ int fatlongnext(fat *f, unit **directory, int *index,
 		unit **longdirectory, int *longindex, wchar_t **name);
 int fatnextname(fat *f, unit **directory, int *index, wchar_t **name);
 
+/*
+ * read a directory as arrays of decoded entries
+ */
+struct fatdirent {
+	wchar_t *name;
+	char shortname[13];
+	unsigned char attributes;
+	uint32_t size;
+	int32_t first;
+	struct tm write;
+	struct tm create;
+	struct tm read;
+	int32_t cluster;
+	int index;
+	int32_t longcluster;
+	int longindex;
+	int err;
+};
+
+struct fatreaddir {
+	unit *directory;
+	int index;
+	unsigned char *class;	/* classes of the entries of directory */
+	int32_t clusters;	/* clusters of the directory read so far */
+	struct fatlongscan scan;
+	int n;
+	int max;
+	struct fatdirent *entries;
+	int err;		/* -2 bad or looping chain, -3 read error */
+};
+
+struct fatreaddir *fatreaddiropen(fat *f, int32_t dir, int max);
+int fatreaddir(fat *f, struct fatreaddir *r);
+void fatreaddirclose(struct fatreaddir *r);
+
 /*
  * long file name lookup
  */
@@ -121,6 +157,8 @@ int fatcreatefilepathlongdir(fat *f, int32_t *dir, wchar_t *path,
 		unit **directory, int *index);
 int fatcreatefilepathlong(fat *f, int32_t dir, wchar_t *path,
 		unit **directory, int *index);
+int fatcreatefileslong(fat *f, int32_t dir, int n, wchar_t **longnames,
+		unit **directory, int *index);
 
 /*
  * free a long file name (does not free its short name entry)
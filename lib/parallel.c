@@ -0,0 +1,645 @@
+/*
+ * parallel.c
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * parallel.c
+ *
+ * walk the directory tree with many threads
+ *
+ * the directories to read are in a queue; each thread takes a directory from
+ * the queue, reads all its entries with its own fat and adds its
+ * subdirectories to the queue; a bitmap of the directory clusters already
+ * queued avoids looping on a directory that contains itself
+ *
+ * in ordered mode the directories are not freed by the threads; the calling
+ * thread visits them depth-first, waiting for each to be read
+ *
+ * extracting a tree is a walk in no particular order where each thread also
+ * copies the files it finds; a directory is created when its entry is met,
+ * which is before its own entries are read
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "fs.h"
+#include "table.h"
+#include "entry.h"
+#include "inverse.h"
+#include "long.h"
+#include "file.h"
+#include "parallel.h"
+
+int fatparalleldebug = 0;
+#define dprintf if (fatparalleldebug) printf
+
+struct fatwalkdir {
+	wchar_t *path;
+	int32_t cluster;
+	int done;
+	int n;
+	struct fatdirent *entries;
+	struct fatwalkdir **sub;
+	struct fatwalkdir *next;
+};
+
+struct fatwalk {
+	int flags;
+	walkrun act;
+	void *user;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;			/* queue changed */
+	pthread_cond_t read;			/* a directory has been read */
+	struct fatwalkdir *queue;
+	int pending;				/* queued or being read */
+	unsigned char *visited;
+	int32_t last;
+	int err;
+};
+
+struct fatwalkthread {
+	pthread_t thread;
+	fat *f;
+	struct fatwalk *w;
+};
+
+struct fatwalkdir *_fatwalknew(wchar_t *path, wchar_t *name, int32_t cl) {
+	struct fatwalkdir *d;
+	size_t len;
+
+	d = malloc(sizeof(struct fatwalkdir));
+	if (d == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	len = wcslen(path) + (name == NULL ? 0 : wcslen(name) + 1);
+	d->path = malloc((len + 1) * sizeof(wchar_t));
+	if (d->path == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	wcscpy(d->path, path);
+	if (name != NULL) {
+		wcscat(d->path, name);
+		wcscat(d->path, L"/");
+	}
+
+	d->cluster = cl;
+	d->done = 0;
+	d->n = 0;
+	d->entries = NULL;
+	d->sub = NULL;
+	d->next = NULL;
+	return d;
+}
+
+void _fatwalkfree(struct fatwalkdir *d) {
+	int i;
+
+	for (i = 0; i < d->n; i++)
+		free(d->entries[i].name);
+	free(d->entries);
+	free(d->sub);
+	free(d->path);
+	free(d);
+}
+
+/*
+ * read all entries of a directory and create its subdirectories
+ */
+int _fatwalkread(fat *f, struct fatwalkdir *d) {
+	struct fatreaddir *r;
+	struct fatdirent *e;
+	int i, size, res;
+
+	dprintf("reading directory %d: %ls\n", d->cluster, d->path);
+
+	r = fatreaddiropen(f, d->cluster, 0);
+	if (r == NULL)
+		return -1;
+
+	size = 0;
+	while (fatreaddir(f, r) > 0) {
+		if (d->n + r->n > size) {
+			size = 2 * (d->n + r->n);
+			d->entries = realloc(d->entries,
+				size * sizeof(struct fatdirent));
+			if (d->entries == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
+			}
+		}
+		for (i = 0; i < r->n; i++) {
+			d->entries[d->n++] = r->entries[i];
+			r->entries[i].name = NULL;
+		}
+	}
+	res = r->err;
+	fatreaddirclose(r);
+	if (res)
+		dprintf("error reading directory %d: %ls\n",
+			d->cluster, d->path);
+
+	d->sub = malloc((d->n + 1) * sizeof(struct fatwalkdir *));
+	if (d->sub == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	for (i = 0; i < d->n; i++) {
+		e = &d->entries[i];
+		d->sub[i] = ! (e->attributes & FAT_ATTR_DIR) ||
+			e->first < FAT_ROOT ||
+			! strcmp(e->shortname, ".") ||
+			! strcmp(e->shortname, "..") ?
+				NULL :
+				_fatwalknew(d->path, e->name, e->first);
+	}
+
+	return res ? -1 : 0;
+}
+
+/*
+ * a thread: read directories from the queue until none is left
+ */
+void *_fatwalkthread(void *arg) {
+	struct fatwalkthread *t;
+	struct fatwalk *w;
+	struct fatwalkdir *d, *s;
+	int i, res;
+
+	t = (struct fatwalkthread *) arg;
+	w = t->w;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		while (w->queue == NULL && w->pending > 0)
+			pthread_cond_wait(&w->queued, &w->mutex);
+		if (w->queue == NULL)
+			break;
+		d = w->queue;
+		w->queue = d->next;
+		pthread_mutex_unlock(&w->mutex);
+
+		res = _fatwalkread(t->f, d);
+
+		if (! (w->flags & FAT_WALK_ORDERED))
+			for (i = 0; i < d->n; i++)
+				w->act(t->f, d->path, &d->entries[i], w->user);
+
+		pthread_mutex_lock(&w->mutex);
+		if (res)
+			w->err = -1;
+		for (i = d->n - 1; i >= 0; i--) {
+			s = d->sub[i];
+			if (s == NULL)
+				continue;
+			if (s->cluster <= w->last) {
+				if (w->visited[s->cluster / 8] &
+				    (1 << (s->cluster % 8))) {
+					_fatwalkfree(s);
+					d->sub[i] = NULL;
+					continue;
+				}
+				w->visited[s->cluster / 8] |=
+					1 << (s->cluster % 8);
+			}
+			s->next = w->queue;
+			w->queue = s;
+			w->pending++;
+		}
+		w->pending--;
+		d->done = 1;
+		if (w->flags & FAT_WALK_ORDERED)
+			pthread_cond_broadcast(&w->read);
+		else
+			_fatwalkfree(d);
+		pthread_cond_broadcast(&w->queued);
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return NULL;
+}
+
+/*
+ * in ordered mode, the calling thread visits the directories depth-first
+ */
+void _fatwalkordered(fat *f, struct fatwalk *w, struct fatwalkdir *root) {
+	struct {
+		struct fatwalkdir *d;
+		int i;
+	} *stack;
+	struct fatwalkdir *d;
+	int size, depth, i;
+
+	size = 16;
+	stack = malloc(size * sizeof(*stack));
+	if (stack == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	depth = 0;
+	stack[depth].d = root;
+	stack[depth].i = 0;
+	depth++;
+
+	while (depth > 0) {
+		d = stack[depth - 1].d;
+		if (stack[depth - 1].i == 0) {
+			pthread_mutex_lock(&w->mutex);
+			while (! d->done)
+				pthread_cond_wait(&w->read, &w->mutex);
+			pthread_mutex_unlock(&w->mutex);
+		}
+
+		if (stack[depth - 1].i >= d->n) {
+			_fatwalkfree(d);
+			depth--;
+			continue;
+		}
+
+		i = stack[depth - 1].i++;
+		w->act(f, d->path, &d->entries[i], w->user);
+		if (d->sub[i] == NULL)
+			continue;
+
+		if (depth >= size) {
+			size *= 2;
+			stack = realloc(stack, size * sizeof(*stack));
+			if (stack == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
+			}
+		}
+		stack[depth].d = d->sub[i];
+		stack[depth].i = 0;
+		depth++;
+	}
+
+	free(stack);
+}
+
+/*
+ * call a function on every file in a directory and its subdirectories
+ */
+int fatwalk(fat *f, int32_t dir, int threads, int flags,
+		walkrun act, void *user) {
+	struct fatwalk w;
+	struct fatwalkthread *t;
+	struct fatwalkdir *root;
+	int i, n;
+
+	if (threads < 1)
+		threads = 1;
+
+	t = malloc(threads * sizeof(struct fatwalkthread));
+	if (t == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	for (i = 0, n = 0; i < threads; i++) {
+		t[n].f = fatopen(f->devicename, f->offset);
+		if (t[n].f == NULL)
+			continue;
+		t[n].f->nfat = f->nfat;
+		t[n].f->insensitive = f->insensitive;
+		t[n].w = &w;
+		n++;
+	}
+	if (n == 0) {
+		free(t);
+		return -1;
+	}
+	dprintf("walking with %d threads\n", n);
+
+	w.flags = flags;
+	w.act = act;
+	w.user = user;
+	pthread_mutex_init(&w.mutex, NULL);
+	pthread_cond_init(&w.queued, NULL);
+	pthread_cond_init(&w.read, NULL);
+	w.last = fatlastcluster(f);
+	w.visited = calloc(w.last / 8 + 1, 1);
+	if (w.visited == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	w.err = 0;
+
+	root = _fatwalknew(L"", NULL, dir);
+	if (dir <= w.last)
+		w.visited[dir / 8] |= 1 << (dir % 8);
+	w.queue = root;
+	w.pending = 1;
+
+	for (i = 0; i < n; i++)
+		pthread_create(&t[i].thread, NULL, _fatwalkthread, &t[i]);
+
+	if (flags & FAT_WALK_ORDERED)
+		_fatwalkordered(f, &w, root);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(t[i].thread, NULL);
+		fatquit(t[i].f);
+	}
+	free(t);
+
+	free(w.visited);
+	pthread_cond_destroy(&w.read);
+	pthread_cond_destroy(&w.queued);
+	pthread_mutex_destroy(&w.mutex);
+	return w.err;
+}
+
+/*
+ * extract a directory tree to the host
+ */
+
+struct fatextractdir {
+	char *path;
+	struct timespec times[2];
+	struct fatextractdir *next;
+};
+
+struct fatextractskip {
+	wchar_t *path;
+	struct fatextractskip *next;
+};
+
+struct fatextract {
+	char *dest;
+	pthread_mutex_t mutex;
+	struct fatextractdir *dirs;
+	struct fatextractskip *skip;	/* directories not extracted */
+	int err;
+};
+
+/*
+ * host name of a file: characters not in the current locale become '?'
+ */
+char *_fatextractname(wchar_t *name) {
+	char *res;
+	size_t len, pos, n;
+	mbstate_t state;
+	int i;
+
+	len = wcslen(name) * MB_CUR_MAX + 1;
+	res = malloc(len);
+	if (res == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	memset(&state, 0, sizeof(mbstate_t));
+	for (i = 0, pos = 0; name[i] != L'\0'; i++) {
+		n = wcrtomb(res + pos, name[i], &state);
+		if (n == (size_t) -1) {
+			memset(&state, 0, sizeof(mbstate_t));
+			res[pos++] = '?';
+		}
+		else
+			pos += n;
+	}
+	res[pos] = '\0';
+	return res;
+}
+
+/*
+ * access and modification time of a directory entry; a zero date (before
+ * 1980 once decoded) is not a time, and is left as UTIME_OMIT
+ */
+void _fatextracttimes(struct fatdirent *e, struct timespec times[2]) {
+	struct tm tm;
+	time_t t;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		tm = i == 0 ? e->read : e->write;
+		tm.tm_isdst = -1;
+		t = tm.tm_year < 80 ? (time_t) -1 : mktime(&tm);
+		times[i].tv_sec = t == (time_t) -1 ? 0 : t;
+		times[i].tv_nsec = t == (time_t) -1 ? UTIME_OMIT : 0;
+	}
+}
+
+/*
+ * a name that would not stay in its directory on the host: empty, dot,
+ * dotdot or containing a slash
+ */
+int _fatextractunsafe(wchar_t *name) {
+	return name[0] == L'\0' ||
+		! wcscmp(name, L".") || ! wcscmp(name, L"..") ||
+		wcschr(name, L'/') != NULL;
+}
+
+/*
+ * whether a path is in a directory not extracted; such a directory is
+ * recorded before its entries are read, so before they get here
+ */
+int _fatextractskipped(struct fatextract *x, wchar_t *path) {
+	struct fatextractskip *s;
+	int res;
+
+	res = 0;
+	pthread_mutex_lock(&x->mutex);
+	for (s = x->skip; s != NULL && ! res; s = s->next)
+		res = ! wcsncmp(path, s->path, wcslen(s->path));
+	pthread_mutex_unlock(&x->mutex);
+	return res;
+}
+
+void _fatextractskip(struct fatextract *x, wchar_t *path, wchar_t *name) {
+	struct fatextractskip *s;
+
+	s = malloc(sizeof(struct fatextractskip));
+	if (s == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	s->path = malloc((wcslen(path) + wcslen(name) + 2) * sizeof(wchar_t));
+	if (s->path == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	wcscpy(s->path, path);
+	wcscat(s->path, name);
+	wcscat(s->path, L"/");
+
+	pthread_mutex_lock(&x->mutex);
+	s->next = x->skip;
+	x->skip = s;
+	x->err = -1;
+	pthread_mutex_unlock(&x->mutex);
+}
+
+/*
+ * create a directory or copy a file; called by the threads of fatwalk()
+ */
+void _fatextractentry(fat *f, wchar_t *path, struct fatdirent *e,
+		void *user) {
+	struct fatextract *x;
+	struct fatextractdir *d;
+	struct timespec times[2];
+	char *dir, *name, *host;
+	int64_t copied;
+	int fd, err;
+
+	x = (struct fatextract *) user;
+
+	if ((e->attributes & FAT_ATTR_VOLUME) ||
+	    ! strcmp(e->shortname, ".") || ! strcmp(e->shortname, ".."))
+		return;
+
+			/* names that would be out of dest on the host */
+
+	if (_fatextractskipped(x, path))
+		return;
+	if (_fatextractunsafe(e->name)) {
+		printf("%ls%ls: invalid name, not extracted\n", path, e->name);
+		_fatextractskip(x, path, e->name);
+		return;
+	}
+
+	dir = _fatextractname(path);
+	name = _fatextractname(e->name);
+	host = malloc(strlen(x->dest) + 1 + strlen(dir) + strlen(name) + 1);
+	if (host == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	sprintf(host, "%s/%s%s", x->dest, dir, name);
+	free(dir);
+	free(name);
+	dprintf("extracting %s\n", host);
+
+	_fatextracttimes(e, times);
+	err = 0;
+
+			/* directory: create it, set its times at the end */
+
+	if (e->attributes & FAT_ATTR_DIR) {
+		if (mkdir(host, 0777) == -1 && errno != EEXIST) {
+			perror(host);
+			err = -1;
+			free(host);
+		}
+		else {
+			d = malloc(sizeof(struct fatextractdir));
+			if (d == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
+			}
+			d->path = host;
+			d->times[0] = times[0];
+			d->times[1] = times[1];
+			pthread_mutex_lock(&x->mutex);
+			d->next = x->dirs;
+			x->dirs = d;
+			pthread_mutex_unlock(&x->mutex);
+		}
+	}
+
+			/* file: copy its clusters */
+
+	else {
+		fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd == -1) {
+			perror(host);
+			err = -1;
+		}
+		else {
+			copied = e->size == 0 || e->first < FAT_FIRST ? 0 :
+				fatfilestream(f, f, e->first, e->size, fd);
+			if (copied != e->size) {
+				printf("%s: %s\n", host, copied == -1 ?
+					"error copying" : "chain too short");
+				err = -1;
+			}
+			if (futimens(fd, times) == -1)
+				perror(host);
+			if ((e->attributes & FAT_ATTR_RO) &&
+			    fchmod(fd, 0444) == -1)
+				perror(host);
+			if (close(fd) == -1) {
+				perror(host);
+				err = -1;
+			}
+		}
+		free(host);
+	}
+
+	if (err) {
+		pthread_mutex_lock(&x->mutex);
+		x->err = -1;
+		pthread_mutex_unlock(&x->mutex);
+	}
+}
+
+/*
+ * extract a directory and all its content to a directory of the host
+ */
+int fatextract(fat *f, int32_t dir, char *dest, int threads) {
+	struct fatextract x;
+	struct fatextractdir *d;
+	struct fatextractskip *s;
+	int res;
+
+	if (mkdir(dest, 0777) == -1 && errno != EEXIST) {
+		perror(dest);
+		return -1;
+	}
+
+	fatflush(f);
+
+	x.dest = dest;
+	pthread_mutex_init(&x.mutex, NULL);
+	x.dirs = NULL;
+	x.skip = NULL;
+	x.err = 0;
+
+	res = fatwalk(f, dir, threads, 0, _fatextractentry, &x);
+	if (res)
+		printf("error reading some directory, not all files copied\n");
+
+			/* times of directories, after their content is written */
+
+	while (x.dirs != NULL) {
+		d = x.dirs;
+		x.dirs = d->next;
+		if (utimensat(AT_FDCWD, d->path, d->times, 0) == -1)
+			perror(d->path);
+		free(d->path);
+		free(d);
+	}
+	while (x.skip != NULL) {
+		s = x.skip;
+		x.skip = s->next;
+		free(s->path);
+		free(s);
+	}
+
+	pthread_mutex_destroy(&x.mutex);
+	return res || x.err ? -1 : 0;
+}
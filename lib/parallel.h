@@ -0,0 +1,76 @@
+/*
+ * parallel.h
+ * Copyright (C) 2016 <sgerwk@aol.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * parallel.h
+ *
+ * walk the directory tree with many threads
+ *
+ * each thread opens the filesystem again, so it has its own file descriptor
+ * and caches; nothing of the filesystem is modified, and the fat passed to
+ * the functions is to be flushed before
+ */
+
+#ifdef _PARALLEL_H
+#else
+#define _PARALLEL_H
+
+#include <stdint.h>
+#include <wchar.h>
+#include "fs.h"
+
+struct fatdirent;
+
+/*
+ * call a function on every file in a directory and its subdirectories
+ *
+ * the directories are read by the given number of threads; the function is
+ * called with the decoded directory entry and the path of the directory that
+ * contains it (the same as fatfileexecutelong); it is called:
+ *
+ * - by the threads, concurrently and in no particular order; the fat is the
+ *   one opened by the thread, and is only to be read
+ *
+ * - with FAT_WALK_ORDERED: by the calling thread, in the order of
+ *   fatfileexecutelong(); the fat is the one passed to fatwalk()
+ *
+ * return -1 if some directory could not be read
+ */
+#define FAT_WALK_ORDERED 0x01
+
+typedef void (* walkrun)(fat *f, wchar_t *path, struct fatdirent *entry,
+		void *user);
+int fatwalk(fat *f, int32_t dir, int threads, int flags,
+		walkrun act, void *user);
+
+/*
+ * copy a directory and all its content to the directory dest of the host
+ *
+ * the tree is walked by the given number of threads, each also copying the
+ * data of the files it finds with fatfilestream(); subdirectories are created
+ * as needed; the write time is the modification time of the host files and
+ * directories, the read date their access time; read-only files are made
+ * read-only on the host; the other attributes have no equivalent; files and
+ * directories named dot, dotdot or with a slash in the name are not copied;
+ * errors are printed and the extraction continues with the next file
+ *
+ * return -1 if some file or directory could not be read or written
+ */
+int fatextract(fat *f, int32_t dir, char *dest, int threads);
+
+#endif
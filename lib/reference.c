@@ -304,6 +304,96 @@ int fatclusterswap(fat *f,
 	return 0;
 }
 
+/*
+ * move a run of clusters
+ *
+ * the clusters src...src+num-1 are consecutive in their chain and go to the
+ * free clusters new...new+num-1; src is the target of the reference; they are
+ * read by a single read and written by a single write
+ *
+ * fatclusterrunlength() tells how many clusters from src, up to max, can be
+ * moved this way to dst
+ */
+
+int fatclusterrunlength(fat *f, int32_t src, int32_t dst, int max) {
+	int num;
+
+	if (src < FAT_FIRST || dst < FAT_FIRST)
+		return 0;
+
+	for (num = 0; num < max; num++) {
+		if (src + num > fatlastcluster(f) ||
+		    dst + num > fatlastcluster(f))
+			break;
+		if (fatgetnextcluster(f, dst + num) != FAT_UNUSED)
+			break;
+		if (num > 0 &&
+		    fatgetnextcluster(f, src + num - 1) != src + num)
+			break;
+	}
+	return num;
+}
+
+int fatclustermoverun(fat *f,
+		unit *directory, int index, int32_t previous,
+		int32_t new, int num,
+		int writeback) {
+	int32_t current, next;
+	unit **clusters;
+	int i;
+
+	if (num == 1)
+		return fatclustermove(f, directory, index, previous,
+			new, writeback);
+
+			/* find and check source and target of move */
+
+	current = fatreferencegettarget(f, directory, index, previous);
+	if (current < FAT_FIRST || num < 1)
+		return -1;
+	if (fatclusterrunlength(f, current, new, num) != num)
+		return -1;
+	next = fatgetnextcluster(f, current + num - 1);
+
+			/* move the clusters themselves */
+
+	if (fatclusterreadrun(f, current, num))
+		return -2;
+	clusters = malloc(num * sizeof(unit *));
+	if (clusters == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	for (i = 0; i < num; i++) {
+		clusters[i] = fatclusterread(f, current + i);
+		if (clusters[i] == NULL) {
+			free(clusters);
+			return -2;
+		}
+	}
+	for (i = 0; i < num; i++)
+		fatunitmove(&f->clusters, clusters[i], new + i);
+	if (writeback)
+		if (fatunitwriterun(clusters, num)) {
+			for (i = 0; i < num; i++)
+				fatunitmove(&f->clusters, clusters[i],
+					current + i);
+			free(clusters);
+			return -5;
+		}
+	free(clusters);
+
+			/* change the references */
+
+	fatreferencesettarget(f, directory, index, previous, new);
+	for (i = 0; i < num; i++) {
+		fatsetnextcluster(f, new + i, i < num - 1 ? new + i + 1 : next);
+		fatsetnextcluster(f, current + i, FAT_UNUSED);
+	}
+
+	return 0;
+}
+
 /*
  * change directory
  *
@@ -411,143 +501,356 @@ int fatfollowpath(fat *f, const char *path,
 /*
  * execute a function on every cluster reference starting from some one
  * see reference.h for details about the function, below for examples
+ *
+ * the directory tree is visited without recursion: each directory being
+ * visited has a frame in an explicit stack; a bitmap tells which directory
+ * clusters are in the stack, so that a directory containing itself is
+ * detected instead of looping forever; chains, including the chains of
+ * directories, are followed for at most as many clusters as the filesystem has
  */
 
+int fatreferencemaxdepth = 1024;
+
+struct fatreferenceframe {
+	unit *directory;
+	int index;
+	int32_t previous;
+	unit *startdirectory;
+	int startindex;
+	int32_t startprevious;
+	unit *dirdirectory;
+	int dirindex;
+	int32_t dirprevious;
+
+	int res;
+	int32_t first;
+	unit *dir, *prevdir;
+	int ind;
+	unsigned char *class;
+	int num, mask;
+	int32_t clusters;
+	int err, status;
+};
+
+/*
+ * the function to call: either a refrun on everything or an eventrun on the
+ * events in the mask
+ */
+struct fatreferencewalker {
+	refrun act;
+	eventrun event;
+	int mask;
+	void *user;
+};
+
+/*
+ * call the function on the reference of a frame (scan=0) or on cluster scan
+ * of its chain; events not in the mask return as if the function returned
+ * FAT_REFERENCE_NORMAL
+ */
+int _fatreferencecall(fat *f, struct fatreferencewalker *w,
+		struct fatreferenceframe *s, int32_t scan,
+		int event, int direction, int depth) {
+	struct fatcursor c;
+
+	if (w->act != NULL && scan > 0)
+		return w->act(f,
+			NULL, 0, scan,
+			s->directory, s->index, s->previous,
+			s->startdirectory, s->startindex, s->startprevious,
+			direction, w->user);
+	if (w->act != NULL)
+		return w->act(f,
+			s->directory, s->index, s->previous,
+			s->startdirectory, s->startindex, s->startprevious,
+			s->dirdirectory, s->dirindex, s->dirprevious,
+			direction, w->user);
+
+	if (! (w->mask & event))
+		return FAT_REFERENCE_NORMAL;
+
+	if (scan > 0) {
+		c.ref.directory = NULL;
+		c.ref.index = 0;
+		c.ref.previous = scan;
+		c.file.directory = s->directory;
+		c.file.index = s->index;
+		c.file.previous = s->previous;
+		c.dir.directory = s->startdirectory;
+		c.dir.index = s->startindex;
+		c.dir.previous = s->startprevious;
+	}
+	else {
+		c.ref.directory = s->directory;
+		c.ref.index = s->index;
+		c.ref.previous = s->previous;
+		c.file.directory = s->startdirectory;
+		c.file.index = s->startindex;
+		c.file.previous = s->startprevious;
+		c.dir.directory = s->dirdirectory;
+		c.dir.index = s->dirindex;
+		c.dir.previous = s->dirprevious;
+	}
+	c.event = event;
+	c.depth = depth;
+	return w->event(f, &c, w->user);
+}
+
 int _fatreferenceexecute(fat *f,
 		unit *directory, int index, int32_t previous,
 		unit *startdirectory, int startindex, int32_t startprevious,
 		unit *dirdirectory, int dirindex, int32_t dirprevious,
-		refrun act, void *user) {
-	int res;
-	int32_t scan, next;
-	unit *dir, *prevdir;
-	int ind;
-	int err, status = 0;
+		struct fatreferencewalker *w) {
+	struct fatreferenceframe *stack, *s, *p;
+	int size, depth;
+	unsigned char *visiting;
+	int32_t last, scan, next, count;
+	int res, status;
+
+	size = 16;
+	stack = malloc(size * sizeof(struct fatreferenceframe));
+	if (stack == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	visiting = NULL;
+	last = fatlastcluster(f);
+
+	depth = 0;
+	s = stack;
+	s->directory = directory;
+	s->index = index;
+	s->previous = previous;
+	s->startdirectory = startdirectory;
+	s->startindex = startindex;
+	s->startprevious = startprevious;
+	s->dirdirectory = dirdirectory;
+	s->dirindex = dirindex;
+	s->dirprevious = dirprevious;
+
+enter:
+	s->status = 0;
+	s->first = FAT_UNUSED;
+	s->class = NULL;
 
 			/* if reference is a directory cluster, mark as used */
 
-	if (directory != NULL)
-		directory->refer++;
+	if (s->directory != NULL)
+		fatunitrefer(s->directory);
 
 			/* call function on cluster reference */
 
-	next = fatreferencegettarget(f, directory, index, previous);
-	if (previous > 0 && next > fatlastcluster(f)) {
+	next = fatreferencegettarget(f, s->directory, s->index, s->previous);
+	if (s->previous > 0 && next > last) {
 		eprintf("\ncluster %d out of range\n", next);
-		return -1;
+		s->status = -1;
+		goto endexecute;
 	}
-	res = act(f,
-		directory, index, previous,
-		startdirectory, startindex, startprevious,
-		dirdirectory, dirindex, dirprevious,
-		0, user);
+	res = _fatreferencecall(f, w, s, 0, FAT_EVENT_ENTRY, 0, depth);
 	scan = (res & FAT_REFERENCE_ORIG) ? next :
-		fatreferencegettarget(f, directory, index, previous);
+		fatreferencegettarget(f, s->directory, s->index, s->previous);
 
 			/* longname parts and deleted entries end here */
 
-	if (fatreferenceisentry(directory, index, previous) &&
-			(! fatentryexists(directory, index) ||
-			fatentryislongpart(directory, index)))
+	if (fatreferenceisentry(s->directory, s->index, s->previous) &&
+			(! fatentryexists(s->directory, s->index) ||
+			fatentryislongpart(s->directory, s->index)))
 		goto endexecute;
 
-			/* call on the rest of the chain */
+			/* call on the rest of the chain, if anyone listens */
+
+	if (w->act == NULL && ! (w->mask & FAT_EVENT_CHAIN))
+		res &= ~FAT_REFERENCE_CHAIN;
 
-	while ((res & FAT_REFERENCE_CHAIN) && scan >= FAT_ROOT) {
+	for (count = 0; (res & FAT_REFERENCE_CHAIN) && scan >= FAT_ROOT;
+	     count++) {
+		if (count > last) {
+			eprintf("\nloop in the chain of cluster %d\n",
+				fatreferencegettarget(f,
+					s->directory, s->index, s->previous));
+			s->status = -1;
+			goto endexecute;
+		}
 		next = fatgetnextcluster(f, scan);
-		res = act(f,
-			NULL, 0, scan,
-			directory, index, previous,
-			startdirectory, startindex, startprevious,
-			0, user);
+		res = _fatreferencecall(f, w, s, scan,
+			FAT_EVENT_CHAIN, 0, depth);
 		scan = (res & FAT_REFERENCE_ORIG) ? next :
 			fatgetnextcluster(f, scan);
 	}
 
-			/* check whether to call recursively */
+			/* check whether to enter the directory */
 
 	if (! (res & FAT_REFERENCE_RECUR))
 		goto endexecute;
-	if (! fatreferenceisdirectory(directory, index, previous))
+	if (! fatreferenceisdirectory(s->directory, s->index, s->previous))
 		goto endexecute;
-	if (directory != NULL && fatentryisdotfile(directory, index))
+	if (s->directory != NULL && fatentryisdotfile(s->directory, s->index))
 		goto endexecute;
 
 			/* directory: cycle over its entries */
 
-	act(f,
-		directory, index, previous,
-		startdirectory, startindex, startprevious,
-		dirdirectory, dirindex, dirprevious,
-		1, user);
+	_fatreferencecall(f, w, s, 0, FAT_EVENT_ENTER, 1, depth);
 
-	next = fatreferencegettarget(f, directory, index, previous);
+	next = fatreferencegettarget(f, s->directory, s->index, s->previous);
 	if (next < FAT_ROOT)
 		goto leavedir;
 
-	dir = fatclusterread(f, next);
-	if (dir == NULL) {
-		status = -1;
+	if (fatreferencemaxdepth > 0 && depth >= fatreferencemaxdepth) {
+		eprintf("\ndirectories nested deeper than %d\n",
+			fatreferencemaxdepth);
+		s->status = -1;
+		goto leavedir;
+	}
+
+	if (next <= last) {
+		if (visiting == NULL) {
+			visiting = calloc(last / 8 + 1, 1);
+			if (visiting == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
+			}
+		}
+		if (visiting[next / 8] & (1 << (next % 8))) {
+			eprintf("\ndirectory cluster %d contains itself\n",
+				next);
+			s->status = -1;
+			goto leavedir;
+		}
+		visiting[next / 8] |= 1 << (next % 8);
+		s->first = next;
+	}
+
+	s->dir = fatclusterread(f, next);
+	if (s->dir == NULL) {
+		s->status = -1;
 		goto leavedir;
 	}
 
-	prevdir = dir;
-	for (ind = -1; ! (err = fatnextentry(f, &dir, &ind)); prevdir = dir) {
-		if ((res & FAT_REFERENCE_DELETE) &&
-				prevdir != dir && prevdir->refer == 0) {
-			fatunitwriteback(prevdir);
-			fatunitdelete(&f->clusters, prevdir->n);
+	s->res = res;
+	s->mask = (res & FAT_REFERENCE_ALL) ? FAT_CLASS_ALL : FAT_CLASS_EXISTS;
+	s->num = 0;
+	s->prevdir = s->dir;
+	s->ind = -1;
+	s->clusters = 0;
+
+nextentry:
+	s->err = fatnextentry(f, &s->dir, &s->ind);
+	if (s->err)
+		goto endscan;
+	if (s->ind == 0 && ++s->clusters > last) {
+		eprintf("\nloop in the chain of directory cluster %d\n",
+			s->first);
+		s->err = -1;
+		s->status = -1;
+		goto endscan;
+	}
+
+	if ((s->res & FAT_REFERENCE_DELETE) &&
+			s->prevdir != s->dir && fatunitrefers(s->prevdir) == 0) {
+		fatunitwriteback(s->prevdir);
+		fatunitdelete(&f->clusters, s->prevdir->n);
+	}
+
+			/* skip to the next entry to visit */
+
+	if (s->ind == 0 || s->class == NULL) {
+		s->num = s->dir->size / 32;
+		s->class = realloc(s->class, s->num);
+		if (s->class == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
 		}
+		fatentryclassify(s->dir, s->class);
+	}
+	if (! (s->class[s->ind] & s->mask)) {
+		s->ind = fatentryclassnext(s->class, s->num, s->ind,
+			s->mask | FAT_CLASS_END) - 1;
+		s->prevdir = s->dir;
+		goto nextentry;
+	}
+	if (! (s->res & FAT_REFERENCE_ALL) &&
+			(! fatentryexists(s->dir, s->ind) ||
+			fatentryislongpart(s->dir, s->ind))) {
+		s->prevdir = s->dir;
+		goto nextentry;
+	}
 
-		if (! (res & FAT_REFERENCE_ALL) &&
-				(! fatentryexists(dir, ind) ||
-				fatentryislongpart(dir, ind)))
-			continue;
-
-		err = _fatreferenceexecute(f,
-				dir, ind, 0,
-				directory, index, previous,
-				startdirectory, startindex, startprevious,
-				act, user);
-		if (err) {
-			status = -1;
-			break;
+			/* push the entry */
+
+	depth++;
+	if (depth >= size) {
+		size *= 2;
+		stack = realloc(stack, size * sizeof(struct fatreferenceframe));
+		if (stack == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
 		}
 	}
-	if ((res & FAT_REFERENCE_DELETE) && prevdir->refer == 0) {
-		fatunitwriteback(prevdir);
-		fatunitdelete(&f->clusters, prevdir->n);
+	p = &stack[depth - 1];
+	s = &stack[depth];
+	s->directory = p->dir;
+	s->index = p->ind;
+	s->previous = 0;
+	s->startdirectory = p->directory;
+	s->startindex = p->index;
+	s->startprevious = p->previous;
+	s->dirdirectory = p->startdirectory;
+	s->dirindex = p->startindex;
+	s->dirprevious = p->startprevious;
+	goto enter;
+
+			/* back from the entry */
+
+leaveentry:
+	if (s[1].status) {
+		s->err = -1;
+		s->status = -1;
+		goto endscan;
+	}
+	s->prevdir = s->dir;
+	goto nextentry;
+
+endscan:
+	free(s->class);
+	s->class = NULL;
+	if ((s->res & FAT_REFERENCE_DELETE) &&
+			fatunitrefers(s->prevdir) == 0) {
+		fatunitwriteback(s->prevdir);
+		fatunitdelete(&f->clusters, s->prevdir->n);
 	}
-	if (err < -1) {
-		printf("error in fatnextentry: %d\n", err);
-		status = -1;
+	if (s->err < -1) {
+		printf("error in fatnextentry: %d\n", s->err);
+		s->status = -1;
 	}
 
 leavedir:
-	act(f,
-		directory, index, previous,
-		startdirectory, startindex, startprevious,
-		dirdirectory, dirindex, dirprevious,
-		-1, user);
+	if (s->first != FAT_UNUSED)
+		visiting[s->first / 8] &= ~(1 << (s->first % 8));
+
+	_fatreferencecall(f, w, s, 0, FAT_EVENT_LEAVE, -1, depth);
 
 			/* call again with direction = -2 */
 
-	next = fatreferencegettarget(f, directory, index, previous);
-	res = act(f,
-		directory, index, previous,
-		startdirectory, startindex, startprevious,
-		dirdirectory, dirindex, dirprevious,
-		-2, user);
-	scan = (res & FAT_REFERENCE_ORIG) ? next :
-		fatreferencegettarget(f, directory, index, previous);
+	if (w->act == NULL && ! (w->mask & FAT_EVENT_POST))
+		goto endexecute;
 
-	while ((res & FAT_REFERENCE_CHAIN) && scan >= FAT_FIRST) {
+	next = fatreferencegettarget(f, s->directory, s->index, s->previous);
+	res = _fatreferencecall(f, w, s, 0, FAT_EVENT_POST, -2, depth);
+	scan = (res & FAT_REFERENCE_ORIG) ? next :
+		fatreferencegettarget(f, s->directory, s->index, s->previous);
+
+	for (count = 0; (res & FAT_REFERENCE_CHAIN) && scan >= FAT_FIRST;
+	     count++) {
+		if (count > last) {
+			eprintf("\nloop in the chain of cluster %d\n",
+				fatreferencegettarget(f,
+					s->directory, s->index, s->previous));
+			s->status = -1;
+			break;
+		}
 		next = fatreferencegettarget(f, NULL, 0, scan);
-		res = act(f,
-			NULL, 0, scan,
-			directory, index, previous,
-			startdirectory, startindex, startprevious,
-			-2, user);
+		res = _fatreferencecall(f, w, s, scan,
+			FAT_EVENT_POST, -2, depth);
 		scan = (res & FAT_REFERENCE_ORIG) ? next :
 			fatreferencegettarget(f, NULL, 0, scan);
 	}
@@ -555,20 +858,51 @@ leavedir:
 			/* no longer this directory cluster is used here */
 
 endexecute:
-	if (directory != NULL)
-		directory->refer--;
+	if (s->directory != NULL)
+		fatunitunrefer(s->directory);
 
+	if (depth > 0) {
+		depth--;
+		s = &stack[depth];
+		goto leaveentry;
+	}
+
+	status = s->status;
+	free(stack);
+	free(visiting);
 	return status;
 }
 
 int fatreferenceexecute(fat *f,
 		unit *directory, int index, int32_t previous,
 		refrun act, void *user) {
+	struct fatreferencewalker w;
+
+	w.act = act;
+	w.event = NULL;
+	w.mask = FAT_EVENT_ALL;
+	w.user = user;
+	return _fatreferenceexecute(f,
+			directory, index, previous,
+			directory, index, previous,
+			directory, index, previous,
+			&w);
+}
+
+int fatreferencewalk(fat *f,
+		unit *directory, int index, int32_t previous,
+		int mask, eventrun act, void *user) {
+	struct fatreferencewalker w;
+
+	w.act = NULL;
+	w.event = act;
+	w.mask = mask;
+	w.user = user;
 	return _fatreferenceexecute(f,
 			directory, index, previous,
 			directory, index, previous,
 			directory, index, previous,
-			act, user);
+			&w);
 }
 
 /*
@@ -703,23 +1037,16 @@ struct fatcountclustersstruct {
 };
 
 int _fatcountclusters(fat __attribute__((unused)) *f,
-		unit *directory, int index, int32_t previous,
-		unit __attribute__((unused)) *startdirectory,
-		int __attribute__((unused)) startindex,
-		int32_t __attribute__((unused)) startprevious,
-		unit __attribute__((unused)) *dirdirectory,
-		int __attribute__((unused)) dirindex,
-		int32_t __attribute__((unused)) dirprevious,
-		int direction, void *user) {
+		struct fatcursor *c, void *user) {
 	struct fatcountclustersstruct *s;
-	if (direction != 0)
-		return 0;
-	if (fatreferenceisdotfile(directory, index, previous))
+	if (fatreferenceisdotfile(c->ref.directory, c->ref.index,
+			c->ref.previous))
 		return FAT_REFERENCE_DELETE;
 
 	s = (struct fatcountclustersstruct *) user;
 
-	if (fatreferenceiscluster(directory, index, previous))
+	if (fatreferenceiscluster(c->ref.directory, c->ref.index,
+			c->ref.previous))
 		s->n++;
 
 	return FAT_REFERENCE_COND(s->recur);
@@ -730,12 +1057,65 @@ int32_t fatcountclusters(fat *f,
 	struct fatcountclustersstruct s;
 	s.n = 0;
 	s.recur = recur;
-	if (fatreferenceexecute(f, directory, index, previous,
+	if (fatreferencewalk(f, directory, index, previous,
+			FAT_EVENT_ENTRY | FAT_EVENT_CHAIN,
 			_fatcountclusters, &s))
 		return FAT_ERR;
 	return s.n;
 }
 
+/*
+ * same, with the length of the chains taken from a fatchains
+ */
+
+struct fatcountchainsstruct {
+	fatchains *c;
+	int32_t n;
+	int recur;
+	int loop;
+};
+
+int _fatcountchains(fat *f, struct fatcursor *c, void *user) {
+	struct fatcountchainsstruct *s;
+	int32_t target, len;
+
+	if (fatreferenceisdotfile(c->ref.directory, c->ref.index,
+			c->ref.previous))
+		return FAT_REFERENCE_DELETE;
+
+	s = (struct fatcountchainsstruct *) user;
+
+	if (fatreferenceiscluster(c->ref.directory, c->ref.index,
+			c->ref.previous))
+		s->n++;
+
+	target = fatreferencegettarget(f, c->ref.directory, c->ref.index,
+		c->ref.previous);
+	if (target >= FAT_ROOT) {
+		len = target == FAT_ROOT ? 1 : fatchainslength(s->c, target);
+		if (fatchainsloop(s->c, target)) {
+			s->loop = 1;
+			return FAT_REFERENCE_ABORT;
+		}
+		s->n += len == FAT_ERR ? 1 : len;
+	}
+
+	return FAT_REFERENCE_COND(s->recur);
+}
+
+int32_t fatcountclusterschains(fat *f, fatchains *c,
+		unit *directory, int index, int32_t previous, int recur) {
+	struct fatcountchainsstruct s;
+	s.c = c;
+	s.n = 0;
+	s.recur = recur;
+	s.loop = 0;
+	if (fatreferencewalk(f, directory, index, previous,
+			FAT_EVENT_ENTRY, _fatcountchains, &s) || s.loop)
+		return FAT_ERR;
+	return s.n;
+}
+
 /*
  * fix the dot and dotdot files
  */
@@ -875,36 +1255,27 @@ struct fileexecutestruct {
 	filerun act;
 };
 
-int _fatfileexecute(fat *f,
-		unit *directory,
-		int index,
-		int32_t __attribute__((unused)) previous,
-		unit __attribute__((unused)) *startdirectory,
-		int __attribute__((unused)) startindex,
-		int32_t __attribute__((unused)) startprevious,
-		unit __attribute__((unused)) *dirdirectory,
-		int __attribute__((unused)) dirindex,
-		int32_t __attribute__((unused)) dirprevious,
-		int direction, void *user) {
+int _fatfileexecute(fat *f, struct fatcursor *c, void *user) {
 	struct fileexecutestruct *s;
 	char shortname[13];
 	char *pos;
 
-	if (directory == NULL && previous == -1)
+	if (c->ref.directory == NULL && c->ref.previous == -1)
 		return FAT_REFERENCE_RECUR | FAT_REFERENCE_DELETE;
 
-	if (directory == NULL)
+	if (c->ref.directory == NULL)
 		return 0;
 
 	s = (struct fileexecutestruct *) user;
 
-	if (direction == 1) {
-		fatentrygetshortname(directory, index, shortname);
+	if (c->event == FAT_EVENT_ENTER) {
+		fatentrygetshortname(c->ref.directory, c->ref.index,
+			shortname);
 		strncat(s->path, shortname, MAX_PATH);
 		strncat(s->path, "/", MAX_PATH);
 		return 0;
 	}
-	if (direction == -1) {
+	if (c->event == FAT_EVENT_LEAVE) {
 		s->path[strlen(s->path) - 1] = '\0';
 		pos = rindex(s->path, '/');
 		if (pos == NULL)
@@ -913,10 +1284,8 @@ int _fatfileexecute(fat *f,
 			*(pos + 1) = '\0';
 		return 0;
 	}
-	if (direction == -2)
-		return 0;
 
-	s->act(f, s->path, directory, index, s->user);
+	s->act(f, s->path, c->ref.directory, c->ref.index, s->user);
 
 	return FAT_REFERENCE_RECUR | FAT_REFERENCE_DELETE;
 }
@@ -930,7 +1299,8 @@ int fatfileexecute(fat *f,
 	s.path[0] = '\0';
 	s.act = act;
 
-	return fatreferenceexecute(f, directory, index, previous,
+	return fatreferencewalk(f, directory, index, previous,
+		FAT_EVENT_ENTRY | FAT_EVENT_ENTER | FAT_EVENT_LEAVE,
 		_fatfileexecute, &s);
 }
 
@@ -21,6 +21,7 @@
 #define _REFERENCE_H
 
 #include "fs.h"
+#include "table.h"
 
 /*
  * next of a cluster reference (a pointer to a cluster): get and set
@@ -70,6 +71,16 @@ int fatclusterswap(fat *f,
 		unit *dsecond, int isecond, int32_t psecond,
 		int writeback);
 
+/*
+ * move a run of consecutive clusters of a chain to consecutive free clusters
+ * by a single read and a single write
+ */
+int fatclusterrunlength(fat *f, int32_t src, int32_t dst, int max);
+int fatclustermoverun(fat *f,
+		unit *directory, int index, int32_t previous,
+		int32_t new, int num,
+		int writeback);
+
 /*
  * follow the first part of a path or all of it as much as possible
  */
@@ -105,6 +116,11 @@ int fatfollowpath(fat *f, const char *path,
  *	   the next of the cluster (FAT_REFERENCE_ORIG)
  *	d. whether to call on all directory entries, including long name parts
  *	   and deleted entries (FAT_REFERENCE_ALL)
+ *
+ * directories nested more than fatreferencemaxdepth levels (0 = no limit) and
+ * directories containing themselves are not entered, and chains longer than
+ * the number of clusters are not followed further; all make the function
+ * return -1
  */
 #define FAT_REFERENCE_CHAIN  0x01
 #define FAT_REFERENCE_RECUR  0x02
@@ -119,6 +135,8 @@ int fatfollowpath(fat *f, const char *path,
 	((r) ? FAT_REFERENCE_RECUR : 0)
 #define FAT_REFERENCE_ABORT 0
 
+extern int fatreferencemaxdepth;
+
 typedef int(* refrun)(fat *f,
 	unit *directory, int index, int32_t previous,
 	unit *startdirectory, int startindex, int32_t startprevious,
@@ -128,6 +146,48 @@ int fatreferenceexecute(fat *f,
 		unit *directory, int index, int32_t previous,
 		refrun act, void *user);
 
+/*
+ * same visit, calling a function only on the events in a mask:
+ * - FAT_EVENT_ENTRY	the first reference of a chain: a directory entry or
+ *			the starting reference (direction=0 above)
+ * - FAT_EVENT_CHAIN	the other references of the chain (direction=0)
+ * - FAT_EVENT_ENTER	before entering a directory (direction=1)
+ * - FAT_EVENT_LEAVE	when leaving it (direction=-1)
+ * - FAT_EVENT_POST	the chain of the directory again (direction=-2)
+ *
+ * the function receives a cursor with the three references, the event and the
+ * depth in the tree, and returns the same flags as a refrun; events not in
+ * the mask are not dispatched: the visit goes on as if FAT_REFERENCE_NORMAL
+ * were returned, but the chain is not followed if FAT_EVENT_CHAIN is not in the
+ * mask, and it is not followed again when leaving a directory if
+ * FAT_EVENT_POST is not
+ */
+#define FAT_EVENT_ENTRY 0x01
+#define FAT_EVENT_CHAIN 0x02
+#define FAT_EVENT_ENTER 0x04
+#define FAT_EVENT_LEAVE 0x08
+#define FAT_EVENT_POST  0x10
+#define FAT_EVENT_ALL   0x1F
+
+struct fatreference {
+	unit *directory;
+	int index;
+	int32_t previous;
+};
+
+struct fatcursor {
+	struct fatreference ref;	/* the cluster reference */
+	struct fatreference file;	/* entry of the file of the chain */
+	struct fatreference dir;	/* entry of the directory of the file */
+	int event;
+	int depth;
+};
+
+typedef int (* eventrun)(fat *f, struct fatcursor *c, void *user);
+int fatreferencewalk(fat *f,
+		unit *directory, int index, int32_t previous,
+		int mask, eventrun act, void *user);
+
 /*
  * execute a function on every file
  */
@@ -149,6 +209,8 @@ void fatcalls(fat *f, int all);
  */
 int32_t fatcountclusters(fat *f,
 	unit *directory, int index, int32_t previous, int recur);
+int32_t fatcountclusterschains(fat *f, fatchains *c,
+	unit *directory, int index, int32_t previous, int recur);
 
 /*
  * fix the dot and dotdot files
@@ -391,11 +391,43 @@ int32_t fatgetnextcluster(fat *f, int32_t n) {
 
 /*
  * set the next of a cluster in a fat (FAT_ALL = all fats)
+ *
+ * the fat to change is passed to the internal function rather than stored in
+ * f->nfat, so that other threads reading the table are not affected
  */
 
-int fatsetnextcluster(fat *f, int32_t n, int32_t next) {
+int _fatsetnextcluster(fat *f, int nfat, int32_t n, int32_t next) {
 	int res;
 
+	f->changes++;
+
+	if (nfat == FAT_ALL) {
+		res = 0;
+		for (nfat = 0; nfat < fatgetnumfats(f); nfat++)
+			if (_fatsetnextcluster(f, nfat, n, next))
+				res--;
+		return res;
+	}
+
+	if (next == FAT_EOF)
+		next = 0x0FFFFFF8;
+	else if (next == FAT_BAD)
+		next = 0x0FFFFFF7;
+
+	switch (fatbits(f)) {
+	case 12:
+		return fatsetfat(f, nfat, n, next & 0x0FFF);
+	case 16:
+		return fatsetfat(f, nfat, n, next & 0xFFFF);
+	case 32:
+		return fatsetfat(f, nfat, n, next & 0x0FFFFFFF);
+	}
+
+	return -1;
+}
+
+int fatsetnextcluster(fat *f, int32_t n, int32_t next) {
+
 	if (n > fatlastcluster(f)) {
 		printf("\nerror: cluster %d does not exists\n", n);
 		printf("last cluster in the filesystem is ");
@@ -415,37 +447,13 @@ int fatsetnextcluster(fat *f, int32_t n, int32_t next) {
 			f->free--;
 	}
 
-	if (f->nfat == FAT_ALL) {
-		res = 0;
-		for (f->nfat = 0; f->nfat < fatgetnumfats(f); f->nfat++)
-			if (fatsetnextcluster(f, n, next))
-				res--;
-		f->nfat = FAT_ALL;
-		return res;
-	}
-
-	if (next == FAT_EOF)
-		next = 0x0FFFFFF8;
-	else if (next == FAT_BAD)
-		next = 0x0FFFFFF7;
-
-	switch (fatbits(f)) {
-	case 12:
-		return fatsetfat(f, f->nfat, n, next & 0x0FFF);
-	case 16:
-		return fatsetfat(f, f->nfat, n, next & 0xFFFF);
-	case 32:
-		return fatsetfat(f, f->nfat, n, next & 0x0FFFFFFF);
-	}
-
-	return -1;
+	return _fatsetnextcluster(f, f->nfat, n, next);
 }
 
 /*
  * initialize a file allocation table
  */
 int fatinittable(fat *f, int nfat) {
-	int prevfat;
 	int32_t cl, r, pilot;
 	int32_t sector, start;
 	unit *table;
@@ -455,16 +463,13 @@ int fatinittable(fat *f, int nfat) {
 
 	fatfixtableheader(f, nfat);
 
-	prevfat = f->nfat;
-	f->nfat = nfat;
-
 	pilot = 2 * fatgetbytespersector(f);
 	if (fatlastcluster(f) <= pilot)
 		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
-			fatsetnextcluster(f, cl, FAT_UNUSED);
+			_fatsetnextcluster(f, nfat, cl, FAT_UNUSED);
 	else {
 		for (cl = FAT_FIRST; cl < pilot; cl++)
-			fatsetnextcluster(f, cl, FAT_UNUSED);
+			_fatsetnextcluster(f, nfat, cl, FAT_UNUSED);
 
 		start = fatgetreservedsectors(f) + fatgetfatsize(f) * nfat;
 		table = fatunitget(&f->sectors, f->offset,
@@ -482,9 +487,7 @@ int fatinittable(fat *f, int nfat) {
 
 	r = fatgetrootbegin(f);
 	if (r >= FAT_FIRST)
-		fatsetnextcluster(f, r, FAT_EOF);
-
-	f->nfat = prevfat;
+		_fatsetnextcluster(f, nfat, r, FAT_EOF);
 
 	f->last = FAT_FIRST;
 	f->free = fatnumdataclusters(f) - 1;
@@ -560,8 +563,27 @@ int32_t fatclusternumfreebetween(fat *f, int32_t begin, int32_t end) {
 	return num;
 }
 
+#define FATPROGRESSFREE 65536	/* clusters counted between progress calls */
+
 int32_t fatclusternumfree(fat *f) {
-	f->free = fatclusternumfreebetween(f, FAT_FIRST, fatlastcluster(f));
+	int32_t begin, end;
+
+	if (! fatprogressactive(f)) {
+		f->free = fatclusternumfreebetween(f,
+			FAT_FIRST, fatlastcluster(f));
+		return f->free;
+	}
+
+	fatprogressbegin(f, "count free clusters",
+		fatlastcluster(f) - FAT_FIRST + 1);
+	f->free = 0;
+	for (begin = FAT_FIRST; begin <= fatlastcluster(f); begin = end + 1) {
+		end = fatlastcluster(f) - begin < FATPROGRESSFREE ?
+			fatlastcluster(f) : begin + FATPROGRESSFREE - 1;
+		f->free += fatclusternumfreebetween(f, begin, end);
+		fatprogressstep(f, end - begin + 1, 0);
+	}
+	fatprogressend(f);
 	return f->free;
 }
 
@@ -632,6 +654,42 @@ int32_t fatclusterfindfree(fat *f) {
 		FAT_FIRST, fatlastcluster(f), -1);
 }
 
+/*
+ * the smallest sequence of free clusters at least length long (best fit)
+ */
+int32_t fatclusterfindfreeextent(fat *f, int length) {
+	int32_t cl, first, best;
+	int count, bestcount;
+
+	if (length <= 0)
+		return FAT_ERR;
+
+	best = FAT_ERR;
+	bestcount = 0;
+	count = 0;
+	first = FAT_FIRST;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f) + 1; cl++) {
+		if (cl <= fatlastcluster(f) &&
+		    fatgetnextcluster(f, cl) == FAT_UNUSED) {
+			if (count == 0)
+				first = cl;
+			count++;
+			continue;
+		}
+		if (count >= length && (best == FAT_ERR || count < bestcount)) {
+			best = first;
+			bestcount = count;
+			if (count == length)
+				break;
+		}
+		count = 0;
+	}
+
+	dprintf("free extent of %d clusters: %d (%d)\n",
+		length, best, bestcount);
+	return best;
+}
+
 /*
  * presence and count of bad clusters in an area
  */
@@ -815,6 +873,114 @@ int fatclusterfreechain(fat *f, int32_t begin) {
 	return 0;
 }
 
+/*
+ * length and last cluster of all chains, in a single scan of the fat: the
+ * chain from a cluster is followed only up to a cluster already done, then
+ * the result is propagated back along the path; a path that reaches itself
+ * is a loop
+ */
+
+#define FAT_CHAINS_PENDING (-1)
+
+fatchains *fatchainscreate(fat *f) {
+	fatchains *c;
+	int32_t *path, n, cl, len, end;
+	int num;
+
+	c = malloc(sizeof(fatchains));
+	path = malloc((fatlastcluster(f) + 1) * sizeof(int32_t));
+	if (c == NULL || path == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	c->last = fatlastcluster(f);
+	c->length = calloc(c->last + 1, sizeof(int32_t));
+	c->end = malloc((c->last + 1) * sizeof(int32_t));
+	c->in = calloc(c->last + 1, 1);
+	if (c->length == NULL || c->end == NULL || c->in == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+			/* end[] is the next of each cluster, to begin with */
+
+	for (n = FAT_FIRST; n <= c->last; n++) {
+		c->end[n] = fatgetnextcluster(f, n);
+		if (c->end[n] >= FAT_FIRST && c->end[n] <= c->last &&
+		    c->in[c->end[n]] < 255)
+			c->in[c->end[n]]++;
+	}
+
+	for (n = FAT_FIRST; n <= c->last; n++) {
+		num = 0;
+		for (cl = n;
+		     cl >= FAT_FIRST && cl <= c->last && c->length[cl] == 0;
+		     cl = c->end[cl]) {
+			c->length[cl] = FAT_CHAINS_PENDING;
+			path[num++] = cl;
+		}
+
+		if (cl < FAT_FIRST || cl > c->last) {
+			len = 0;
+			end = num > 0 ? path[num - 1] : FAT_ERR;
+		}
+		else if (c->length[cl] == FAT_CHAINS_PENDING ||
+		         c->length[cl] == FAT_ERR) {
+			dprintf("loop in chain from %d\n", n);
+			len = FAT_ERR;
+			end = FAT_ERR;
+		}
+		else {
+			len = c->length[cl];
+			end = c->end[cl];
+		}
+
+		while (num > 0) {
+			num--;
+			if (len != FAT_ERR)
+				len++;
+			c->length[path[num]] = len;
+			c->end[path[num]] = end;
+		}
+	}
+
+	free(path);
+	return c;
+}
+
+void fatchainsdelete(fatchains *c) {
+	if (c == NULL)
+		return;
+	free(c->length);
+	free(c->end);
+	free(c->in);
+	free(c);
+}
+
+int32_t fatchainslength(fatchains *c, int32_t cl) {
+	if (cl < FAT_FIRST || cl > c->last)
+		return FAT_ERR;
+	return c->length[cl];
+}
+
+int32_t fatchainsend(fatchains *c, int32_t cl) {
+	if (cl < FAT_FIRST || cl > c->last)
+		return FAT_ERR;
+	return c->end[cl];
+}
+
+int fatchainscrosslinked(fatchains *c, int32_t cl) {
+	if (cl < FAT_FIRST || cl > c->last)
+		return 0;
+	return c->in[cl] > 1;
+}
+
+int fatchainsloop(fatchains *c, int32_t cl) {
+	if (cl < FAT_FIRST || cl > c->last)
+		return 0;
+	return c->length[cl] == FAT_ERR;
+}
+
 /*
  * origin and size of a cluster
  */
@@ -884,6 +1050,36 @@ unit *fatclusterread(fat *f, int32_t cl) {
 	return fatunitget(&f->clusters, f->offset + origin, size, cl, f->fd);
 }
 
+/*
+ * read the clusters cl...cl+num-1 that are not in cache by a single read
+ */
+int fatclusterreadrun(fat *f, int32_t cl, int num) {
+	uint64_t origin;
+	int size;
+
+	if (cl < FAT_FIRST || num <= 0 || cl + num - 1 > fatlastcluster(f))
+		return -1;
+
+	fatclusterposition(f, cl, &origin, &size);
+	return fatunitgetrun(&f->clusters, f->offset + origin, size,
+		cl, num, f->fd) ? -1 : 0;
+}
+
+/*
+ * tell the operating system that a cluster is going to be read soon
+ */
+int fatclusterprefetch(fat *f, int32_t cl) {
+	uint64_t origin;
+	int size;
+
+	if (cl < FAT_ROOT || cl > fatlastcluster(f))
+		return -1;
+
+	fatclusterposition(f, cl, &origin, &size);
+	return posix_fadvise(f->fd, f->offset + origin, size,
+		POSIX_FADV_WILLNEED) ? -1 : 0;
+}
+
 /*
  * the cluster that contains a sector
  */
@@ -910,3 +1106,47 @@ int32_t fatsectorposition(fat *f, uint32_t sector) {
 	return s / fatgetsectorspercluster(f) + 2;
 }
 
+
+/*
+ * hashes of the boot parameters and of the fat
+ */
+uint64_t fathash(uint64_t h, uint32_t v) {
+	int i;
+
+	for (i = 0; i < 4; i++, v >>= 8) {
+		h ^= v & 0xFF;
+		h *= 0x100000001B3LLU;
+	}
+	return h;
+}
+
+uint64_t fatgeometry(fat *f) {
+	uint64_t h;
+
+	h = 0xCBF29CE484222325LLU;
+	h = fathash(h, fatbits(f));
+	h = fathash(h, fatgetbytespersector(f));
+	h = fathash(h, fatgetsectorspercluster(f));
+	h = fathash(h, fatgetreservedsectors(f));
+	h = fathash(h, fatgetnumfats(f));
+	h = fathash(h, fatgetnumsectors(f));
+	h = fathash(h, fatgetfatsize(f));
+	h = fathash(h, fatgetrootbegin(f));
+	h = fathash(h, fatgetrootentries(f));
+	h = fathash(h, fatgetserialnumber(f));
+	return h;
+}
+
+uint64_t fathashentry(int32_t cl, int32_t next) {
+	return fathash(fathash(0xCBF29CE484222325LLU, cl), next);
+}
+
+uint64_t fathashtable(fat *f) {
+	uint64_t h;
+	int32_t cl;
+
+	h = 0;
+	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+		h ^= fathashentry(cl, fatgetnextcluster(f, cl));
+	return h;
+}
@@ -118,6 +118,11 @@ int32_t fatclusterfindfreebetween(fat *f,
 		int32_t begin, int32_t end, int32_t start);
 int32_t fatclusterfindfree(fat *f);
 
+/*
+ * find the smallest sequence of free clusters that is at least length long
+ */
+int32_t fatclusterfindfreeextent(fat *f, int length);
+
 /*
  * presence and count of bad clusters in an area
  */
@@ -151,17 +156,55 @@ int fatclusterfindallocated(fat *f, int32_t begin, int32_t end);
  */
 int fatclusterfreechain(fat *f, int32_t begin);
 
+/*
+ * bitmaps of clusters, fatlastcluster(f) / 8 + 1 bytes long
+ */
+#define FATBIT(bitmap, cl) ((bitmap)[(cl) / 8] & (1 << ((cl) % 8)))
+#define FATSETBIT(bitmap, cl) ((bitmap)[(cl) / 8] |= 1 << ((cl) % 8))
+#define FATCLEARBIT(bitmap, cl) ((bitmap)[(cl) / 8] &= ~(1 << ((cl) % 8)))
+
+/*
+ * length and last cluster of the chain from every cluster, computed from the
+ * fat only; also tell the clusters that are the next of more than one
+ * (cross-links) and the ones that lead to a loop (FAT_ERR as length and end)
+ */
+typedef struct {
+	int32_t last;		/* last cluster of the filesystem */
+	int32_t *length;	/* clusters from n to the end of the chain */
+	int32_t *end;		/* last cluster of the chain from n */
+	unsigned char *in;	/* clusters having n as next, up to 255 */
+} fatchains;
+
+fatchains *fatchainscreate(fat *f);
+void fatchainsdelete(fatchains *c);
+int32_t fatchainslength(fatchains *c, int32_t cl);
+int32_t fatchainsend(fatchains *c, int32_t cl);
+int fatchainscrosslinked(fatchains *c, int32_t cl);
+int fatchainsloop(fatchains *c, int32_t cl);
+
 /*
  * create and read a cluster; writeback is done by fatunitwriteback(unit *)
  */
 int fatclusterposition(fat *f, int32_t cl, uint64_t *origin, int *size);
 unit *fatclustercreate(fat *f, int32_t cl);
 unit *fatclusterread(fat *f, int32_t cl);
+int fatclusterprefetch(fat *f, int32_t cl);
+int fatclusterreadrun(fat *f, int32_t cl, int num);
 
 /*
  * the cluster that contains a sector
  */
 int32_t fatsectorposition(fat *f, uint32_t sector);
 
+/*
+ * hashes of the boot parameters and of the fat, to tell whether a file saved
+ * by a previous run still matches the filesystem; the hash of the fat is the
+ * xor of the hashes of its entries, so that it can be updated entry by entry
+ */
+uint64_t fathash(uint64_t h, uint32_t v);
+uint64_t fatgeometry(fat *f);
+uint64_t fathashentry(int32_t cl, int32_t next);
+uint64_t fathashtable(fat *f);
+
 #endif
 
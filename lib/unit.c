@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <search.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "unit.h"
 
 int fatunitdebug = 0;
@@ -39,6 +40,14 @@ int fatunitdebug = 0;
 
 #define NO_ORIGIN ((uint64_t) -1)
 
+/*
+ * locks: the trees of all caches are protected by a single readers/writer
+ * lock; the data of a unit that was deallocated is read again with the other
+ * lock held, and is then made visible to the other threads
+ */
+pthread_rwlock_t _fatunitcachelock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t _fatunitdatalock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * create, copy and deallocate a unit
  */
@@ -90,6 +99,44 @@ unit *fatunitcopy(unit *u) {
 	return c;
 }
 
+/*
+ * usage counter, changed atomically
+ */
+
+int fatunitrefer(unit *u) {
+	return __atomic_add_fetch(&u->refer, 1, __ATOMIC_ACQ_REL);
+}
+
+int fatunitunrefer(unit *u) {
+	return __atomic_sub_fetch(&u->refer, 1, __ATOMIC_ACQ_REL);
+}
+
+int fatunitrefers(unit *u) {
+	return __atomic_load_n(&u->refer, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * threads holding a filesystem lock for reading: they may be using any unit
+ * without having it referred, so no unit is destroyed or deallocated while
+ * any of them is present; this is checked with the caches locked, while
+ * readers are counted before they search the caches
+ */
+
+int _fatunitreaders = 0;
+
+void fatunitreaderbegin(void) {
+	__atomic_add_fetch(&_fatunitreaders, 1, __ATOMIC_SEQ_CST);
+}
+
+void fatunitreaderend(void) {
+	__atomic_sub_fetch(&_fatunitreaders, 1, __ATOMIC_SEQ_CST);
+}
+
+int _fatunitevictable(unit *u) {
+	return __atomic_load_n(&_fatunitreaders, __ATOMIC_SEQ_CST) == 0 &&
+		fatunitrefers(u) == 0 && ! u->dirty;
+}
+
 void fatunitdestroy(unit *u) {
 	dprintf("deleting unit %d\n", u->n);
 	if (u == NULL)
@@ -227,23 +274,22 @@ int fatsimulateread(char *filename, int fd) {
 
 /*
  * read and write a unit from the filesystem
+ *
+ * pread() and pwrite() do not change the offset of the file descriptor, so
+ * different threads can read units at the same time
  */
 
-int _fatunitseek(unit *u) {
-	off_t res, pos;
-
-	pos = u->origin + ((uint64_t) u->n) * u->size;
-	dprintf("lseek %" PRIu64 "\n", pos);
+int _fatunitseek(unit *u, off_t *pos) {
+	*pos = u->origin + ((uint64_t) u->n) * u->size;
+	dprintf("position %" PRIu64 "\n", *pos);
 
-	res = lseek(u->fd, pos, SEEK_SET);
 	SIMULATE_ERROR(FAT_SEEK, u);
-	if (res == (off_t) -1) {
+	if (u->origin == NO_ORIGIN || *pos < 0) {
 		if (u->origin == NO_ORIGIN)
 			printf("unspecified origin of unit %d\n", u->n);
 		else {
-			printf("error in lseek to unit %d, ", u->n);
-			printf("position %" PRId64 ", ", pos);
-			printf("description: %s\n", strerror(errno));
+			printf("error in seeking to unit %d, ", u->n);
+			printf("position %" PRId64 "\n", *pos);
 		}
 		u->error |= FAT_SEEK;
 		return -1;
@@ -252,14 +298,14 @@ int _fatunitseek(unit *u) {
 	return 0;
 }
 
-int _fatunitread(unit *u) {
-	off_t res;
+int _fatunitread(unit *u, unsigned char *data) {
+	off_t res, pos;
 	dprintf("reading unit %d, origin %" PRId64 "\n", u->n, u->origin);
 
-	if (_fatunitseek(u))
+	if (_fatunitseek(u, &pos))
 		return -1;
 
-	res = read(u->fd, u->data, u->size);
+	res = pread(u->fd, data, u->size, pos);
 	SIMULATE_ERROR(FAT_READ, u);
 	if (res != u->size) {
 		if (res == -1)
@@ -274,13 +320,13 @@ int _fatunitread(unit *u) {
 }
 
 int _fatunitwrite(unit *u) {
-	off_t res;
+	off_t res, pos;
 	dprintf("writing unit %d, origin %" PRId64 "\n", u->n, u->origin);
 
-	if (_fatunitseek(u))
+	if (_fatunitseek(u, &pos))
 		return -1;
 
-	res = write(u->fd, u->data, u->size);
+	res = pwrite(u->fd, u->data, u->size, pos);
 	SIMULATE_ERROR(FAT_WRITE, u);
 	if (res != u->size) {
 		if (res == -1)
@@ -311,54 +357,165 @@ int _compareunit(const void *a, const void *b) {
  * get, insert, move, swap, writeback and delete a unit from the cache
  */
 
-unit *fatunitget(unit **cache, uint64_t origin, int size, long n, int fd) {
-	unit k, **s, *i, *r;
+/*
+ * read again the data of a deallocated unit
+ */
+int _fatunitload(unit *u) {
+	unsigned char *data;
+	int res;
 
-	k.n = n;
-	s = (unit **) tfind(&k, (void **) cache, _compareunit);
-	if (s != NULL && (*s)->data != NULL)
-		return *s;
+	if (__atomic_load_n(&u->data, __ATOMIC_ACQUIRE) != NULL)
+		return 0;
 
-	if (s == NULL)
-		i = fatunitcreate(size);
-	else {
-		i = *s;
-		i->size = size;
-		i->data = malloc(size);
-		if (i->data == NULL) {
+	res = 0;
+	pthread_mutex_lock(&_fatunitdatalock);
+	if (u->data == NULL) {
+		data = malloc(u->size);
+		if (data == NULL) {
 			printf("cannot allocate memory\n");
 			exit(1);
 		}
+		if (_fatunitread(u, data)) {
+			free(data);
+			res = -1;
+		}
+		else
+			__atomic_store_n(&u->data, data, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&_fatunitdatalock);
+	return res;
+}
+
+unit *fatunitget(unit **cache, uint64_t origin, int size, long n, int fd) {
+	unit k, **s, *i, *r;
+
+	k.n = n;
+	pthread_rwlock_rdlock(&_fatunitcachelock);
+	s = (unit **) tfind(&k, (void **) cache, _compareunit);
+	r = s == NULL ? NULL : *s;
+	pthread_rwlock_unlock(&_fatunitcachelock);
+	if (r != NULL)
+		return _fatunitload(r) ? NULL : r;
+
+	i = fatunitcreate(size);
 	i->origin = origin;
 	i->n = n;
 	i->fd = fd;
 
-	if (_fatunitread(i))
+	if (_fatunitread(i, i->data)) {
+		fatunitdestroy(i);
 		return NULL;
-	r = * (unit **) tsearch(i, (void **) cache, _compareunit);
+	}
+
+			/* another thread may have stored the same unit */
+
+	pthread_rwlock_wrlock(&_fatunitcachelock);
+	s = (unit **) tsearch(i, (void **) cache, _compareunit);
+	r = s == NULL ? NULL : *s;
+	pthread_rwlock_unlock(&_fatunitcachelock);
 	if (r == NULL) {
 		printf("insufficient memory to store cluster %d ", i->n);
 		printf("in cache\n");
 	}
+	if (r != i)
+		fatunitdestroy(i);
 	return r;
 }
 
+/*
+ * get a run of consecutive units, reading the ones not in cache by a single
+ * read; return the number of units that could not be read
+ */
+int fatunitgetrun(unit **cache, uint64_t origin, int size,
+		long n, int num, int fd) {
+	unit k, **s, *i, r;
+	long first, last, j;
+	unsigned char *buf;
+	int err;
+
+			/* the part of the run not already in cache */
+
+	first = -1;
+	last = -1;
+	pthread_rwlock_rdlock(&_fatunitcachelock);
+	for (j = n; j < n + num; j++) {
+		k.n = j;
+		s = (unit **) tfind(&k, (void **) cache, _compareunit);
+		if (s != NULL)
+			continue;
+		if (first == -1)
+			first = j;
+		last = j;
+	}
+	pthread_rwlock_unlock(&_fatunitcachelock);
+	if (first == -1)
+		return 0;
+
+			/* simulated errors and failed reads: one at time */
+
+	buf = NULL;
+	if (fat_simulate_errors == NULL && last > first) {
+		buf = malloc((last - first + 1) * size);
+		if (buf == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		r.fd = fd;
+		r.n = 0;
+		r.size = (last - first + 1) * size;
+		r.origin = origin + ((uint64_t) first) * size;
+		r.error = 0;
+		dprintf("reading units %ld-%ld\n", first, last);
+		if (_fatunitread(&r, buf)) {
+			free(buf);
+			buf = NULL;
+		}
+	}
+
+	err = 0;
+	for (j = first; j <= last; j++) {
+		if (buf == NULL) {
+			if (fatunitget(cache, origin, size, j, fd) == NULL)
+				err++;
+			continue;
+		}
+
+		i = fatunitcreate(size);
+		i->origin = origin;
+		i->n = j;
+		i->fd = fd;
+		i->error = 0;
+		memcpy(i->data, buf + (j - first) * size, size);
+
+		pthread_rwlock_wrlock(&_fatunitcachelock);
+		s = (unit **) tsearch(i, (void **) cache, _compareunit);
+		pthread_rwlock_unlock(&_fatunitcachelock);
+		if (s == NULL || *s != i)
+			fatunitdestroy(i);
+	}
+
+	free(buf);
+	return err;
+}
+
 int fatunitinsert(unit **cache, unit *u, int replace) {
 	unit **f;
+	int res;
 
+	res = 0;
+	pthread_rwlock_wrlock(&_fatunitcachelock);
 	f = (unit **) tsearch(u, (void **) cache, _compareunit);
-	if (*f == u) {
+	if (*f == u)
+		u->dirty = 1;
+	else if (! replace && (*f)->data != NULL)
+		res = -1;
+	else {
+		fatunitdestroy(*f);
+		*f = u;
 		u->dirty = 1;
-		return 0;
 	}
-	if (! replace && (*f)->data != NULL)
-		return -1;
-
-	fatunitdestroy(*f);
-	*f = u;
-	u->dirty = 1;
-	return 0;
+	pthread_rwlock_unlock(&_fatunitcachelock);
+	return res;
 }
 
 void fatunitmove(unit **cache, unit *u, int dest) {
@@ -387,26 +544,73 @@ int fatunitwriteback(unit *u) {
 	return _fatunitwrite(u);
 }
 
+/*
+ * write units[0]...units[num-1], which have consecutive numbers, by a single
+ * write; return the number of units that could not be written
+ */
+int fatunitwriterun(unit **units, int num) {
+	unsigned char *buf;
+	unit r;
+	int j, err;
+
+			/* simulated errors and failed writes: one at time */
+
+	if (fat_simulate_errors == NULL && num > 1) {
+		buf = malloc(num * units[0]->size);
+		if (buf == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		for (j = 0; j < num; j++)
+			memcpy(buf + j * units[0]->size,
+				units[j]->data, units[0]->size);
+		r.fd = units[0]->fd;
+		r.n = 0;
+		r.size = num * units[0]->size;
+		r.origin = units[0]->origin +
+			((uint64_t) units[0]->n) * units[0]->size;
+		r.data = buf;
+		r.error = 0;
+		dprintf("writing units %d-%d\n",
+			units[0]->n, units[num - 1]->n);
+		err = _fatunitwrite(&r);
+		free(buf);
+		if (! err) {
+			for (j = 0; j < num; j++)
+				units[j]->dirty = 0;
+			return 0;
+		}
+	}
+
+	err = 0;
+	for (j = 0; j < num; j++)
+		if (fatunitwriteback(units[j]))
+			err++;
+	return err;
+}
+
 int _fatunitdeleteordetach(unit **cache, long n, int destroy) {
 	unit k, **s, *u;
+	int res;
 
+	res = -1;
+	pthread_rwlock_wrlock(&_fatunitcachelock);
 	k.n = n;
 	s = (unit **) tfind(&k, (void **) cache, _compareunit);
-	if (s == NULL)
-		return -1;
-	u = *s;
-
-	if (destroy && (u->refer > 0 || u->dirty))
-		return -1;
-
-	k.n = n;
-	if (NULL == tdelete(&k, (void **) cache, _compareunit))
-		return -1;
+	if (s != NULL) {
+		u = *s;
+		if (! destroy || _fatunitevictable(u)) {
+			k.n = n;
+			if (NULL != tdelete(&k, (void **) cache, _compareunit))
+				res = 0;
+		}
+	}
+	pthread_rwlock_unlock(&_fatunitcachelock);
 
-	if (destroy)
+	if (res == 0 && destroy)
 		fatunitdestroy(u);
 
-	return 0;
+	return res;
 }
 
 int fatunitdetach(unit **cache, long n) {
@@ -429,7 +633,35 @@ void _fatunitflush(const void *nodep, const VISIT which, UNUSED_DEPTH) {
 }
 
 void fatunitflush(unit *cache) {
+	pthread_rwlock_rdlock(&_fatunitcachelock);
 	twalk(cache, _fatunitflush);
+	pthread_rwlock_unlock(&_fatunitcachelock);
+}
+
+/*
+ * call a function on each unit in cache; twalk() does not pass data to its
+ * action, hence the globals
+ */
+
+pthread_mutex_t _fatunitwalklock = PTHREAD_MUTEX_INITIALIZER;
+void (*_fatunitwalkvisit)(unit *u, void *user);
+void *_fatunitwalkuser;
+
+void _fatunitwalk(const void *nodep, const VISIT which, UNUSED_DEPTH) {
+	if (which != preorder && which != leaf)
+		return;
+
+	_fatunitwalkvisit(* (unit **) nodep, _fatunitwalkuser);
+}
+
+void fatunitwalk(unit *cache, void (*visit)(unit *u, void *user), void *user) {
+	pthread_mutex_lock(&_fatunitwalklock);
+	_fatunitwalkvisit = visit;
+	_fatunitwalkuser = user;
+	pthread_rwlock_rdlock(&_fatunitcachelock);
+	twalk(cache, _fatunitwalk);
+	pthread_rwlock_unlock(&_fatunitcachelock);
+	pthread_mutex_unlock(&_fatunitwalklock);
 }
 
 /*
@@ -437,37 +669,43 @@ void fatunitflush(unit *cache) {
  */
 
 unsigned char *fatunitgetdata(unit *u) {
-	if (u->data == NULL) {
-		u->data = malloc(u->size);
-		if (u->data == NULL) {
-			printf("cannot allocate memory\n");
-			exit(1);
-		}
-		if (_fatunitread(u)) {
-			printf("unit %d no longer readable\n", u->n);
-			exit(1);
-		}
-	}
+	unsigned char *data;
 
+	data = __atomic_load_n(&u->data, __ATOMIC_ACQUIRE);
+	if (data != NULL)
+		return data;
+
+	if (_fatunitload(u)) {
+		printf("unit %d no longer readable\n", u->n);
+		exit(1);
+	}
 	return u->data;
 }
 
-void fatunitfree(unit *u) {
-	if (u->dirty || u->refer > 0)
+void _fatunitfree(unit *u) {
+	if (! _fatunitevictable(u))
 		return;
 	free(u->data);
 	u->data = NULL;
 }
 
+void fatunitfree(unit *u) {
+	pthread_rwlock_wrlock(&_fatunitcachelock);
+	_fatunitfree(u);
+	pthread_rwlock_unlock(&_fatunitcachelock);
+}
+
 void _fatunitfreecache(const void *nodep, const VISIT which, UNUSED_DEPTH) {
 	if (which != preorder && which != leaf)
 		return;
 	
-	fatunitfree(* (unit **) nodep);
+	_fatunitfree(* (unit **) nodep);
 }
 
 void fatunitfreecache(unit *cache) {
+	pthread_rwlock_wrlock(&_fatunitcachelock);
 	twalk(cache, _fatunitfreecache);
+	pthread_rwlock_unlock(&_fatunitcachelock);
 }
 
 /*
@@ -33,6 +33,11 @@
  *	dirty	the unit in cache differs from that in the filesystem
  *	refer	usage counter; the unit cannot be removed if > 0
  *	user 	free for program use
+ *
+ * the caches can be accessed by many threads at the same time: searching,
+ * adding, removing and reading units is atomic; the usage counter is to be
+ * changed only by fatunitrefer() and fatunitunrefer(); no unit is deleted or
+ * deallocated while a thread holds a filesystem lock for reading
  */
 
 #ifdef _UNIT_H
@@ -73,18 +78,35 @@ unit *fatunitcreate(int size);
 unit *fatunitcopy(unit *u);
 void fatunitdestroy(unit *u);
 
-/* get, insert, detach, move, swap, writeback and delete a unit from a cache */
+/* usage counter, atomic: increase, decrease, get */
+int fatunitrefer(unit *u);
+int fatunitunrefer(unit *u);
+int fatunitrefers(unit *u);
+
+/* a thread starts or stops reading; called by fatlockread() and fatunlock() */
+void fatunitreaderbegin(void);
+void fatunitreaderend(void);
+
+/* get, insert, detach, move, swap, writeback and delete a unit from a cache;
+ * fatunitgetrun() reads the missing units of n...n+num-1 in a single call,
+ * fatunitwriterun() writes num units of consecutive numbers in a single call */
 unit *fatunitget(unit **cache, uint64_t origin, int size, long n, int fd);
+int fatunitgetrun(unit **cache, uint64_t origin, int size,
+		long n, int num, int fd);
 int fatunitinsert(unit **cache, unit *u, int replace);
 int fatunitdetach(unit **cache, long n);
 void fatunitmove(unit **cache, unit *u, int dest);
 void fatunitswap(unit **cache, unit *u, unit *w);
 int fatunitwriteback(unit *u);
+int fatunitwriterun(unit **units, int num);
 int fatunitdelete(unit **cache, long n);
 
 /* flush all dirty units to filesystem */
 void fatunitflush(unit *cache);
 
+/* call a function on each unit in cache */
+void fatunitwalk(unit *cache, void (*visit)(unit *u, void *user), void *user);
+
 /* deal with deallocated units (data only); README: Note 1 **/
 unsigned char *fatunitgetdata(unit *u);
 void fatunitfree(unit *u);
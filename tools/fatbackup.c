@@ -306,6 +306,7 @@ int main(int argn, char *argv[]) {
 	dst->boot = fatunitget(&src->sectors, 0, size, 0, src->fd);
 	printf("copying clusters:");
 	fflush(stdout);
+	fatdirectoryprefetch(src, FAT_ROOT);
 	fatreferenceexecute(src, NULL, 0, -1, copydirectoryclusters, dst);
 	printf("\n");
 
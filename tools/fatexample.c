@@ -195,7 +195,7 @@ int main() {
 	directory = NULL;
 	index = 0;
 	previous = cl;
-	if (fatinversereferencetoentry(rev, &directory, &index, &previous))
+	if (fatinversereferencetoentry(f, rev, &directory, &index, &previous))
 		printf("cluster %d is in no file\n", cl);
 	else {
 		printf("cluster %d is in file: ", cl);
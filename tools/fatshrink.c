@@ -25,21 +25,100 @@
 #define _FILE_OFFSET_BITS 64
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
 #include <llfat.h>
 
 void usage() {
-	printf("usage:\n\tfatresize ([-m] [-t])|[-f] filename [size]\n");
+	printf("usage:\n\tfatresize ([-m] [-t] [-n])|[-f] filename [size]\n");
 	printf("\t\t-m\tmove clusters in the area to be cut\n");
 	printf("\t\t-t\tremove clusters in the area to be cut\n");
 	printf("\t\t-f\tresize even if some clusters are left out\n");
 	printf("\t\t\t(the resulting filesystem would be incorrect)\n");
-	printf("\t\tsize\tif omitted, only print number of sectors\n");
+	printf("\t\t-n\tonly estimate the cost of -m and -t\n");
+	printf("\t\tsize\tif omitted, only print number of sectors;\n");
+	printf("\t\t\tif larger, grow the filesystem\n");
+}
+
+/*
+ * read throughput of the device, measured on some of the clusters to be moved
+ */
+#define SAMPLE 256
+
+double throughput(fat *f, int32_t begin, int32_t last) {
+	struct timespec start, end;
+	int32_t cl;
+	uint64_t origin, bytes;
+	int size, n;
+	char *buf;
+	double elapsed;
+
+	fatclusterposition(f, begin, &origin, &size);
+	buf = malloc(size);
+	if (buf == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (cl = begin, n = 0; cl <= last && n < SAMPLE; cl++) {
+		if (fatgetnextcluster(f, cl) == FAT_UNUSED ||
+		    fatgetnextcluster(f, cl) == FAT_BAD)
+			continue;
+		fatclusterposition(f, cl, &origin, &size);
+		posix_fadvise(f->fd, f->offset + origin + (uint64_t) cl * size,
+			size, POSIX_FADV_DONTNEED);
+		if (pread(f->fd, buf, size,
+				f->offset + origin + (uint64_t) cl * size) != size)
+			break;
+		bytes += size;
+		n++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(buf);
+
+	elapsed = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	return elapsed <= 0 ? 0 : bytes / elapsed;
+}
+
+/*
+ * print the cost of shrinking without doing it
+ */
+void estimate(fat *f, int32_t clusters, int move) {
+	fatshrinkcost c;
+	double rate;
+
+	rate = throughput(f, clusters + 2, fatlastcluster(f));
+	if (fatshrinkestimate(f, clusters, move, rate, &c)) {
+		printf("cannot estimate: error reading the filesystem\n");
+		exit(1);
+	}
+
+	printf("\nestimate, nothing changed:\n");
+	printf("files in area to be cut: %d\n", c.files);
+	printf("their clusters in the area: %d\n", c.clusters);
+	printf("clusters to move: %d (%" PRIu64 " bytes)\n", c.moved, c.bytes);
+	printf("files to truncate: %d, ", c.truncated);
+	printf("clusters removed from them: %d\n", c.lost);
+	printf("used clusters in no file, to be lost: %d\n", c.other);
+	if (rate <= 0)
+		printf("device throughput: not measured\n");
+	else {
+		printf("device throughput: %.1f MB/s\n", rate / 1000000);
+		printf("time for moving: %.1f seconds\n", c.seconds);
+	}
+	if (c.truncated > 0 && move)
+		printf("not enough free space: -t would truncate files\n");
 }
 
 int main(int argn, char *argv[]) {
 	char *filename;
 	uint32_t sectors;
-	int move = 0, truncate = 0, force = 0;
+	int move = 0, truncate = 0, force = 0, dryrun = 0;
 	int32_t clusters, begin, last, allocated, numcut;
 	fat *f, *g;
 
@@ -61,6 +140,9 @@ int main(int argn, char *argv[]) {
 		case 'f':
 			force = 1;
 			break;
+		case 'n':
+			dryrun = 1;
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -102,9 +184,20 @@ int main(int argn, char *argv[]) {
 			/* compare current and target clusters */
 
 	if (sectors > fatgetnumsectors(f)) {
-		printf("this program can only shrink a filesystem, ");
-		printf("not elarge it\n");
-		exit(1);
+		if (dryrun || move || truncate) {
+			printf("options -n, -m and -t are only for shrinking\n");
+			exit(1);
+		}
+		printf("\ngrowing to %u sectors\n", sectors);
+		if (fatgrow(f, sectors)) {
+			printf("cannot grow the filesystem\n");
+			fatclose(f);
+			exit(1);
+		}
+		printf("sectors: %d\n", fatgetnumsectors(f));
+		printf("clusters: %d\n", fatnumdataclusters(f));
+		fatclose(f);
+		return 0;
 	}
 	else if (sectors == fatgetnumsectors(f)) {
 		printf("no change requested\n");
@@ -140,6 +233,10 @@ int main(int argn, char *argv[]) {
 	}
 	else if (clusters == fatnumdataclusters(f)) {
 		printf("no change in number of clusters\n");
+		if (dryrun) {
+			fatclose(f);
+			return 0;
+		}
 		goto resize;
 	}
 	begin = clusters + 2;
@@ -148,6 +245,12 @@ int main(int argn, char *argv[]) {
 	printf("clusters left: %d-%d, ", 2, begin - 1);
 	printf("cluster removed: %d-%d\n", begin, last);
 
+	if (dryrun) {
+		estimate(f, clusters, move || ! truncate);
+		fatclose(f);
+		return 0;
+	}
+
 	if (force)
 		goto resize;
 
@@ -26,10 +26,129 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #define __USE_UNIX98
 #include <wchar.h>
+#include <pthread.h>
 #include <llfat.h>
 
+/*
+ * compare the size of the extracted files with the directory entries
+ */
+void extractcheck(fat *f, wchar_t *path, struct fatdirent *entry, void *user) {
+	char name[4096];
+	struct stat st;
+	(void) f;
+	if ((entry->attributes & (FAT_ATTR_DIR | FAT_ATTR_VOLUME)) ||
+	    entry->first < FAT_FIRST)
+		return;
+	snprintf(name, 4096, "%s/%ls%ls", ((char **) user)[0],
+		path, entry->name);
+	if (stat(name, &st) == -1 || st.st_size != entry->size)
+		((char **) user)[1] = "differs";
+}
+
+/*
+ * remove an extracted tree
+ */
+int removetree(char *dirname) {
+	DIR *dir;
+	struct dirent *ent;
+	char name[4096];
+	struct stat st;
+	int res;
+
+	dir = opendir(dirname);
+	if (dir == NULL)
+		return remove(dirname);
+	res = 0;
+	while ((ent = readdir(dir)) != NULL) {
+		if (! strcmp(ent->d_name, ".") || ! strcmp(ent->d_name, ".."))
+			continue;
+		snprintf(name, 4096, "%s/%s", dirname, ent->d_name);
+		if (lstat(name, &st) == -1)
+			res = -1;
+		else if (S_ISDIR(st.st_mode))
+			res |= removetree(name);
+		else
+			res |= remove(name);
+	}
+	closedir(dir);
+	return res | rmdir(dirname);
+}
+
+/*
+ * count the references visited by fatreferenceexecute()
+ */
+int countreference(fat *f,
+		unit *directory, int index, int32_t previous,
+		unit *startdirectory, int startindex, int32_t startprevious,
+		unit *dirdirectory, int dirindex, int32_t dirprevious,
+		int direction, void *user) {
+	(void) f;
+	(void) directory;
+	(void) index;
+	(void) previous;
+	(void) startdirectory;
+	(void) startindex;
+	(void) startprevious;
+	(void) dirdirectory;
+	(void) dirindex;
+	(void) dirprevious;
+	if (direction == 0)
+		(* (int32_t *) user)++;
+	return FAT_REFERENCE_CHAIN | FAT_REFERENCE_RECUR;
+}
+
+/*
+ * count the events dispatched by fatreferencewalk(); user is an array with
+ * the mask, a counter for each event and one for the events not in the mask
+ */
+int countevent(fat *f, struct fatcursor *c, void *user) {
+	int32_t *count = user;
+	int i;
+
+	(void) f;
+	for (i = 0; i < 5; i++)
+		if (c->event == 1 << i)
+			count[1 + i]++;
+	if (! (c->event & count[0]))
+		count[6]++;
+	return FAT_REFERENCE_NORMAL;
+}
+
+/*
+ * count the files and their size, from many threads
+ */
+void walkcount(fat *f, wchar_t *path, struct fatdirent *entry, void *user) {
+	(void) f;
+	(void) path;
+	__sync_fetch_and_add(&((int *) user)[0], 1);
+	__sync_fetch_and_add(&((int *) user)[1], entry->size);
+}
+
+/*
+ * count the clusters of the filesystem, holding the read lock
+ */
+struct sharedcount {
+	fat *f;
+	int32_t n;
+	pthread_t thread;
+};
+
+void *sharedcount(void *arg) {
+	struct sharedcount *s;
+
+	s = (struct sharedcount *) arg;
+	fatlockread(s->f);
+	s->n = fatcountclusters(s->f, NULL, 0, -1, 1);
+	fatunlock(s->f);
+	return NULL;
+}
+
 /*
  * print the first max entries in a fat
  */
@@ -80,6 +199,27 @@ void fatprintentrylong(fat __attribute__((unused)) *f, wchar_t *path,
 	printf("\n");
 }
 
+/*
+ * print the end of each long operation
+ */
+void progressprint(fat __attribute__((unused)) *f, fatprogress *p) {
+	if (p->finished)
+		printf("progress: %s %" PRId64 "/%" PRId64 " %" PRIu64 "\n",
+			p->operation, p->done, p->total, p->bytes);
+}
+
+/*
+ * record the clusters moved by compaction and the expected ones
+ */
+int64_t compactdone, compacttotal;
+
+void progresscompact(fat __attribute__((unused)) *f, fatprogress *p) {
+	if (p->finished && ! strcmp(p->operation, "compact")) {
+		compactdone = p->done;
+		compacttotal = p->total;
+	}
+}
+
 /*
  * main
  */
@@ -94,12 +234,28 @@ int main(int argn, char *argv[]) {
 	unit *root, *cluster, *directory, *longdirectory;
 	int index, longindex;
 	char shortname[13], *path, *left;
-	int32_t cl, freecluster, n, previous;
+	int32_t cl, freecluster, n, previous, cycle[3];
 	int i;
-	fatinverse *rev;
+	fatinverse *rev, *check;
 	int res;
 	struct fatlongscan scan;
-	wchar_t longname[1000], *in, *out;
+	wchar_t longname[1000], *in, *out, **names;
+	unit **directories;
+	int *indexes;
+	struct fatreaddir *readdir;
+	struct fatdirent *dirent;
+	char timestring[30];
+	int count[2];
+	struct sharedcount shared[4];
+	struct fat_simulate_errors_s simulated[2];
+	FILE *stream;
+	char *buffer;
+	char dirname[64], *extracted[2];
+	fatchains *chains;
+	fatshrinkcost shrinkcost;
+	unsigned char *classes, expected[8];
+	int masks[4], want;
+	int32_t events[7], all[7];
 
 	if (argn - 1 < 1) {
 		printf("usage:\n\tfattest filename [test]\n");
@@ -773,7 +929,7 @@ int main(int argn, char *argv[]) {
 		directory = NULL;
 		index = 0;
 		n = cl;
-		if (fatinversereferencetoentry(rev, &directory, &index, &n))
+		if (fatinversereferencetoentry(f, rev, &directory, &index, &n))
 			printf("cluster %d is not in any file\n", cl);
 		else if (directory != NULL) {
 			printf("entry of cluster %d ", cl);
@@ -785,7 +941,7 @@ int main(int argn, char *argv[]) {
 		else
 			printf("cluster %d is part of the root dir\n", cl);
 
-		free(rev);
+		fatinversedelete(f, rev);
 		break;
 
 	case 25:
@@ -805,6 +961,7 @@ int main(int argn, char *argv[]) {
 		root = fatclusterread(f, r);
 		index = -1;
 		fatfindfreeentry(f, &root, &index);
+		fatunitrefer(root);	/* inverse checks may evict it */
 		fatentrydelete(root, index);
 		strcpy(shortname, "TEST");
 		printf("creating file %s ", shortname);
@@ -871,7 +1028,8 @@ int main(int argn, char *argv[]) {
 			fatentrygetsize(root, index) - cluster->size);
 		fatinversecheck(f, rev, 0);
 
-		free(rev);
+		fatunitunrefer(root);
+		fatinversedelete(f, rev);
 		break;
 
 	case 26:
@@ -899,7 +1057,7 @@ int main(int argn, char *argv[]) {
 
 		fatinversecheck(f, rev, 0);
 
-		free(rev);
+		fatinversedelete(f, rev);
 		break;
 
 	case 27:
@@ -1151,6 +1309,669 @@ int main(int argn, char *argv[]) {
 		out = fatlegalizepathlong(in);
 		printf("original:  %ls\nlegalized: %ls\n", in, out);
 
+		break;
+
+	case 38:
+		printf("\n********* multiple file creation test\n");
+
+		names = malloc(100 * sizeof(wchar_t *));
+		directories = malloc(100 * sizeof(unit *));
+		indexes = malloc(100 * sizeof(int));
+		for (i = 0; i < 100; i++) {
+			names[i] = malloc(100 * sizeof(wchar_t));
+			swprintf(names[i], 100, L"holiday picture %d.jpeg", i);
+		}
+
+		n = fatcreatefileslong(f, r, 100, names, directories, indexes);
+		printf("created %d files\n", n);
+		for (i = 0; i < n; i++) {
+			fatentrygetshortname(directories[i], indexes[i],
+				shortname);
+			printf("%d,%d %-12s %ls\n",
+				directories[i]->n, indexes[i],
+				shortname, names[i]);
+		}
+
+		for (i = 0; i < 100; i++)
+			free(names[i]);
+		free(names);
+		free(directories);
+		free(indexes);
+
+		break;
+
+	case 39:
+		printf("\n********* batched directory read test\n");
+
+		readdir = fatreaddiropen(f, r, 4);
+		if (readdir == NULL) {
+			printf("cannot read root directory\n");
+			break;
+		}
+		while ((n = fatreaddir(f, readdir)) > 0) {
+			printf("batch of %d entries\n", n);
+			for (i = 0; i < n; i++) {
+				dirent = &readdir->entries[i];
+				strftime(timestring, 30, "%Y-%m-%d %H:%M",
+					&dirent->write);
+				printf("%d,%d %-12s 0x%02X %8u %6d %s %ls\n",
+					dirent->cluster, dirent->index,
+					dirent->shortname, dirent->attributes,
+					dirent->size, dirent->first,
+					timestring, dirent->name);
+			}
+		}
+		fatreaddirclose(readdir);
+
+		break;
+
+	case 42:
+		printf("\n********* parallel walk test\n");
+
+		for (i = 1; i <= 8; i *= 2) {
+			count[0] = 0;
+			count[1] = 0;
+			res = fatwalk(f, r, i, 0, walkcount, count);
+			printf("%d threads: result %d, %d files, %d bytes\n",
+				i, res, count[0], count[1]);
+		}
+
+		break;
+
+	case 43:
+		printf("\n********* concurrent readers test\n");
+
+		fatunitfreecache(f->clusters);
+		for (i = 0; i < 4; i++) {
+			shared[i].f = f;
+			pthread_create(&shared[i].thread, NULL,
+				sharedcount, &shared[i]);
+		}
+		for (i = 0; i < 4; i++) {
+			pthread_join(shared[i].thread, NULL);
+			printf("thread %d: %d clusters\n", i, shared[i].n);
+		}
+		printf("serial: %d clusters\n",
+			fatcountclusters(f, NULL, 0, -1, 1));
+
+		break;
+
+	case 44:
+		printf("\n********* chain lengths test\n");
+
+		chains = fatchainscreate(f);
+		n = 0;
+		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+			if (fatchainscrosslinked(chains, cl))
+				printf("cluster %d is cross-linked\n", cl);
+			if (fatchainsloop(chains, cl))
+				n++;
+		}
+		printf("%d clusters lead to a loop\n", n);
+		printf("from the fat: %d clusters\n",
+			fatcountclusterschains(f, chains, NULL, 0, -1, 1));
+		if (n == 0)
+			printf("by the chains: %d clusters\n",
+				fatcountclusters(f, NULL, 0, -1, 1));
+		fatchainsdelete(chains);
+
+		break;
+
+	case 45:
+		printf("\n********* saved inverse fat test\n");
+
+		fatinversedebug = 1;
+		unlink("/tmp/fattest-inverse");
+		rev = fatinverseopen(f, "/tmp/fattest-inverse");
+		fatinversedelete(f, rev);
+
+		rev = fatinverseopen(f, "/tmp/fattest-inverse");
+		fatinversecheck(f, rev, 0);
+		freecluster = fatclusterfindfree(f);
+		printf("moving 12->%d\n", freecluster);
+		fatinversemove(f, rev, 12, freecluster, 1);
+		fatinversedelete(f, rev);
+
+		rev = fatinverseopen(f, "/tmp/fattest-inverse");
+		fatinversecheck(f, rev, 0);
+		freecluster = fatclusterfindfree(f);
+		printf("changing %d outside the inverse fat\n", freecluster);
+		fatsetnextcluster(f, freecluster, FAT_EOF);
+		fatinversedelete(f, rev);
+
+		rev = fatinverseopen(f, "/tmp/fattest-inverse");
+		fatinversecheck(f, rev, 0);
+		fatsetnextcluster(f, freecluster, FAT_UNUSED);
+		fatinversedelete(f, rev);
+		unlink("/tmp/fattest-inverse");
+
+		break;
+
+	case 46:
+		printf("\n********* parallel inverse fat test\n");
+
+		fatparalleldebug = 1;
+		fatinversethreads = 4;
+		rev = fatinversecreate(f, 0);
+		fatinversethreads = 0;
+		fatinversecheck(f, rev, 0);
+		fatinversedelete(f, rev);
+
+		fatinversethreads = 4;
+		rev = fatinversechains(f, 0);
+		fatinversethreads = 0;
+		check = fatinversechains(f, 0);
+		printf("chains %s\n",
+			memcmp(rev + 1, check + 1,
+				fatlastcluster(f) * sizeof(fatinverse)) ?
+			"differ" : "equal");
+		fatinversedelete(f, check);
+		fatinversedelete(f, rev);
+
+		break;
+
+	case 47:
+		printf("\n********* rotate and defragment plan test\n");
+
+		rev = fatinversecreate(f, 0);
+		for (i = 0, cl = 12; i < 3 && cl <= fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) != FAT_UNUSED &&
+			    ! fatinverseisvoid(rev, cl))
+				cycle[i++] = cl;
+		printf("rotating %d->%d->%d->%d\n",
+			cycle[0], cycle[1], cycle[2], cycle[0]);
+		fatinverserotate(f, rev, cycle, 3, 1);
+		fatinversecheck(f, rev, 0);
+		fatinversedelete(f, rev);
+
+		fatdefragment(f, 1, &res);
+		printf("%d changes planned\n", res);
+		fatdefragment(f, 0, NULL);
+		fatdefragment(f, 1, &res);
+		printf("%d changes left\n", res);
+
+		break;
+
+	case 48:
+		printf("\n********* cluster run move test\n");
+
+		rev = fatinversecreate(f, 0);
+		for (cl = FAT_FIRST; cl < fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) == cl + 1 &&
+			    ! fatinverseisvoid(rev, cl))
+				break;
+		for (n = 1; n < 8 && fatgetnextcluster(f, cl + n - 1) == cl + n;)
+			n++;
+		freecluster = fatclusterfindfreesequence(f, n);
+		if (cl >= fatlastcluster(f) || freecluster == FAT_ERR ||
+		    fatinverseget(f, rev, cl, &directory, &index, &previous)) {
+			printf("no run of clusters to move\n");
+			fatinversedelete(f, rev);
+			break;
+		}
+		printf("moving %d-%d -> %d-%d\n", cl, cl + n - 1,
+			freecluster, freecluster + n - 1);
+		res = fatinversemoverun(f, rev, directory, index, previous,
+			rev[cl].isdir, freecluster, n, 1);
+		printf("result: %d\n", res);
+		res = fatinversecheck(f, rev, 0);
+		printf("inverse fat %s\n", res == 0 ? "matches" : "differs");
+		fatinversedelete(f, rev);
+
+		break;
+
+	case 49:
+		printf("\n********* journal test\n");
+
+		rev = fatinversecreate(f, 0);
+		for (i = 0, cl = 12; i < 3 && cl <= fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) != FAT_UNUSED &&
+			    ! fatinverseisvoid(rev, cl))
+				cycle[i++] = cl;
+		fatinverserotate(f, rev, cycle, 3, 1);
+		fatinversedelete(f, rev);
+
+		fatjournalfile = "fattest.journal";
+		fatdefragment(f, 0, NULL);
+		printf("journal %s\n",
+			access(fatjournalfile, F_OK) ? "deleted" : "left");
+		fatcompact(f);
+		printf("journal %s\n",
+			access(fatjournalfile, F_OK) ? "deleted" : "left");
+		fatjournalfile = NULL;
+		fatdefragment(f, 1, &res);
+		printf("%d changes left\n", res);
+
+			/* resume after a write error */
+
+		rev = fatinversecreate(f, 0);
+		fatinverserotate(f, rev, cycle, 3, 1);
+		fatinversedelete(f, rev);
+		fatflush(f);
+
+		simulated[0].fd = -1;
+		simulated[0].type = FAT_WRITE;
+		simulated[0].n = cycle[0];
+		simulated[0].iscluster = 1;
+		simulated[0].res = -1;
+		simulated[1].type = 0;
+		fat_simulate_errors = simulated;
+
+		fatjournalfile = "fattest.journal";
+		fatdefragment(f, 0, NULL);
+		printf("journal %s\n",
+			access(fatjournalfile, F_OK) ? "deleted" : "left");
+
+		fat_simulate_errors = NULL;
+		fatclose(f);
+		f = fatopen(filename, 0);
+		if (f == NULL)
+			return -1;
+
+		fatdefragment(f, 0, NULL);
+		printf("journal %s\n",
+			access(fatjournalfile, F_OK) ? "deleted" : "left");
+		fatjournalfile = NULL;
+		fatdefragment(f, 1, &res);
+		printf("%d changes left\n", res);
+
+		break;
+
+	case 50:
+		printf("\n********* progress test\n");
+
+		fatprogressregister(f, progressprint, 100, 0);
+		fatclusternumfree(f);
+		rev = fatinversecreate(f, 0);
+		fatinversedelete(f, rev);
+		fatdefragment(f, 0, NULL);
+		fatcompact(f);
+		fatprogressregister(f, NULL, 0, 0);
+
+		break;
+
+	case 51:
+		printf("\n********* selective defragmentation test\n");
+
+		rev = fatinversecreate(f, 0);
+		for (i = 0, cl = 12; i < 3 && cl <= fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) != FAT_UNUSED &&
+			    ! fatinverseisvoid(rev, cl))
+				cycle[i++] = cl;
+		fatinverserotate(f, rev, cycle, 3, 1);
+		fatinversedelete(f, rev);
+
+		fatdefragmentselective(f, 2, 0, 1, &res);
+		fatdefragmentselective(f, 2, 0, 0, &res);
+		printf("%d clusters moved\n", res);
+		fatdefragmentselective(f, 2, 0, 1, &res);
+		printf("%d clusters left\n", res);
+
+		break;
+
+	case 52:
+		printf("\n********* shrink estimate test\n");
+
+		n = (fatnumdataclusters(f) - fatclusternumfree(f)) / 2;
+		for (i = 0; i <= 1; i++) {
+			fatshrinkestimate(f, n, i, 1000000, &shrinkcost);
+			printf("move %d: %d files, %d clusters, ", i,
+				shrinkcost.files, shrinkcost.clusters);
+			printf("%d moved, %d truncated, %d lost, %d other, ",
+				shrinkcost.moved, shrinkcost.truncated,
+				shrinkcost.lost, shrinkcost.other);
+			printf("%.3f seconds\n", shrinkcost.seconds);
+		}
+
+		break;
+
+	case 53:
+		printf("\n********* grow test\n");
+
+		n = fatnumdataclusters(f) - fatclusternumfree(f);
+		origin = fatgetnumsectors(f) / 2 * 3;
+		if (ftruncate(f->fd, f->offset +
+				origin * fatgetbytespersector(f))) {
+			perror("ftruncate");
+			break;
+		}
+		if (fatgrow(f, origin))
+			break;
+		printf("sectors: %d, clusters: %d, ",
+			fatgetnumsectors(f), fatnumdataclusters(f));
+		printf("used: %d -> %d\n",
+			n, fatnumdataclusters(f) - fatclusternumfree(f));
+
+		break;
+
+	case 54:
+		printf("\n********* directories first test\n");
+
+		fatdirectoriesfirst(f, 1, &res);
+		fatdirectoriesfirst(f, 0, &res);
+		printf("%d changes done\n", res);
+		fatdirectoriesfirst(f, 1, &res);
+		printf("%d changes left\n", res);
+
+		break;
+
+	case 55:
+		printf("\n********* stream test\n");
+
+		stream = tmpfile();
+		if (stream == NULL) {
+			perror("tmpfile");
+			break;
+		}
+		origin = fatfilestream(f, f, fatgetrootbegin(f), -1,
+			fileno(stream));
+		printf("%" PRIu64 " bytes copied\n", origin);
+
+		rewind(stream);
+		res = 0;
+		for (cl = fatgetrootbegin(f);
+		     cl == FAT_ROOT || cl >= FAT_FIRST;
+		     cl = cl == FAT_ROOT ? FAT_EOF : fatgetnextcluster(f, cl)) {
+			cluster = fatclusterread(f, cl);
+			if (cluster == NULL)
+				break;
+			buffer = malloc(cluster->size);
+			if (fread(buffer, 1, cluster->size, stream) !=
+				(size_t) cluster->size ||
+			    memcmp(buffer, fatunitgetdata(cluster),
+					cluster->size))
+				res = 1;
+			free(buffer);
+		}
+		printf("content %s\n", res ? "differs" : "matches");
+		fclose(stream);
+
+		break;
+
+	case 56:
+		printf("\n********* file write test\n");
+
+		stream = tmpfile();
+		if (stream == NULL) {
+			perror("tmpfile");
+			break;
+		}
+		for (i = 0; i < 100000; i++)
+			fputc(i % 251, stream);
+		rewind(stream);
+		origin = fatfilewrite(f, fileno(stream), 100000,
+			FAT_FIRST, fatlastcluster(f), &cl);
+		printf("%" PRId64 " bytes written, ", (int64_t) origin);
+		printf("first cluster %d\n", cl);
+		fclose(stream);
+
+		stream = tmpfile();
+		if (stream == NULL) {
+			perror("tmpfile");
+			break;
+		}
+		fatfilestream(f, f, cl, 100000, fileno(stream));
+		rewind(stream);
+		for (i = 0, res = 0; i < 100000; i++)
+			if (fgetc(stream) != i % 251)
+				res = 1;
+		printf("content %s\n", res ? "differs" : "matches");
+		fclose(stream);
+		fatclusterfreechain(f, cl);
+
+		break;
+
+	case 57:
+		printf("\n********* extract test\n");
+
+		strcpy(dirname, "/tmp/fattest-XXXXXX");
+		if (mkdtemp(dirname) == NULL) {
+			perror("mkdtemp");
+			break;
+		}
+		strcat(dirname, "/tree");
+		res = fatextract(f, r, dirname, 4);
+		printf("result: %d\n", res);
+
+		extracted[0] = dirname;
+		extracted[1] = "matches";
+		fatwalk(f, r, 1, FAT_WALK_ORDERED, extractcheck, extracted);
+		printf("size of files %s\n", extracted[1]);
+
+		*strrchr(dirname, '/') = '\0';
+		if (removetree(dirname))
+			printf("cannot remove %s\n", dirname);
+
+		break;
+
+	case 58:
+		printf("\n********* compact count test\n");
+
+				/* free the first file in the root directory */
+
+		readdir = fatreaddiropen(f, r, 0);
+		i = 0;
+		while (fatreaddir(f, readdir) > 0) {
+			for (i = 0; i < readdir->n; i++)
+				if (! (readdir->entries[i].attributes &
+				       (FAT_ATTR_DIR | FAT_ATTR_VOLUME)) &&
+				    readdir->entries[i].first >= FAT_FIRST)
+					break;
+			if (i < readdir->n)
+				break;
+		}
+		if (i < readdir->n) {
+			u = fatclusterread(f, readdir->entries[i].cluster);
+			printf("deleting %ls\n", readdir->entries[i].name);
+			fatclusterfreechain(f, readdir->entries[i].first);
+			fatentrydelete(u, readdir->entries[i].index);
+			u->dirty = 1;
+		}
+		fatreaddirclose(readdir);
+
+				/* used clusters over the final boundary */
+
+		for (cl = FAT_FIRST, res = 0; cl <= fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) != FAT_UNUSED)
+				res++;
+		origin = 0;
+		for (cl = FAT_FIRST + res; cl <= fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) != FAT_UNUSED)
+				origin++;
+		printf("%" PRIu64 " clusters over %d\n", origin, FAT_FIRST + res);
+
+		compactdone = -1;
+		compacttotal = -1;
+		fatprogressregister(f, progresscompact, 0, 0);
+		res = fatcompact(f);
+		fatprogressregister(f, NULL, 0, 0);
+		printf("result: %d, moved %" PRId64 " of %" PRId64 "\n",
+			res, compactdone, compacttotal);
+		printf("count %s\n",
+			compactdone == compacttotal &&
+			compactdone == (int64_t) origin ? "matches" : "differs");
+
+		break;
+
+	case 59:
+		printf("\n********* traversal limits test\n");
+
+				/* directories nested too deep */
+
+		fatreferencemaxdepth = 2;
+		n = 0;
+		res = fatreferenceexecute(f, NULL, 0, -1, countreference, &n);
+		printf("depth limit 2: result %d\n", res);
+		fatreferencemaxdepth = 1024;
+		n = 0;
+		res = fatreferenceexecute(f, NULL, 0, -1, countreference, &n);
+		printf("depth limit 1024: result %d, %d references\n", res, n);
+
+				/* a directory containing its ancestor */
+
+		if (fatlookuppath(f, r, "/AAA/BBB/CCC", &directory, &index) ||
+		    fatlookuppath(f, r, "/AAA", &longdirectory, &longindex)) {
+			printf("no /AAA/BBB/CCC in the filesystem\n");
+			break;
+		}
+		cl = fatentrygetfirstcluster(directory, index, fatbits(f));
+		fatentrysetfirstcluster(directory, index, fatbits(f),
+			fatentrygetfirstcluster(longdirectory, longindex,
+				fatbits(f)));
+		n = 0;
+		res = fatreferenceexecute(f, NULL, 0, -1, countreference, &n);
+		printf("directory in itself: result %d\n", res);
+		fatentrysetfirstcluster(directory, index, fatbits(f), cl);
+
+				/* a chain ending in a loop */
+
+		if (fatlookuppath(f, r, "/AAA/BBB/FATTOOL.C",
+				&directory, &index)) {
+			printf("no /AAA/BBB/FATTOOL.C in the filesystem\n");
+			break;
+		}
+		cl = fatentrygetfirstcluster(directory, index, fatbits(f));
+		for (freecluster = cl;
+		     fatgetnextcluster(f, freecluster) >= FAT_FIRST;
+		     freecluster = fatgetnextcluster(f, freecluster))
+			;
+		previous = fatgetnextcluster(f, freecluster);
+		fatsetnextcluster(f, freecluster, cl);
+		n = 0;
+		res = fatreferenceexecute(f, NULL, 0, -1, countreference, &n);
+		printf("chain in a loop: result %d\n", res);
+		fatsetnextcluster(f, freecluster, previous);
+
+		n = 0;
+		res = fatreferenceexecute(f, NULL, 0, -1, countreference, &n);
+		printf("restored: result %d, %d references\n", res, n);
+
+		break;
+
+	case 60:
+		printf("\n********* entry classes test\n");
+
+				/* an entry of each class, then the end; the
+				   long and deleted ones also have the volume
+				   bit, which does not count */
+
+		u = fatunitcreate(fatbytespercluster(f));
+		memset(fatunitgetdata(u), 0, u->size);
+		fatentrysetshortname(u, 0, "LABEL\0      ");
+		fatentrysetattributes(u, 0, FAT_ATTR_VOLUME);
+		expected[0] = FAT_CLASS_VOLUME;
+		fatentrysetshortname(u, 1, "LONG\0       ");
+		fatentrysetattributes(u, 1, FAT_ATTR_LONGNAME);
+		_unit8uint(u, 1 * 32) = 0x41;
+		expected[1] = FAT_CLASS_LONG;
+		fatentrysetshortname(u, 2, "FILE.TXT\0   ");
+		fatentrysetattributes(u, 2, FAT_ATTR_ARCHIVE);
+		expected[2] = FAT_CLASS_FILE;
+		fatentrysetshortname(u, 3, "OLD.TXT\0    ");
+		fatentrysetattributes(u, 3, FAT_ATTR_ARCHIVE);
+		fatentrydelete(u, 3);
+		expected[3] = FAT_CLASS_DELETED;
+		fatentrysetshortname(u, 4, "DIR\0        ");
+		fatentrysetattributes(u, 4, FAT_ATTR_DIR);
+		expected[4] = FAT_CLASS_DIR;
+		fatentrysetshortname(u, 5, "OLDLONG\0    ");
+		fatentrysetattributes(u, 5, FAT_ATTR_LONGNAME);
+		fatentrydelete(u, 5);
+		expected[5] = FAT_CLASS_DELETED;
+		fatentrysetshortname(u, 6, "LAST.TXT\0   ");
+		fatentrysetattributes(u, 6, 0);
+		expected[6] = FAT_CLASS_FILE;
+		expected[7] = FAT_CLASS_END;
+
+		classes = malloc(u->size / 32);
+		if (classes == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		n = fatentryclassify(u, classes);
+		printf("%d entries:", n);
+		res = n != u->size / 32;
+		for (i = 0; i < n; i++) {
+			if (i < 8)
+				printf(" 0x%02X", classes[i]);
+			if (classes[i] != fatentryclass(u, i) ||
+			    classes[i] != (i < 8 ? expected[i] : FAT_CLASS_END))
+				res++;
+		}
+		printf("\nclassify %s\n", res ? "differs" : "matches");
+
+				/* the entries of some classes, up to the end */
+
+		masks[0] = FAT_CLASS_EXISTS;
+		masks[1] = FAT_CLASS_LONG | FAT_CLASS_EXISTS;
+		masks[2] = FAT_CLASS_DELETED;
+		masks[3] = FAT_CLASS_ALL;
+		for (i = 0; i < 4; i++) {
+			printf("mask 0x%02X:", masks[i]);
+			res = 0;
+			want = -1;
+			index = -1;
+			do {
+				index = fatentryclassnext(classes, n, index,
+					masks[i] | FAT_CLASS_END);
+				for (want++;
+				     ! (expected[want] &
+				        (masks[i] | FAT_CLASS_END));
+				     want++)
+					;
+				printf(" %d", index);
+				if (index != want)
+					res++;
+			} while (index < n && classes[index] != FAT_CLASS_END);
+			printf(" %s\n", res ? "differs" : "matches");
+		}
+
+		free(classes);
+		fatunitdestroy(u);
+
+		break;
+
+	case 61:
+		printf("\n********* walk events test\n");
+
+				/* all events, as a reference */
+
+		memset(all, 0, sizeof(all));
+		all[0] = FAT_EVENT_ALL;
+		res = fatreferencewalk(f, NULL, 0, -1, FAT_EVENT_ALL,
+			countevent, all);
+		printf("all: result %d, entry %d chain %d enter %d ",
+			res, all[1], all[2], all[3]);
+		printf("leave %d post %d\n", all[4], all[5]);
+		n = 0;
+		fatreferenceexecute(f, NULL, 0, -1, countreference, &n);
+		printf("references %d %s\n", n,
+			n == all[1] + all[2] ? "match" : "differ");
+
+				/* each mask gets its events only, and all of
+				   them */
+
+		masks[0] = FAT_EVENT_ENTRY;
+		masks[1] = FAT_EVENT_ENTER | FAT_EVENT_LEAVE;
+		masks[2] = FAT_EVENT_CHAIN;
+		masks[3] = FAT_EVENT_POST;
+		for (i = 0; i < 4; i++) {
+			memset(events, 0, sizeof(events));
+			events[0] = masks[i];
+			res = fatreferencewalk(f, NULL, 0, -1, masks[i],
+				countevent, events);
+			printf("mask 0x%02X: result %d, entry %d chain %d ",
+				masks[i], res, events[1], events[2]);
+			printf("enter %d leave %d post %d, ",
+				events[3], events[4], events[5]);
+			for (want = 0, n = 0; want < 5; want++)
+				if (events[1 + want] !=
+				    ((masks[i] & 1 << want) ?
+					all[1 + want] : 0))
+					n++;
+			printf("%s\n", n || events[6] ? "differs" : "matches");
+		}
+
 		break;
 	}
 
@@ -75,6 +75,34 @@ void check() {
 	exit(1);
 }
 
+/*
+ * progress bar of long operations, on stderr
+ */
+#define PROGRESSWIDTH 30
+
+void progressbar(fat __attribute__((unused)) *f, fatprogress *p) {
+	int fill, i;
+
+	fprintf(stderr, "\r%-20s", p->operation);
+	if (p->total > 0) {
+		fill = p->done >= p->total ?
+			PROGRESSWIDTH : p->done * PROGRESSWIDTH / p->total;
+		fprintf(stderr, " [");
+		for (i = 0; i < PROGRESSWIDTH; i++)
+			fputc(i < fill ? '#' : ' ', stderr);
+		fprintf(stderr, "] %3d%%", fill * 100 / PROGRESSWIDTH);
+		fprintf(stderr, " %" PRId64 "/%" PRId64, p->done, p->total);
+	}
+	else
+		fprintf(stderr, " %" PRId64, p->done);
+	if (p->bytes > 0)
+		fprintf(stderr, " %.1f MB/s  ", p->throughput / 1000000);
+	else
+		fprintf(stderr, " %.0f/s  ", p->rate);
+	if (p->finished)
+		fprintf(stderr, "\n");
+}
+
 /*
  * print a long name
  */
@@ -111,6 +139,14 @@ void printpath(fat *f, wchar_t *path, unit *directory, int index,
 	printlongname("", name, "\n");
 }
 
+void printwalk(fat *f, wchar_t *path, struct fatdirent *entry, void *user) {
+	(void) f;
+	if ((entry->attributes & FAT_ATTR_DIR) && user)
+		return;
+	printlongname("", path, "");
+	printlongname("", entry->name, "\n");
+}
+
 /*
  * process an option that is a file and turns it into a cluster reference; in
  * some cases like "cluster:103", the target is filled but the reference is
@@ -565,7 +601,7 @@ void printcluster(fat *f, int32_t cl, fatinverse *rev, int run) {
 		index = 0;
 		previous = cl;
 
-		if (fatinversereferencetoentry(rev, &directory,
+		if (fatinversereferencetoentry(f, rev, &directory,
 				&index, &previous))
 			if (previous == -1) {
 				printf("/\n");
@@ -575,7 +611,7 @@ void printcluster(fat *f, int32_t cl, fatinverse *rev, int run) {
 				printf("not in a file\n");
 		else {
 			if (useshortnames) {
-				path = fatinversepath(rev,
+				path = fatinversepath(f, rev,
 					directory, index, previous);
 				printf("%s\n", path);
 				free(path);
@@ -640,6 +676,26 @@ int dumpclusters(fat *f, unit *directory, int index, int32_t previous,
 		_dumpclusters, &recur);
 }
 
+/*
+ * number of clusters of a file or a tree; a single file is counted by
+ * following its chain, a tree from the lengths of all chains computed once
+ * from the fat, which pays off only when many chains are counted and also
+ * finds chains that loop
+ */
+int32_t countclusters(fat *f,
+		unit *directory, int index, int32_t previous, int recur) {
+	fatchains *c;
+	int32_t n;
+
+	if (! recur)
+		return fatcountclusters(f, directory, index, previous, 0);
+
+	c = fatchainscreate(f);
+	n = fatcountclusterschains(f, c, directory, index, previous, recur);
+	fatchainsdelete(c);
+	return n;
+}
+
 /*
  * count the number of entries in a directory
  */
@@ -1279,8 +1335,10 @@ int parserange(char *option, int32_t *first, int32_t *last) {
 void usage() {
 	printf("usage:\n\tfattool [-f num] [-l] [-s] [-t] [-n] ");
 	printf("[-m] [-c] [-o offset] [-p num]\n");
-	printf("\t\t[-a first-last] [-v level] [-e simerr.txt] ");
-	printf("device operation [arg...]\n");
+	printf("\t\t[-a first-last] [-v level] [-e simerr.txt] [-j threads] ");
+	printf("[-r inverse]\n");
+	printf("\t\t[-k journal] [-g]\n");
+	printf("\t\tdevice operation [arg...]\n");
 	printf("\t\t-f num\t\tuse the specified file allocation table\n");
 	printf("\t\t-l\t\tload the first FAT in cache immediately\n");
 	printf("\t\t-s\t\tuse shortnames\n");
@@ -1294,6 +1352,10 @@ void usage() {
 	printf("\t\t-a first-last\trange of allocable clusters\n");
 	printf("\t\t-v level\tverbose output\n");
 	printf("\t\t-e simerr.txt\tread simulated errors from file\n");
+	printf("\t\t-j threads\tread directories with many threads\n");
+	printf("\t\t-r inverse\tkeep the inverse FAT in this file\n");
+	printf("\t\t-k journal\tresumable defragment, compact and move\n");
+	printf("\t\t-g\t\tshow the progress of long operations\n");
 	printf("\n\toperations:\n");
 	printf("\t\tsummary\t\tbasic characteristics of the filesystem\n");
 	printf("\t\tgetserial\tget the filesystem serial number\n");
@@ -1318,6 +1380,11 @@ void usage() {
 	printf("\t\tcompact\t\tmove used clusters at the beginning,");
 	printf("\n\t\t\t\tin place of free clusters\n");
 	printf("\t\tdefragment\torder clusters in the filesystem\n");
+	printf("\t\tdirfirst [test]\tmove all directories at the beginning\n");
+	printf("\t\tfragmented [min [budget]] [test]\n");
+	printf("\t\t\t\tdefragment the files with at least min fragments,\n");
+	printf("\t\t\t\tthe most fragmented first, moving at most\n");
+	printf("\t\t\t\tbudget clusters; test: only show them\n");
 	printf("\t\tlast [n]\tset the last known free cluster indicator\n");
 	printf("\t\t\t\tdefault: first data cluster in the filesystem\n");
 	printf("\t\trecompute\tcalculate the number of free clusters\n");
@@ -1370,6 +1437,8 @@ void usage() {
 	printf("\t\t\t\tread content of file to stdout\n");
 	printf("\t\t\t\tchain: dump the entire cluster chain\n");
 	printf("\t\twritefile name\twrite stdin to file\n");
+	printf("\t\textract dest [dir]\n");
+	printf("\t\t\t\tcopy all files to directory dest\n");
 	printf("\t\tdeletefile name [(dir|force) [erase]]\n");
 	printf("\t\t\t\tdelete a file\n");
 	printf("\t\toverwrite name [test]\n\t\t\t\toverwrite the ");
@@ -1432,7 +1501,9 @@ int main(int argn, char *argv[]) {
 	unit *directory, *startdirectory, *longdirectory, *seconddirectory;
 	int index, startindex, longindex, secondindex;
 	unit *cluster;
-	int max, size, csize, pos, ncluster;
+	int max, size, pos, ncluster;
+	int64_t written;
+	struct stat st;
 	uint32_t sector, spos, serial;
 	unsigned long readserial;
 	int res, diff, finalres, recur, chain, all, chains;
@@ -1446,6 +1517,8 @@ int main(int argn, char *argv[]) {
 	fatinverse *rev;
 	char *simerrfile;
 	int dirty;
+	int threads;
+	int progress;
 
 	finalres = 0;
 
@@ -1468,6 +1541,8 @@ int main(int argn, char *argv[]) {
 	clusterdump = 0;
 	debug = 0;
 	simerrfile = NULL;
+	threads = 0;
+	progress = 0;
 	while (argn - 1 >= 1 && argv[1][0] == '-') {
 		switch(argv[1][1]) {
 		case 'o':
@@ -1568,6 +1643,38 @@ int main(int argn, char *argv[]) {
 			fatinversedebug =	debug & 0x0080;
 			fatlongdebug =		debug & 0x0100;
 			fatcomplexdebug =	debug & 0x0200;
+			fatparalleldebug =	debug & 0x0400;
+			break;
+		case 'j':
+			if (argv[1][2] != '\0')
+				threads = atoi(argv[1] + 2);
+			else {
+				threads = atoi(argv[2]);
+				argn--;
+				argv++;
+			}
+			fatinversethreads = threads;
+			break;
+		case 'r':
+			if (argv[1][2] != '\0')
+				fatinversefile = &argv[1][2];
+			else {
+				fatinversefile = argv[2];
+				argn--;
+				argv++;
+			}
+			break;
+		case 'g':
+			progress = 1;
+			break;
+		case 'k':
+			if (argv[1][2] != '\0')
+				fatjournalfile = &argv[1][2];
+			else {
+				fatjournalfile = argv[2];
+				argn--;
+				argv++;
+			}
 			break;
 		case 'h':
 			usage();
@@ -1700,6 +1807,9 @@ int main(int argn, char *argv[]) {
 		exit(1);
 	}
 
+	if (progress)
+		fatprogressregister(f, progressbar, 0, 200);
+
 	r = fatgetrootbegin(f);
 	last = fatlastcluster(f);
 
@@ -1878,6 +1988,53 @@ int main(int argn, char *argv[]) {
 			printf("%d changes %s\n", nchanges,
 				testonly ? "required" : "done");
 	}
+	else if (! strcmp(operation, "dirfirst")) {
+		testonly = ! strcmp(option1, "test");
+
+		if (! testonly) {
+			printf("WARNING: complex operation ");
+			printf("on filesystem %s\n", name);
+			check();
+		}
+
+		fatcomplexdebug = 1;
+		if (fatdirectoriesfirst(f, testonly, &nchanges) ==
+		    FATINTERRUPTIBLEIOERROR) {
+			printf("operation aborted due to IO error\n");
+			printf("check the device for faulty sectors\n");
+		}
+		else if (nchanges == 0)
+			printf("directories already first\n");
+		else
+			printf("%d changes %s\n", nchanges,
+				testonly ? "required" : "done");
+	}
+	else if (! strcmp(operation, "fragmented")) {
+		testonly = ! strcmp(option1, "test") ||
+			   ! strcmp(option2, "test") ||
+			   ! strcmp(option3, "test");
+
+		if (! testonly) {
+			printf("WARNING: complex operation ");
+			printf("on filesystem %s\n", name);
+			check();
+		}
+
+		fatcomplexdebug = 1;
+		if (fatdefragmentselective(f,
+				option1[0] == '\0' ? 2 : atoi(option1),
+				option2[0] == '\0' ? 0 : atoi(option2),
+				testonly, &nchanges) ==
+		    FATINTERRUPTIBLEIOERROR) {
+			printf("operation aborted due to IO error\n");
+			printf("check the device for faulty sectors\n");
+		}
+		else if (nchanges == 0)
+			printf("no fragmented file to move\n");
+		else
+			printf("%d clusters %s\n", nchanges,
+				testonly ? "to move" : "moved");
+	}
 	else if (! strcmp(operation, "last")) {
 		if (fatbits(f) != 32)
 			printf("warning: no effect on FAT%d\n", fatbits(f));
@@ -2142,7 +2299,7 @@ int main(int argn, char *argv[]) {
 			else {
 				printf("creating inverse fat... ");
 				fflush(stdout);
-				rev = fatinversecreate(f, 0);
+				rev = fatinverseopen(f, fatinversefile);
 				printf("done\n");
 				if (rev == NULL) {
 					printf("WARNING: ");
@@ -2365,8 +2522,8 @@ int main(int argn, char *argv[]) {
 		testonly |= ! memcmp(option2, "check", 5);
 
 		size = fatreferenceisvoid(directory, index, previous) ?
-			fatcountclusters(f, NULL, 0, target, recur) - 1:
-			fatcountclusters(f, directory, index, previous, recur);
+			countclusters(f, NULL, 0, target, recur) - 1:
+			countclusters(f, directory, index, previous, recur);
 		printf("number of clusters: %d\n", size);
 
 		if (target == fatgetrootbegin(f))
@@ -2516,18 +2673,28 @@ int main(int argn, char *argv[]) {
 			-1 : ! strcmp(option2, "chain");
 		size = chain || directory == NULL ?
 			0 : fatentrygetsize(directory, index);
-		for (cl = previous > 0 ? previous : target;
-		     cl != FAT_EOF && cl != FAT_UNUSED && cl != FAT_BAD &&
-		     		(size > 0 || chain);
-		     cl = fatgetnextcluster(f, cl)) {
-			cluster = fatclusterread(f, cl);
-			if (cluster == NULL)
-				break;
-			res = write(1, fatunitgetdata(cluster),
-				chain || size > cluster->size ?
-					cluster->size : size);
-			size -= cluster->size;
+		if (fatfilestream(f, f, previous > 0 ? previous : target,
+				chain ? -1 : (int64_t) (uint32_t) size, 1) == -1)
+			finalres = 1;
+	}
+	else if (! strcmp(operation, "extract")) {
+		if (option1[0] == '\0') {
+			printf("missing argument: destination directory\n");
+			exit(1);
 		}
+		if (fileoptiontoreference(f, option2,
+				&directory, &index, &previous, &target)) {
+			printf("not found: %s\n", option2);
+			exit(1);
+		}
+		if (! fatreferenceisboot(directory, index, previous) &&
+		    (! fatreferenceisentry(directory, index, previous) ||
+		     ! fatentryisdirectory(directory, index))) {
+			printf("not a directory: %s\n", option2);
+			exit(1);
+		}
+		if (fatextract(f, target, option1, threads))
+			finalres = 1;
 	}
 	else if (! strcmp(operation, "writefile")) {
 		if (option1[0] == '\0') {
@@ -2551,63 +2718,31 @@ int main(int argn, char *argv[]) {
 			exit(1);
 		}
 
-		startdirectory = directory;
-		startindex = index;
-		cl = 0;
-		size = 0;
 		max = option2[0] == '\0' ? -1 : atoi(option2);
 		printf("max: %d\n", max);
 
-		fatreferencesettarget(f, directory, index, cl, FAT_UNUSED);
-
-		do {
-			next = fatclusterfindfreebetween(f,
-				afirst, alast, -1);
-			printf("next: %d max: %d       \r", next, max);
-			if (next == FAT_ERR) {
-				printf("filesystem full\n");
-				exit(1);
-			}
-
-			if (max == -1) {
-				cluster = fatclustercreate(f, next);
-				if (cluster == NULL)
-					cluster = fatclusterread(f, next);
-				if (cluster == NULL) {
-					printf("error creating cluster %d\n",
-						next);
-					exit(1);
-				}
-
-				csize = cluster->size;
-				res = read(0, fatunitgetdata(cluster), csize);
-
-				if (res > 0) {
-					cluster->dirty = 1;
-					fatunitwriteback(cluster);
-				}
-				fatunitdelete(&f->clusters, cluster->n);
-			}
-			else {
-				csize = fatbytespercluster(f);
-				res = max > csize ? csize : max;
-				max -= res;
-			}
-
-			if (res <= 0)
-				break;
-
-			fatreferencesettarget(f, directory, index, cl, next);
-			fatsetnextcluster(f, next, FAT_EOF);
-
-			fatreferencenext(f, &directory, &index, &cl);
-
-			size += res;
-		} while (res == csize);
+		written = max != -1 ? max :
+			fstat(0, &st) == 0 && S_ISREG(st.st_mode) ?
+				st.st_size : -1;
+		written = fatfilewrite(f, max == -1 ? 0 : -1, written,
+			afirst, alast, &cl);
+		if (written == -2) {
+			printf("filesystem full\n");
+			exit(1);
+		}
+		if (written < 0) {
+			printf("cannot write file %s\n", option1);
+			exit(1);
+		}
+		if (written > UINT32_MAX) {
+			printf("file too large: %" PRId64 " bytes\n", written);
+			fatclusterfreechain(f, cl);
+			exit(1);
+		}
 
-		fatentrysetsize(startdirectory, startindex, size);
-		fatentrysetattributes(startdirectory, startindex, 0x20);
-		printf("\n");
+		fatreferencesettarget(f, directory, index, 0, cl);
+		fatentrysetsize(directory, index, written);
+		fatentrysetattributes(directory, index, 0x20);
 	}
 	else if (! strcmp(operation, "deletefile")) {
 		if (option1[0] == '\0') {
@@ -2922,8 +3057,14 @@ int main(int argn, char *argv[]) {
 			printf("file %s does not exists\n", option1);
 			exit(1);
 		}
-		fatfileexecutelong(f, directory, index, previous, printpath,
-			! strcmp(option2, "dir") ? (void *) 0 : (void *) 1);
+		if (threads > 0 &&
+		    fatreferenceisboot(directory, index, previous))
+			fatwalk(f, r, threads, FAT_WALK_ORDERED, printwalk,
+				! strcmp(option2, "dir") ? (void *) 0 : (void *) 1);
+		else
+			fatfileexecutelong(f, directory, index, previous,
+				printpath,
+				! strcmp(option2, "dir") ? (void *) 0 : (void *) 1);
 	}
 	else if (! strcmp(operation, "mkdir")) {
 		if (option1[0] == '\0') {
@@ -3002,8 +3143,8 @@ int main(int argn, char *argv[]) {
 		}
 		recur = ! strcmp(option2, "recur");
 		size = fatreferenceisvoid(directory, index, previous) ?
-			fatcountclusters(f, NULL, 0, target, recur) :
-			fatcountclusters(f, directory, index, previous, recur);
+			countclusters(f, NULL, 0, target, recur) :
+			countclusters(f, directory, index, previous, recur);
 		printf("%d\n", size);
 	}
 	else if (! strcmp(operation, "filldeleted")) {
@@ -3107,7 +3248,7 @@ int main(int argn, char *argv[]) {
 		}
 	}
 	else if (! strcmp(operation, "inverse")) {
-		rev = fatinversecreate(f, 0);
+		rev = fatinverseopen(f, fatinversefile);
 		if (rev != NULL)
 			printf("inverse fat created\n");
 		else
@@ -3348,18 +3489,9 @@ int main(int argn, char *argv[]) {
 			-1 : ! strcmp(option2, "chain");
 		size = chain || directory == NULL ?
 			0 : fatentrygetsize(directory, index);
-		for (cl = previous > 0 ? previous : target;
-		     cl != FAT_EOF && cl != FAT_UNUSED && cl != FAT_BAD &&
-				(size > 0 || chain);
-		     cl = fatgetnextcluster(f, cl)) {
-			cluster = fatclusterread(cross, cl);
-			if (cluster == NULL)
-				break;
-			res = write(1, fatunitgetdata(cluster),
-				chain || size > cluster->size ?
-					cluster->size : size);
-			size -= cluster->size;
-		}
+		if (fatfilestream(f, cross, previous > 0 ? previous : target,
+				chain ? -1 : (int64_t) (uint32_t) size, 1) == -1)
+			finalres = 1;
 	}
 	else {
 		printf("unknown operation: %s\n", operation);